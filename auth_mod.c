@@ -31,6 +31,10 @@
  * SUCH DAMAGE.
  *
  */
+#include "hassplice.h"
+#if defined(QLDAP_CLUSTER) && defined(HASSPLICE)
+#define _GNU_SOURCE	/* for splice(2) */
+#endif
 #include <sys/types.h>
 #include <unistd.h>
 #include "alloc.h"
@@ -55,6 +59,11 @@
 #include "qldap-cluster.h"
 #include "select.h"
 #include "timeoutconn.h"
+#include <sys/time.h>
+#ifdef HASSPLICE
+#include <fcntl.h>
+#include <sys/epoll.h>
+#endif
 #endif
 #ifdef AUTOHOMEDIRMAKE
 #include "dirmaker.h"
@@ -221,10 +230,20 @@ chdir_or_make(char *home, char *maildir)
 
 #ifdef QLDAP_CLUSTER
 #define COPY_BUF_SIZE	8192
-static void copyloop(int, int, int, int);
+
+struct fwdstat {
+	unsigned long	toserver;	/* bytes client -> server */
+	unsigned long	toclient;	/* bytes server -> client */
+};
+
+static void copyloop(int, int, int, int, struct fwdstat *);
+#ifdef HASSPLICE
+static int spliceloop(int, int, int, int, struct fwdstat *);
+#endif
+static unsigned long msecs(struct timeval *, struct timeval *);
 
 static void
-copyloop(int infdr, int infdw, int outfd, int timeout)
+copyloop(int infdr, int infdw, int outfd, int timeout, struct fwdstat *fs)
 {
 	fd_set	rfds, wfds;
 	struct	timeval tv;
@@ -308,6 +327,7 @@ copyloop(int infdr, int infdw, int outfd, int timeout)
 			if (r != outpos)
 				byte_copy(outbuf, outpos - r, outbuf + r);
 			outpos -= r;
+			fs->toclient += r;
 		}
 		if (FD_ISSET(outfd, &wfds)) {
 			if ((r = subwrite(outfd, inbuf, inpos)) == -1) {
@@ -319,6 +339,7 @@ copyloop(int infdr, int infdw, int outfd, int timeout)
 			if (r != inpos)
 				byte_copy(inbuf, inpos - r, inbuf + r);
 			inpos -= r;
+			fs->toserver += r;
 		}
 
 		if (inok == 0 && inpos == 0)
@@ -338,18 +359,238 @@ copyloop(int infdr, int infdw, int outfd, int timeout)
 	close(outfd);
 }
 
+#ifdef HASSPLICE
+#define SPLICE_SIZE	65536
+
+/*
+ * One direction of a spliced session. The data is moved from the
+ * source fd into a pipe and from there to the destination fd without
+ * ever being copied to user space.
+ */
+struct splicedir {
+	int		from;
+	int		to;
+	int		pfd[2];
+	unsigned int	inpipe;	/* bytes currently buffered in the pipe */
+	int		eof;
+	unsigned long	*bytes;
+};
+
+/*
+ * Update the epoll interest for fd. Fds without interest are removed
+ * from the set, else hangups would be reported over and over again.
+ */
+static int
+splice_watch(int epfd, int fd, int idx, unsigned int *cur, unsigned int want)
+{
+	struct epoll_event ev;
+	int op;
+
+	if (*cur == want)
+		return 0;
+	if (want == 0)
+		op = EPOLL_CTL_DEL;
+	else if (*cur == 0)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+	byte_zero(&ev, sizeof(ev));
+	ev.events = want;
+	ev.data.u32 = idx;
+	if (epoll_ctl(epfd, op, fd, &ev) == -1)
+		return -1;
+	*cur = want;
+	return 0;
+}
+
+/*
+ * Zero-copy version of copyloop(). Returns 1 if the session was
+ * handled, 0 if splice(2) or epoll(7) is not usable for these fds
+ * and nothing was transferred yet so that copyloop() can take over.
+ */
+static int
+spliceloop(int infdr, int infdw, int outfd, int timeout, struct fwdstat *fs)
+{
+	struct	epoll_event ev, evs[3];
+	struct	splicedir d[2];	/* d[0] client -> server, d[1] back */
+	unsigned int	mask[3], ready[3];
+	int	fds[3];
+	int	epfd, i, n, r, moved, fallback = 0;
+
+	/* index into fds[]: d[0] reads fds[0] and writes fds[2] ... */
+	static const int rdidx[2] = { 0, 2 };
+	static const int wridx[2] = { 2, 1 };
+
+	fds[0] = infdr; fds[1] = infdw; fds[2] = outfd;
+	d[0].from = infdr; d[0].to = outfd; d[0].bytes = &fs->toserver;
+	d[1].from = outfd; d[1].to = infdw; d[1].bytes = &fs->toclient;
+	for (i = 0; i < 2; i++) {
+		d[i].inpipe = 0;
+		d[i].eof = 0;
+		d[i].pfd[0] = d[i].pfd[1] = -1;
+	}
+
+	if ((epfd = epoll_create(3)) == -1)
+		return 0;
+	for (i = 0; i < 3; i++) {
+		byte_zero(&ev, sizeof(ev));
+		mask[i] = 0;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev) == -1 ||
+		    epoll_ctl(epfd, EPOLL_CTL_DEL, fds[i], &ev) == -1) {
+			/* e.g. regular files can not be polled */
+			logit(32, "spliceloop: epoll_ctl: %s\n",
+			    error_str(errno));
+			close(epfd);
+			return 0;
+		}
+	}
+	for (i = 0; i < 2; i++)
+		if (pipe(d[i].pfd) == -1) {
+			logit(1, "spliceloop: pipe: %s\n", error_str(errno));
+			fallback = 1;
+			goto done;
+		}
+	for (i = 0; i < 3; i++)
+		ndelay_on(fds[i]);
+
+	while (1) {
+		for (i = 0; i < 3; i++)
+			ready[i] = 0;
+		if (splice_watch(epfd, fds[0], 0, &mask[0],
+		    !d[0].eof && d[0].inpipe < SPLICE_SIZE ? EPOLLIN : 0) ||
+		    splice_watch(epfd, fds[1], 1, &mask[1],
+		    d[1].inpipe != 0 ? EPOLLOUT : 0) ||
+		    splice_watch(epfd, fds[2], 2, &mask[2],
+		    (!d[1].eof && d[1].inpipe < SPLICE_SIZE ? EPOLLIN : 0) |
+		    (d[0].inpipe != 0 ? EPOLLOUT : 0))) {
+			logit(1, "spliceloop: epoll_ctl: %s\n",
+			    error_str(errno));
+			break;
+		}
+
+		n = epoll_wait(epfd, evs, 3, timeout * 1000);
+		if (n == -1) {
+			if (errno == error_intr) continue;
+			logit(1, "spliceloop: epoll_wait: %s\n",
+			    error_str(errno));
+			break;
+		} else if (n == 0) {
+			logit(32, "spliceloop: epoll timeout\n");
+			break;
+		}
+		for (i = 0; i < n; i++)
+			ready[evs[i].data.u32] = evs[i].events;
+
+		for (i = 0; i < 2; i++) {
+			moved = 0;
+			if (!d[i].eof && d[i].inpipe < SPLICE_SIZE &&
+			    ready[rdidx[i]] & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+				r = splice(d[i].from, (loff_t *)0,
+				    d[i].pfd[1], (loff_t *)0,
+				    SPLICE_SIZE - d[i].inpipe,
+				    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (r == -1 && errno == EINVAL &&
+				    fs->toserver == 0 && fs->toclient == 0 &&
+				    d[0].inpipe == 0 && d[1].inpipe == 0) {
+					/* fd type not supported by splice */
+					fallback = 1;
+					goto done;
+				}
+				if (r == -1 && errno != error_intr &&
+				    errno != error_again) {
+					logit(1, "spliceloop: read: %s\n",
+					    error_str(errno));
+					goto done;
+				}
+				if (r == 0)
+					d[i].eof = 1;
+				if (r > 0) {
+					d[i].inpipe += r;
+					moved = 1;
+				}
+			}
+			/* try to pass on fresh data without a poll round */
+			if (d[i].inpipe != 0 && (moved ||
+			    ready[wridx[i]] & (EPOLLOUT | EPOLLERR))) {
+				r = splice(d[i].pfd[0], (loff_t *)0,
+				    d[i].to, (loff_t *)0, d[i].inpipe,
+				    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (r == -1 && errno != error_intr &&
+				    errno != error_again) {
+					logit(1, "spliceloop: write: %s\n",
+					    error_str(errno));
+					goto done;
+				}
+				if (r > 0) {
+					d[i].inpipe -= r;
+					*d[i].bytes += r;
+				}
+			}
+		}
+
+		if (d[0].eof && d[0].inpipe == 0)
+			/* half close forwarding channel */
+			shutdown(outfd, SHUT_WR);
+
+		if (d[1].eof && d[1].inpipe == 0)
+			/* see copyloop(), can not half close the client */
+			break;
+	}
+
+done:
+	close(epfd);
+	for (i = 0; i < 2; i++) {
+		if (d[i].pfd[0] != -1) close(d[i].pfd[0]);
+		if (d[i].pfd[1] != -1) close(d[i].pfd[1]);
+	}
+	if (fallback) {
+		for (i = 0; i < 3; i++)
+			ndelay_off(fds[i]);
+		return 0;
+	}
+	close(infdr);
+	close(infdw);
+	close(outfd);
+	return 1;
+}
+#endif
+
+static unsigned long
+msecs(struct timeval *start, struct timeval *stop)
+{
+	long	ms;
+
+	ms = (stop->tv_sec - start->tv_sec) * 1000 +
+	    (stop->tv_usec - start->tv_usec) / 1000;
+	return ms < 0 ? 0 : (unsigned long)ms;
+}
+
 void
 forward(char *name, char *passwd, struct credentials *c)
 {
+	struct	fwdstat fs;
+	struct	timeval start, established, stop;
 	int	ffd;
 	int	timeout = 31*60; /* ~30 min timeout RFC1730 */
 	
 	/* pop befor smtp */
 	pbsexec();
 
+	fs.toserver = fs.toclient = 0;
+	gettimeofday(&start, (struct timezone *)0);
 	/* We have a connection, first send user and pass */
 	ffd = auth_forward(&c->forwarder, name, passwd);
-	copyloop(0, 1, ffd, timeout);
+	gettimeofday(&established, (struct timezone *)0);
+#ifdef HASSPLICE
+	if (!spliceloop(0, 1, ffd, timeout, &fs))
+#endif
+		copyloop(0, 1, ffd, timeout, &fs);
+	gettimeofday(&stop, (struct timezone *)0);
+
+	logit(8, "forward: %s to %S: setup %u ms, session %u ms, "
+	    "%u bytes to server, %u bytes to client\n", name, &c->forwarder,
+	    msecs(&start, &established), msecs(&established, &stop),
+	    fs.toserver, fs.toclient);
 
 	_exit(0); /* all went ok, exit normaly */
 }
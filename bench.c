@@ -0,0 +1,99 @@
+/*
+ * Helpers shared by the benchmark programs (spawnbench, databench, ...).
+ * None of them are built by default, see 'make spawnbench' and friends.
+ */
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "auto_qmail.h"
+#include "bench.h"
+#include "fd.h"
+#include "fmt.h"
+#include "fork.h"
+#include "str.h"
+#include "stralloc.h"
+#include "strerr.h"
+#include "subfd.h"
+#include "substdio.h"
+
+void
+bench_put(const char *s)
+{
+	substdio_puts(subfdout, s);
+}
+
+void
+bench_putnum(unsigned long u)
+{
+	char num[FMT_ULONG];
+
+	substdio_put(subfdout, num, fmt_ulong(num, u));
+}
+
+void
+bench_flush(void)
+{
+	substdio_flush(subfdout);
+}
+
+void
+bench_usage(const char *usage)
+{
+	strerr_die1x(100, usage);
+}
+
+/* true if argv0 ends in name, used to run a program as its own stub */
+int
+bench_calledas(const char *argv0, const char *name)
+{
+	unsigned int i;
+
+	i = str_rchr(argv0, '/');
+	if (argv0[i] == '/')
+		argv0 += i + 1;
+	return !str_diff(argv0, name);
+}
+
+/* ~qmail/bin/prog in a fresh string */
+const char *
+bench_bin(const char *fatal, const char *prog)
+{
+	stralloc sa = {0};
+
+	if (!stralloc_copys(&sa, auto_qmail) ||
+	    !stralloc_cats(&sa, "/bin/") ||
+	    !stralloc_cats(&sa, prog) ||
+	    !stralloc_0(&sa))
+		strerr_die2x(111, fatal, "out of memory");
+	return sa.s;
+}
+
+/*
+ * Runs args with fd0 as stdin and fd1 as stdout and closes both here.
+ * The other ends of pipes must be close-on-exec.
+ */
+int
+bench_spawn(const char *fatal, char **args, int fd0, int fd1)
+{
+	int pid;
+
+	switch (pid = fork()) {
+	case -1:
+		strerr_die2sys(111, fatal, "unable to fork: ");
+	case 0:
+		if (fd_move(0, fd0) == -1 || fd_move(1, fd1) == -1)
+			_exit(111);
+		execv(*args, args);
+		strerr_die4sys(111, fatal, "unable to run ", *args, ": ");
+	}
+	close(fd0);
+	close(fd1);
+	return pid;
+}
+
+unsigned long
+bench_usecs(struct timeval *t0, struct timeval *t1)
+{
+	return (t1->tv_sec - t0->tv_sec) * 1000000 +
+	    t1->tv_usec - t0->tv_usec;
+}
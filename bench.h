@@ -0,0 +1,15 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <sys/time.h>
+
+extern void bench_put(const char *);
+extern void bench_putnum(unsigned long);
+extern void bench_flush(void);
+extern void bench_usage(const char *);
+extern int bench_calledas(const char *, const char *);
+extern const char *bench_bin(const char *, const char *);
+extern int bench_spawn(const char *, char **, int, int);
+extern unsigned long bench_usecs(struct timeval *, struct timeval *);
+
+#endif
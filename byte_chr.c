@@ -1,20 +1,16 @@
+#include <string.h>
 #include "byte.h"
 
+/* libc memchr() scans a word or vector at a time */
 unsigned int byte_chr(s,n,c)
 const char *s;
 register unsigned int n;
 int c;
 {
-  register char ch;
   register const char *t;
 
-  ch = c;
-  t = s;
-  for (;;) {
-    if (!n) break; if (*t == ch) break; ++t; --n;
-    if (!n) break; if (*t == ch) break; ++t; --n;
-    if (!n) break; if (*t == ch) break; ++t; --n;
-    if (!n) break; if (*t == ch) break; ++t; --n;
-  }
+  if (!n) return 0;
+  t = memchr(s,c,n);
+  if (!t) return n;
   return t - s;
 }
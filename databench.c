@@ -0,0 +1,181 @@
+/*
+ * databench [-n messages] [-s bytes] [-p program]
+ * Runs qmail-smtpd (or -p program) on a pair of pipes and sends it
+ * messages of the given size (by default 10 messages of 10MB) in one
+ * SMTP session. It prints the DATA throughput in MB/s, counted from the
+ * first body byte to the 250 reply, so it measures the body scanning of
+ * qmail-smtpd and the copy to qmail-queue.
+ *
+ * Called as qmail-queue databench is a sink that reads and discards the
+ * message and the envelope. Set QMAILQUEUE (needs -DALTQUEUE) to a
+ * symlink qmail-queue -> databench to keep the disk out of the numbers.
+ */
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "bench.h"
+#include "coe.h"
+#include "env.h"
+#include "getln.h"
+#include "readwrite.h"
+#include "scan.h"
+#include "sgetopt.h"
+#include "sig.h"
+#include "str.h"
+#include "stralloc.h"
+#include "strerr.h"
+#include "substdio.h"
+#include "wait.h"
+
+#define FATAL "databench: fatal: "
+#define USAGE "databench: usage: databench [-n messages] [-s bytes] " \
+    "[-p program]"
+
+unsigned long messages = 10;
+unsigned long size = 10 * 1024 * 1024;
+char *program;
+
+char inbuf[1024];
+char outbuf[8192];
+substdio ssin;
+substdio ssout;
+stralloc reply = {0};
+
+/* 64 lines of 76 base64 characters, never starting with a dot */
+char body[64 * 78];
+
+static int
+sink(void)
+{
+	char buf[8192];
+
+	while (read(0, buf, sizeof(buf)) > 0)
+		;
+	while (read(1, buf, sizeof(buf)) > 0)
+		;
+	return 0;
+}
+
+static void
+say(const char *s)
+{
+	if (substdio_puts(&ssout, s) == -1)
+		strerr_die2sys(111, FATAL, "unable to write: ");
+}
+
+/* reads a possibly multiline reply and checks its code */
+static void
+expect(const char *code)
+{
+	int match;
+
+	if (substdio_flush(&ssout) == -1)
+		strerr_die2sys(111, FATAL, "unable to write: ");
+	do {
+		if (getln(&ssin, &reply, &match, '\n') == -1)
+			strerr_die2sys(111, FATAL, "unable to read: ");
+		if (!match)
+			strerr_die3x(111, FATAL, program, " closed the session");
+		if (reply.len < 4 || str_diffn(reply.s, code, 3)) {
+			if (!stralloc_0(&reply))
+				strerr_die2x(111, FATAL, "out of memory");
+			strerr_die3x(111, FATAL, "unexpected reply: ", reply.s);
+		}
+	} while (reply.s[3] == '-');
+}
+
+int
+main(int argc, char **argv)
+{
+	const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	    "abcdefghijklmnopqrstuvwxyz0123456789+/";
+	struct timeval t0, t1;
+	unsigned long i, left, us;
+	char *args[2];
+	int pi[2], po[2];
+	int pid, wstat, opt;
+
+	if (bench_calledas(argv[0], "qmail-queue"))
+		return sink();
+
+	while ((opt = getopt(argc, argv, "n:s:p:")) != opteof)
+		switch (opt) {
+		case 'n':
+			scan_ulong(optarg, &messages);
+			break;
+		case 's':
+			scan_ulong(optarg, &size);
+			break;
+		case 'p':
+			program = optarg;
+			break;
+		default:
+			bench_usage(USAGE);
+		}
+	size -= size % 78;	/* whole lines only */
+	if (argv[optind] || !messages || !size)
+		bench_usage(USAGE);
+	if (!program)
+		program = (char *)bench_bin(FATAL, "qmail-smtpd");
+	for (i = 0; i < sizeof(body); i++)
+		switch (i % 78) {
+		case 76: body[i] = '\r'; break;
+		case 77: body[i] = '\n'; break;
+		default: body[i] = b64[(i * 7 + i / 78) % 64];
+		}
+	sig_pipeignore();
+	if (!env_get("TCPREMOTEIP"))
+		if (!env_put2("TCPREMOTEIP", "127.0.0.1"))
+			strerr_die2x(111, FATAL, "out of memory");
+	if (!env_get("RELAYCLIENT"))
+		if (!env_put2("RELAYCLIENT", ""))
+			strerr_die2x(111, FATAL, "out of memory");
+
+	if (pipe(pi) == -1 || pipe(po) == -1)
+		strerr_die2sys(111, FATAL, "unable to create pipe: ");
+	coe(pi[1]); coe(po[0]);
+	args[0] = program;
+	args[1] = 0;
+	pid = bench_spawn(FATAL, args, pi[0], po[1]);
+	substdio_fdbuf(&ssin, subread, po[0], inbuf, sizeof(inbuf));
+	substdio_fdbuf(&ssout, subwrite, pi[1], outbuf, sizeof(outbuf));
+
+	expect("220");
+	say("HELO databench\r\n");
+	expect("250");
+
+	us = 0;
+	for (i = 0; i < messages; i++) {
+		say("MAIL FROM:<databench@localhost>\r\n");
+		expect("250");
+		say("RCPT TO:<databench@localhost>\r\n");
+		expect("250");
+		say("DATA\r\n");
+		expect("354");
+		gettimeofday(&t0, (struct timezone *)0);
+		say("Subject: databench\r\n\r\n");
+		for (left = size; left > sizeof(body); left -= sizeof(body))
+			if (substdio_put(&ssout, body, sizeof(body)) == -1)
+				strerr_die2sys(111, FATAL, "unable to write: ");
+		if (substdio_put(&ssout, body, left) == -1)
+			strerr_die2sys(111, FATAL, "unable to write: ");
+		say(".\r\n");
+		expect("250");
+		gettimeofday(&t1, (struct timezone *)0);
+		us += bench_usecs(&t0, &t1);
+	}
+	say("QUIT\r\n");
+	expect("221");
+	close(pi[1]);
+	if (wait_pid(&wstat, pid) == -1)
+		strerr_die2sys(111, FATAL, "unable to wait: ");
+
+	if (!us) us = 1;
+	/* bytes per microsecond are MB/s */
+	bench_putnum(messages); bench_put(" messages of ");
+	bench_putnum(size); bench_put(" bytes in ");
+	bench_putnum(us / 1000); bench_put(" ms, ");
+	bench_putnum(size * messages / us); bench_put(" MB/s\n");
+	bench_flush();
+	return 0;
+}
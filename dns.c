@@ -5,7 +5,11 @@
 #include <arpa/nameser.h>
 #include <resolv.h>
 #include <errno.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 extern int res_query();
+extern int res_mkquery();
 extern int res_search();
 extern int h_errno;
 #include "errno.h"
@@ -17,8 +21,10 @@ extern int h_errno;
 #include "stralloc.h"
 #include "dns.h"
 #include "case.h"
-#ifdef IGNOREVERISIGN
 #include "byte.h"
+#include "select.h"
+#include "readwrite.h"
+#ifdef IGNOREVERISIGN
 #define FUCKVERISIGN 
 #endif
 
@@ -41,12 +47,81 @@ static stralloc glue = {0};
 
 static int (*lookup)() = res_query;
 
+static int (*cachefind)() = 0;
+static void (*cachestore)() = 0;
+
+/* A answers for MX hosts, queried in parallel by prefetch() */
+#define PREFETCH 16
+static struct { stralloc name; unsigned short id; int len; } pf[PREFETCH];
+static unsigned char pfbuf[PREFETCH][PACKETSZ];
+static int numpf = 0;
+
+static int samename(s,t)
+char *s;
+char *t;
+{
+ unsigned char x;
+ unsigned char y;
+
+ for (;;)
+  {
+   x = *s++ - 'A'; if (x <= 'Z' - 'A') x += 'a'; else x += 'A';
+   y = *t++ - 'A'; if (y <= 'Z' - 'A') y += 'a'; else y += 'A';
+   if (x != y) return 0;
+   if (!x) return 1;
+  }
+}
+
+static int prefetched(type)
+int type;
+{
+ int i;
+
+ if (type != T_A) return 0;
+ for (i = 0;i < numpf;++i)
+   if ((pf[i].len > 0) && samename(pf[i].name.s,glue.s))
+    {
+     byte_copy(response.buf,pf[i].len,pfbuf[i]);
+     return pf[i].len;
+    }
+ return 0;
+}
+
+static unsigned long minttl()
+{
+ unsigned char *pos;
+ unsigned long ttl;
+ unsigned long t;
+ unsigned short rrdlen;
+ int n;
+ int i;
+
+ pos = responsepos;
+ ttl = 0;
+ for (n = 0;n < numanswers;++n)
+  {
+   i = dn_expand(response.buf,responseend,pos,name,MAXDNAME);
+   if (i < 0) return 0;
+   pos += i;
+   if (responseend - pos < 10) return 0;
+   t = ((unsigned long) pos[4] << 24) + ((unsigned long) pos[5] << 16) +
+       ((unsigned long) pos[6] << 8) + (unsigned long) pos[7];
+   rrdlen = getshort(pos + 8);
+   pos += 10;
+   if (responseend - pos < rrdlen) return 0;
+   pos += rrdlen;
+   if (!n || (t < ttl)) ttl = t;
+  }
+ return ttl;
+}
+
 static int resolve(domain,type)
 stralloc *domain;
 int type;
 {
  int n;
  int i;
+ int flagcache;
 
  errno = 0;
  if (!stralloc_copy(&glue,domain)) return DNS_MEM;
@@ -57,19 +132,29 @@ int type;
   else return DNS_MEM;
  }
  
- responselen = lookup(glue.s,C_IN,type,response.buf,responsebuflen);
- if ((responselen >= responsebuflen) ||
-     (responselen > 0 && (((HEADER *)response.buf)->tc)))
+ flagcache = cachestore && (lookup == res_query);
+ responselen = prefetched(type);
+ if (!responselen && flagcache)
   {
-   if (responsebuflen < 65536) {
-    if (alloc_re((char **)&response.buf, responsebuflen, 65536))
-     responsebuflen = 65536;
-    else return DNS_MEM;
-    saveresoptions = _res.options;
-    _res.options |= RES_USEVC;
-    responselen = lookup(glue.s,C_IN,type,response.buf,responsebuflen);
-    _res.options = saveresoptions;
-   }
+   responselen = cachefind(glue.s,type,response.buf,responsebuflen);
+   if (responselen > 0) flagcache = 0;
+  }
+ if (responselen <= 0)
+  {
+   responselen = lookup(glue.s,C_IN,type,response.buf,responsebuflen);
+   if ((responselen >= responsebuflen) ||
+       (responselen > 0 && (((HEADER *)response.buf)->tc)))
+    {
+     if (responsebuflen < 65536) {
+      if (alloc_re((char **)&response.buf, responsebuflen, 65536))
+       responsebuflen = 65536;
+      else return DNS_MEM;
+      saveresoptions = _res.options;
+      _res.options |= RES_USEVC;
+      responselen = lookup(glue.s,C_IN,type,response.buf,responsebuflen);
+      _res.options = saveresoptions;
+     }
+    }
   }
  if (responselen <= 0)
   {
@@ -90,6 +175,8 @@ int type;
    responsepos += QFIXEDSZ;
   }
  numanswers = ntohs(((HEADER *)response.buf)->ancount);
+ if (flagcache && (numanswers > 0))
+   cachestore(glue.s,type,response.buf,responselen,minttl());
  return 0;
 }
 
@@ -202,6 +289,14 @@ int wanttype;
  return 0;
 }
 
+void dns_setcache(find,store)
+int (*find)();
+void (*store)();
+{
+ cachefind = find;
+ cachestore = store;
+}
+
 void dns_init(flagsearch)
 int flagsearch;
 {
@@ -374,13 +469,99 @@ stralloc *sa;
  return dns_ipplus(ia,sa,0);
 }
 
+struct mx { stralloc sa; unsigned short p; };
+
+/* send the A queries for all MX hosts at once over one UDP socket and
+   keep the answers for resolve(); anything that does not come back in
+   time, is truncated or is not a plain answer is left to the regular
+   resolver lookup */
+static void prefetch(mx,nummx)
+struct mx *mx;
+int nummx;
+{
+ unsigned char query[PACKETSZ];
+ unsigned char buf[PACKETSZ];
+ struct ip_address dummy;
+ struct timeval tv;
+ fd_set rfds;
+ HEADER *hp;
+ time_t deadline;
+ time_t t;
+ int pending;
+ int len;
+ int fd;
+ int i;
+ int j;
+
+ numpf = 0;
+ if (lookup != res_query) return;
+ if (!(_res.options & RES_INIT)) if (res_init() == -1) return;
+ if (_res.nscount <= 0) return;
+ fd = socket(AF_INET,SOCK_DGRAM,0);
+ if (fd == -1) return;
+ if (connect(fd,(struct sockaddr *) &_res.nsaddr_list[0],
+     sizeof(_res.nsaddr_list[0])) == -1) { close(fd); return; }
+
+ pending = 0;
+ for (i = 0;(i < nummx) && (numpf < PREFETCH);++i)
+  {
+   if (!stralloc_copy(&pf[numpf].name,&mx[i].sa)) break;
+   if (!stralloc_0(&pf[numpf].name)) break;
+   if (!pf[numpf].name.s[0]) continue;
+   if (!pf[numpf].name.s[ip_scan(pf[numpf].name.s,&dummy)]) continue;
+   if (!pf[numpf].name.s[ip_scanbracket(pf[numpf].name.s,&dummy)]) continue;
+   for (j = 0;j < numpf;++j)
+     if (samename(pf[j].name.s,pf[numpf].name.s)) break;
+   if (j < numpf) continue;
+   if (cachefind && cachefind(pf[numpf].name.s,T_A,buf,sizeof(buf)) > 0)
+     continue;
+   len = res_mkquery(QUERY,pf[numpf].name.s,C_IN,T_A,(unsigned char *) 0,0,
+       (unsigned char *) 0,query,sizeof(query));
+   if (len <= 0) continue;
+   if (write(fd,query,len) != len) continue;
+   pf[numpf].id = getshort(query);
+   pf[numpf].len = 0;
+   ++numpf;
+   ++pending;
+  }
+
+ t = time((time_t *) 0);
+ deadline = t + (_res.retrans > 0 ? _res.retrans : 5);
+ while ((pending > 0) && (t < deadline))
+  {
+   FD_ZERO(&rfds);
+   FD_SET(fd,&rfds);
+   tv.tv_sec = deadline - t;
+   tv.tv_usec = 0;
+   if (select(fd + 1,&rfds,(fd_set *) 0,(fd_set *) 0,&tv) <= 0) break;
+   t = time((time_t *) 0);
+   len = read(fd,buf,sizeof(buf));
+   if (len < (int) sizeof(HEADER)) continue;
+   hp = (HEADER *) buf;
+   for (j = 0;j < numpf;++j)
+     if (!pf[j].len && (pf[j].id == getshort(buf))) break;
+   if (j == numpf) continue;
+   if ((ntohs(hp->qdcount) != 1) ||
+       (dn_expand(buf,buf + len,buf + sizeof(HEADER),name,MAXDNAME) < 0) ||
+       !samename(name,pf[j].name.s))
+     continue;
+   --pending;
+   pf[j].len = -1;
+   if (!hp->qr || hp->tc || (hp->rcode != NOERROR) || !hp->ancount)
+     continue;
+   byte_copy(pfbuf[j],len,buf);
+   pf[j].len = len;
+  }
+ close(fd);
+}
+
 int dns_mxip(ia,sa,random)
 ipalloc *ia;
 stralloc *sa;
 unsigned long random;
 {
  int r;
- struct mx { stralloc sa; unsigned short p; } *mx;
+ struct mx *mx;
  struct ip_mx ix;
  int nummx;
  int i;
@@ -430,6 +611,7 @@ unsigned long random;
 
  if (!nummx) return dns_ip(ia,sa); /* e.g., CNAME -> A */
 
+ prefetch(mx,nummx);
  flagsoft = 0;
  while (nummx > 0)
   {
@@ -462,5 +644,6 @@ unsigned long random;
   }
 
  alloc_free(mx);
+ numpf = 0;
  return flagsoft;
 }
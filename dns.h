@@ -10,6 +10,8 @@
 #define DNS_MEM -3
 
 void dns_init(int);
+void dns_setcache(int (*)(const char *, int, unsigned char *, int),
+    void (*)(const char *, int, const unsigned char *, int, unsigned long));
 int dns_cname(stralloc *);
 int dns_mxip(ipalloc *, stralloc *, unsigned long);
 int dns_ip(ipalloc *, stralloc *);
@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2000-2004 Claudio Jeker,
+ *      Internet Business Solutions AG, CH-8005 Zrich, Switzerland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Internet Business
+ *      Solutions AG and its contributors.
+ * 4. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "byte.h"
+#include "case.h"
+#include "datetime.h"
+#include "dns.h"
+#include "dnscache.h"
+#include "lock.h"
+#include "now.h"
+#include "open.h"
+#include "readwrite.h"
+#include "seek.h"
+#include "str.h"
+
+/*
+ * Shared cache of raw DNS responses for qmail-remote. The file is
+ * direct mapped: a query lands in exactly one slot chosen by a hash
+ * of name and type, a newer answer simply overwrites the old one.
+ * Like queue/lock/tcpto the file is accessed with plain read and
+ * write under an exclusive lock so all qmail-remote processes share
+ * the same view.
+ */
+
+static int fdr = -1;
+static int fdw = -1;
+static unsigned int numslots;
+static unsigned long maxttl;
+static char slot[DNSCACHE_SLOT];
+
+static unsigned int
+dnscache_hash(const char *name, unsigned int len, int type)
+{
+	unsigned long h;
+	unsigned int i;
+	unsigned char c;
+
+	h = 5381;
+	for (i = 0; i < len; i++) {
+		c = name[i];
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		h = (h << 5) + h;
+		h ^= c;
+	}
+	h = (h << 5) + h;
+	h ^= (unsigned long)type;
+	return h % numslots;
+}
+
+static int
+dnscache_rw(int fd, unsigned int n, int flagwrite)
+{
+	unsigned int pos;
+	int r;
+
+	if (seek_set(fd, (seek_pos)n * DNSCACHE_SLOT) == -1)
+		return -1;
+	for (pos = 0; pos < DNSCACHE_SLOT; pos += r) {
+		if (flagwrite)
+			r = write(fd, slot + pos, DNSCACHE_SLOT - pos);
+		else
+			r = read(fd, slot + pos, DNSCACHE_SLOT - pos);
+		if (r <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+int
+dnscache_init(const char *fn, unsigned long ttl)
+{
+	struct stat st;
+
+	if (fdr != -1) {
+		close(fdr);
+		close(fdw);
+		fdr = fdw = -1;
+	}
+	if (ttl == 0)
+		return 0;
+	if ((fdw = open_write(fn)) == -1)
+		return -1;
+	if ((fdr = open_read(fn)) == -1 || fstat(fdr, &st) == -1 ||
+	    st.st_size < DNSCACHE_SLOT) {
+		if (fdr != -1)
+			close(fdr);
+		close(fdw);
+		fdr = fdw = -1;
+		return -1;
+	}
+	numslots = st.st_size / DNSCACHE_SLOT;
+	maxttl = ttl;
+	dns_setcache(dnscache_find, dnscache_store);
+	return 0;
+}
+
+int
+dnscache_find(const char *name, int type, unsigned char *buf, int buflen)
+{
+	datetime_sec expire;
+	unsigned int len, n;
+	int r;
+
+	if (fdr == -1)
+		return 0;
+	len = str_len(name);
+	if (len == 0 || len >= DNSCACHE_NAME)
+		return 0;
+	n = dnscache_hash(name, len, type);
+
+	if (lock_ex(fdw) == -1)
+		return 0;
+	r = dnscache_rw(fdr, n, 0);
+	lock_un(fdw);
+	if (r == -1)
+		return 0;
+
+	expire = (unsigned char)slot[3];
+	expire = (expire << 8) + (unsigned char)slot[2];
+	expire = (expire << 8) + (unsigned char)slot[1];
+	expire = (expire << 8) + (unsigned char)slot[0];
+	if (expire <= now())
+		return 0;
+	if ((unsigned char)slot[4] != ((type >> 8) & 0xff) ||
+	    (unsigned char)slot[5] != (type & 0xff))
+		return 0;
+	if (slot[8 + len] != '\0' || case_diffb(slot + 8, len, name))
+		return 0;
+	r = ((unsigned char)slot[6] << 8) + (unsigned char)slot[7];
+	if (r <= 0 || r > DNSCACHE_DATA || r > buflen)
+		return 0;
+	byte_copy(buf, r, slot + 8 + DNSCACHE_NAME);
+	return r;
+}
+
+void
+dnscache_store(const char *name, int type, const unsigned char *buf,
+    int buflen, unsigned long ttl)
+{
+	datetime_sec expire;
+	unsigned int len, n;
+
+	if (fdw == -1)
+		return;
+	len = str_len(name);
+	if (len == 0 || len >= DNSCACHE_NAME)
+		return;
+	if (buflen <= 0 || buflen > DNSCACHE_DATA || ttl == 0)
+		return;
+	if (ttl > maxttl)
+		ttl = maxttl;
+	n = dnscache_hash(name, len, type);
+
+	expire = now() + ttl;
+	byte_zero(slot, sizeof(slot));
+	slot[0] = expire & 0xff;
+	slot[1] = (expire >> 8) & 0xff;
+	slot[2] = (expire >> 16) & 0xff;
+	slot[3] = (expire >> 24) & 0xff;
+	slot[4] = (type >> 8) & 0xff;
+	slot[5] = type & 0xff;
+	slot[6] = (buflen >> 8) & 0xff;
+	slot[7] = buflen & 0xff;
+	byte_copy(slot + 8, len, name);
+	case_lowerb(slot + 8, len);
+	byte_copy(slot + 8 + DNSCACHE_NAME, buflen, buf);
+
+	if (lock_ex(fdw) == -1)
+		return;
+	dnscache_rw(fdw, n, 1);
+	lock_un(fdw);
+}
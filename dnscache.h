@@ -0,0 +1,19 @@
+#ifndef DNSCACHE_H
+#define DNSCACHE_H
+
+/*
+ * The cache file is an array of DNSCACHE_SLOT sized records. Each
+ * record holds the expire time, the query type, the length of the
+ * response, the lower-cased query name and the raw response packet.
+ */
+#define DNSCACHE_SLOT	1024
+#define DNSCACHE_NAME	256
+#define DNSCACHE_DATA	(DNSCACHE_SLOT - 8 - DNSCACHE_NAME)
+#define DNSCACHE_SIZE	(256 * DNSCACHE_SLOT)
+
+extern int dnscache_init(const char *, unsigned long);
+extern int dnscache_find(const char *, int, unsigned char *, int);
+extern void dnscache_store(const char *, int, const unsigned char *, int,
+    unsigned long);
+
+#endif
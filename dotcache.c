@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2000-2004 Claudio Jeker,
+ *      Internet Business Solutions AG, CH-8005 Zrich, Switzerland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Internet Business
+ *      Solutions AG and its contributors.
+ * 4. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "byte.h"
+#include "constmap.h"
+#include "direntry.h"
+#include "error.h"
+#include "fmt.h"
+#include "hasmtim.h"
+#include "open.h"
+#include "slurpclose.h"
+#include "str.h"
+#include "stralloc.h"
+
+#include "dotcache.h"
+
+/*
+ * The cache holds the names of all .qmail files in the home directory
+ * preceded by the mtime of the directory at the time it was read, with
+ * nanoseconds where the system has them. Creating, removing or renaming
+ * a .qmail file changes that mtime, so if it still matches the list is
+ * complete. Neither contents nor modes are cached, a listed file is
+ * still opened and checked by qmail-local. The list is kept in a
+ * subdirectory so that replacing it does not change the mtime of the
+ * home directory itself.
+ */
+
+static stralloc names = {0};
+static stralloc tmpname = {0};
+static struct constmap map;
+static int flagcache = 0;
+
+static unsigned int
+dotcache_key(char *s, struct stat *st)
+{
+	unsigned int len;
+
+	len = fmt_ulong(s, (unsigned long)st->st_mtime);
+#ifdef HASMTIM
+	s[len++] = '.';
+	len += fmt_ulong(s + len, (unsigned long)st->st_mtim.tv_nsec);
+#endif
+	return len;
+}
+
+/* true if a was modified strictly after b */
+static int
+dotcache_newer(struct stat *a, struct stat *b)
+{
+	if (a->st_mtime != b->st_mtime)
+		return a->st_mtime > b->st_mtime;
+#ifdef HASMTIM
+	return a->st_mtim.tv_nsec > b->st_mtim.tv_nsec;
+#else
+	return 0;
+#endif
+}
+
+static int
+dotcache_scan(const char *key, unsigned int keylen)
+{
+	DIR *dirp;
+	direntry *dp;
+
+	if (!stralloc_copyb(&names, key, keylen)) return -1;
+	if (!stralloc_0(&names)) return -1;
+	dirp = opendir(".");
+	if (dirp == 0) return -1;
+	while ((dp = readdir(dirp)) != 0) {
+		if (str_diffn(dp->d_name, ".qmail", 6)) continue;
+		if (!stralloc_cats(&names, dp->d_name) ||
+		    !stralloc_0(&names)) {
+			closedir(dirp);
+			return -1;
+		}
+	}
+	closedir(dirp);
+	return 0;
+}
+
+/* creates the temporary list file, st gets its mtime */
+static int
+dotcache_tmp(struct stat *st)
+{
+	char num[FMT_ULONG];
+	int fd;
+
+	if (mkdir(DOTCACHE_DIR, 0700) == -1 && errno != error_exist)
+		return -1;
+	if (!stralloc_copys(&tmpname, DOTCACHE_FILE)) return -1;
+	if (!stralloc_cats(&tmpname, ".")) return -1;
+	if (!stralloc_catb(&tmpname, num, fmt_ulong(num, getpid())))
+		return -1;
+	if (!stralloc_0(&tmpname)) return -1;
+
+	fd = open_trunc(tmpname.s);
+	if (fd == -1) return -1;
+	if (fstat(fd, st) == -1) {
+		close(fd);
+		unlink(tmpname.s);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+dotcache_save(int fd, int flagsave)
+{
+	if (!flagsave ||
+	    write(fd, names.s, names.len) != (ssize_t)names.len) {
+		close(fd);
+		unlink(tmpname.s);
+		return;
+	}
+	if (close(fd) == -1 || rename(tmpname.s, DOTCACHE_FILE) == -1)
+		unlink(tmpname.s);
+}
+
+void
+dotcache_init(void)
+{
+	char key[FMT_ULONG * 2 + 1];
+	struct stat st;
+	struct stat sttmp;
+	unsigned int keylen;
+	unsigned int i;
+	int fd;
+
+	if (stat(".", &st) == -1) return;
+	keylen = dotcache_key(key, &st);
+
+	fd = open_read(DOTCACHE_FILE);
+	if (fd != -1) {
+		if (!stralloc_copys(&names, "")) {
+			close(fd);
+			return;
+		}
+		if (slurpclose(fd, &names, 1024) == -1) return;
+		i = byte_chr(names.s, names.len, '\0');
+		if (i < names.len && i == keylen &&
+		    byte_equal(names.s, keylen, key))
+			goto found;
+	}
+
+	/*
+	 * Missing or stale, read the directory once. A change in the same
+	 * clock tick as the directory mtime would not show up, and on NFS
+	 * that clock is the server's. So the temporary list file is created
+	 * first: every change after the stat below gets at least its mtime,
+	 * and the list is only saved if that is strictly newer than the
+	 * directory.
+	 */
+	fd = dotcache_tmp(&sttmp);
+	if (stat(".", &st) == -1) goto fail;
+	keylen = dotcache_key(key, &st);
+	if (dotcache_scan(key, keylen) == -1) goto fail;
+	if (fd != -1)
+		dotcache_save(fd, dotcache_newer(&sttmp, &st));
+	i = byte_chr(names.s, names.len, '\0');
+
+found:
+	if (!constmap_init(&map, names.s + i + 1, names.len - i - 1, 0))
+		return;
+	flagcache = 1;
+	return;
+
+fail:
+	if (fd != -1) {
+		close(fd);
+		unlink(tmpname.s);
+	}
+}
+
+int
+dotcache_has(const char *name)
+{
+	if (!flagcache) return 1;
+	/* only the home directory itself is listed */
+	if (name[str_chr(name, '/')]) return 1;
+	return constmap(&map, name, str_len(name)) != 0;
+}
@@ -0,0 +1,13 @@
+#ifndef __DOTCACHE_H__
+#define __DOTCACHE_H__
+
+/* list of the .qmail files in the home directory, kept by qmail-local */
+#define DOTCACHE_DIR	".qmail.cache"
+#define DOTCACHE_FILE	".qmail.cache/names"
+
+void dotcache_init(void);
+
+/* returns false if the named .qmail file can not exist */
+int dotcache_has(const char *);
+
+#endif
@@ -37,11 +37,14 @@
  */
 
 #ifdef SMTPEXECCHECK
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "byte.h"
 #include "case.h"
 #include "control.h"
 #include "env.h"
 #include "qmail.h"
+#include "sigdfa.h"
 #include "str.h"
 #include "stralloc.h"
 
@@ -53,6 +56,38 @@ extern void die_control();
 static int checkexecutable = 0;
 static int flagexecutable;
 static stralloc signatures = {0};
+static struct sigdfa sigdfa;
+static int flagsigdfa;
+
+/*
+ * Use control/signatures.dfa if it is at least as new as
+ * control/signatures (the same test make uses), else compile the
+ * signatures here. If the automaton gets too big the signatures
+ * are matched one by one like before.
+ */
+static void
+signatures_setup(void)
+{
+	struct stat stsig, stdfa;
+
+	if (stat("control/signatures", &stsig) == 0 &&
+	    stat("control/signatures.dfa", &stdfa) == 0 &&
+	    stdfa.st_mtime >= stsig.st_mtime &&
+	    sigdfa_load(&sigdfa, "control/signatures.dfa") == 0) {
+		flagsigdfa = 1;
+		return;
+	}
+	switch (sigdfa_compile(&sigdfa, signatures.s, signatures.len)) {
+	case 0:
+		flagsigdfa = 1;
+		break;
+	case -1:
+		die_nomem();
+	default:
+		flagsigdfa = 0;
+		break;
+	}
+}
 
 void
 execcheck_setup(void)
@@ -67,6 +102,8 @@ execcheck_setup(void)
 	default:
 		die_control();
 	}
+	if (checkexecutable)
+		signatures_setup();
 }
 
 int
@@ -98,6 +135,8 @@ signatures_check(stralloc *line)
 {
 	unsigned int	i, j;
 
+	if (flagsigdfa)
+		return sigdfa_match(&sigdfa, line->s, line->len);
 	for (i = j = 0; i < signatures.len; i++)
 		if (!signatures.s[i]) {
 			if (signatures_match(line, signatures.s + j))
@@ -115,6 +154,7 @@ static unsigned int boundary_start;
 static unsigned int boundary_len;
 static int flagrfc822;
 static char linetype;
+static int flagskipline;	/* in a body line that can't be a boundary */
 
 static stralloc line = {0};
 static stralloc content = {0};
@@ -218,26 +258,13 @@ execcheck_start(void)
 	boundary_len = 0;
 	flagexecutable = 0;
 	flagrfc822 = 0;
+	flagskipline = 0;
 	linetype = ' ';
 }
 
-void
-execcheck_put(struct qmail *qq, const char *ch)
+static void
+execcheck_line(struct qmail *qq)
 {
-	if (!checkexecutable)
-		return;
-
-	/* already bad so leave it */
-	if (flagexecutable)
-		return;
-
-	if (line.len < 1024)
-		if (!stralloc_catb(&line,ch,1)) die_nomem();
-
-	if (*ch != '\n')
-		/* wait until we have a entire line together */
-		return;
-
 	if (linespastheader == 0) {
 		/*
 		 * in mail or mime header, search for content-type
@@ -306,5 +333,51 @@ execcheck_put(struct qmail *qq, const char *ch)
 	line.len = 0;
 }
 
+void
+execcheck_putb(struct qmail *qq, const char *buf, unsigned int len)
+{
+	unsigned int n, m;
+
+	if (!checkexecutable)
+		return;
+
+	while (len > 0) {
+		/* already bad so leave it */
+		if (flagexecutable)
+			return;
+		/* past the last boundary nothing can change anymore */
+		if (linespastheader == 2 && boundary_len == 0)
+			return;
+
+		if (linespastheader == 2 && line.len == 0 &&
+		    (flagskipline || *buf != '-')) {
+			/* no need to collect lines that are not looked at */
+			n = byte_chr(buf, len, '\n');
+			flagskipline = n == len;
+			if (n < len)
+				n++;
+			buf += n;
+			len -= n;
+			continue;
+		}
+
+		n = byte_chr(buf, len, '\n');
+		if (n < len)
+			n++;
+		m = n;
+		if (line.len >= 1024)
+			m = 0;
+		else if (line.len + m > 1024)
+			m = 1024 - line.len;
+		if (!stralloc_catb(&line, buf, m)) die_nomem();
+		buf += n;
+		len -= n;
+
+		if (buf[-1] == '\n')
+			/* got an entire line together */
+			execcheck_line(qq);
+	}
+}
+
 #endif
 
@@ -40,6 +40,6 @@ void execcheck_setup(void);
 void execcheck_start(void);
 int execcheck_on(void);
 int execcheck_flag(void);
-void execcheck_put(struct qmail *, const char *);
+void execcheck_putb(struct qmail *, const char *, unsigned int);
 
 #endif
@@ -105,6 +105,7 @@ void hier()
   d(auto_qmail_inst,"queue/todo",auto_uidq,auto_gidq,0750);
 #endif
   d(auto_qmail_inst,"queue/bounce",auto_uids,auto_gidq,0700);
+  d(auto_qmail_inst,"queue/state",auto_uids,auto_gidq,0700);
 
   dsplit("queue/mess",auto_uidq,0750);
   dsplit("queue/info",auto_uids,0700);
@@ -117,6 +118,8 @@ void hier()
 
   d(auto_qmail_inst,"queue/lock",auto_uidq,auto_gidq,0750);
   z(auto_qmail_inst,"queue/lock/tcpto",1024,auto_uidr,auto_gidq,0644);
+  z(auto_qmail_inst,"queue/lock/dnscache",262144,auto_uidr,auto_gidq,0644);
+  d(auto_qmail_inst,"queue/lock/qmtp",auto_uidr,auto_gidq,0700);
   z(auto_qmail_inst,"queue/lock/sendmutex",0,auto_uids,auto_gidq,0600);
   p(auto_qmail_inst,"queue/lock/trigger",auto_uids,auto_gidq,0622);
 
@@ -240,6 +243,7 @@ void hier()
   c(auto_qmail_inst,"bin","qmail-verify",auto_uido,auto_gidq,0755);
   c(auto_qmail_inst,"bin","qmail-ldaplookup",auto_uido,0,0750);
   c(auto_qmail_inst,"bin","qmail-cdb",auto_uido,auto_gidq,0700);
+  c(auto_qmail_inst,"bin","qmail-sigdfa",auto_uido,auto_gidq,0700);
   c(auto_qmail_inst,"bin","digest",auto_uido,auto_gidq,0755);
   c(auto_qmail_inst,"bin","pbsadd",auto_uido,auto_gidq,0755);
   c(auto_qmail_inst,"bin","pbscheck",auto_uido,auto_gidq,0755);
@@ -247,6 +251,8 @@ void hier()
   c(auto_qmail_inst,"bin","qmail-forward",auto_uido,auto_gidq,0755);
   c(auto_qmail_inst,"bin","qmail-secretary",auto_uido,auto_gidq,0755);
   c(auto_qmail_inst,"bin","qmail-group",auto_uido,auto_gidq,0755);
+  c(auto_qmail_inst,"bin","qmail-queued",auto_uido,auto_gidq,0711);
+  c(auto_qmail_inst,"bin","qmail-queuec",auto_uidq,auto_gidq,04711);
   
   c(auto_qmail_inst,"man/man5","addresses.5",auto_uido,auto_gidq,0644);
   c(auto_qmail_inst,"man/cat5","addresses.0",auto_uido,auto_gidq,0644);
@@ -37,6 +37,9 @@
 #include "localdelivery.h"
 
 static int	flaglocaldelivery;
+static int	flaglocaltiming;
+static int	localparallelmax;
+static int	flaglocaldotcache;
 
 int
 localdelivery_init(void)
@@ -47,6 +50,22 @@ localdelivery_init(void)
 		    "control/ldaplocaldelivery") == -1)
 		return -1;
 	logit(64, "init: control/ldaplocaldelivery: %i\n", flaglocaldelivery);
+
+	flaglocaltiming = 0;	/* no timing trailer (DEFAULT) */
+	if (control_readint(&flaglocaltiming, "control/localtiming") == -1)
+		return -1;
+	logit(64, "init: control/localtiming: %i\n", flaglocaltiming);
+
+	localparallelmax = 1;	/* one program at a time (DEFAULT) */
+	if (control_readint(&localparallelmax, "control/localparallel") == -1)
+		return -1;
+	logit(64, "init: control/localparallel: %i\n", localparallelmax);
+
+	flaglocaldotcache = 0;	/* no .qmail name cache (DEFAULT) */
+	if (control_readint(&flaglocaldotcache,
+		    "control/localdotcache") == -1)
+		return -1;
+	logit(64, "init: control/localdotcache: %i\n", flaglocaldotcache);
 	return 0;
 }
 
@@ -56,3 +75,20 @@ localdelivery(void)
 	return flaglocaldelivery;
 }
 
+int
+localtiming(void)
+{
+	return flaglocaltiming;
+}
+
+int
+localparallel(void)
+{
+	return localparallelmax;
+}
+
+int
+localdotcache(void)
+{
+	return flaglocaldotcache;
+}
@@ -39,5 +39,14 @@ int localdelivery_init(void);
 /* returns true if localdelivery is on */
 int localdelivery(void);
 
+/* returns true if qmail-local should report per phase timings */
+int localtiming(void);
+
+/* returns how many program deliveries qmail-local may run at once */
+int localparallel(void);
+
+/* returns true if qmail-local should cache the .qmail names per home */
+int localdotcache(void);
+
 #endif
 
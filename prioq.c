@@ -56,3 +56,25 @@ prioq *pq;
  pq->p[i] = pq->p[n];
  pq->len = n;
 }
+
+/* move element i up to its place after its dt was lowered to dt */
+void prioq_decrease(pq,i,dt)
+prioq *pq;
+unsigned int i;
+datetime_sec dt;
+{
+ struct prioq_elt pe;
+ unsigned int j;
+ if (i >= pq->len) return;
+ if (pq->p[i].dt <= dt) return;
+ pe = pq->p[i];
+ pe.dt = dt;
+ while (i)
+  {
+   j = (i - 1)/2;
+   if (pq->p[j].dt <= pe.dt) break;
+   pq->p[i] = pq->p[j];
+   i = j;
+  }
+ pq->p[i] = pe;
+}
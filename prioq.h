@@ -11,5 +11,6 @@ GEN_ALLOC_typedef(prioq,struct prioq_elt,p,len,a)
 extern int prioq_insert(prioq *, struct prioq_elt *);
 extern int prioq_min(prioq *, struct prioq_elt *);
 extern void prioq_delmin(prioq *);
+extern void prioq_decrease(prioq *, unsigned int, datetime_sec);
 
 #endif
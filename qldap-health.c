@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2000-2004 Claudio Jeker,
+ *      Internet Business Solutions AG, CH-8005 Zrich, Switzerland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Internet Business
+ *      Solutions AG and its contributors.
+ * 4. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "qldap-debug.h"
+#include "qldap-health.h"
+#include "uint32.h"
+
+/*
+ * Shared LDAP server health table. The table is a small file mapped
+ * shared into every process using the qldap library. Updates are done
+ * without locking, a lost update only results in a suboptimal server
+ * order for a while.
+ */
+
+#define HEALTH_RECORDS	64
+
+struct health {
+	uint32	hash;		/* hash of the server name, 0 if unused */
+	uint32	fails;		/* number of consecutive failures */
+	uint32	when;		/* time of last failure or probe */
+	uint32	latency;	/* smoothed connect and bind time in msec */
+};
+
+static struct health	*table = 0;
+
+static uint32
+health_hash(const char *s)
+{
+	uint32 h;
+
+	h = 5381;
+	while (*s)
+		h = ((h << 5) + h) ^ (unsigned char)*s++;
+	return h == 0 ? 1 : h;
+}
+
+static struct health *
+health_find(uint32 h)
+{
+	int i;
+
+	for (i = 0; i < HEALTH_RECORDS; i++)
+		if (table[i].hash == h)
+			return &table[i];
+	return (struct health *)0;
+}
+
+static uint32
+health_backoff(uint32 fails)
+{
+	uint32 secs;
+
+	/* 15 secs after the first failure doubling up to 10 minutes */
+	if (fails > 7) fails = 7;
+	secs = (15 << (fails - 1)) + (getpid() & 15);
+	return secs > 600 ? 600 : secs;
+}
+
+int
+health_init(const char *file)
+{
+	struct	stat st;
+	void	*p;
+	int	fd;
+
+	if (table != 0)
+		return 0;
+	if (file == (char *)0 || *file == '\0')
+		return -1;
+	fd = open(file, O_RDWR);
+	if (fd == -1) {
+		logit(64, "health_init: open %s failed\n", file);
+		return -1;
+	}
+	if (fstat(fd, &st) == -1 ||
+	    (st.st_size < HEALTH_RECORDS * sizeof(struct health) &&
+	    ftruncate(fd, HEALTH_RECORDS * sizeof(struct health)) == -1)) {
+		close(fd);
+		return -1;
+	}
+	p = mmap((void *)0, HEALTH_RECORDS * sizeof(struct health),
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		logit(64, "health_init: mmap %s failed\n", file);
+		return -1;
+	}
+	table = (struct health *)p;
+	return 0;
+}
+
+void
+health_order(char **srv, unsigned int n, unsigned int *order)
+{
+	struct	health *rec;
+	struct	timeval tv;
+	uint32	key[HEALTH_SERVERS];
+	unsigned int	i, j, k;
+
+	for (i = 0; i < n; i++)
+		order[i] = i;
+	if (table == 0 || n <= 1)
+		return;
+
+	gettimeofday(&tv, (struct timezone *)0);
+	for (i = 0; i < n; i++) {
+		rec = health_find(health_hash(srv[i]));
+		if (rec == 0 || rec->fails == 0) {
+			/* healthy, prefer fast servers in 100ms steps */
+			key[i] = 0x1000 + (rec ? rec->latency / 100 : 0);
+			if (key[i] > 0x1fff) key[i] = 0x1fff;
+		} else if (tv.tv_sec - rec->when >=
+		    health_backoff(rec->fails)) {
+			/*
+			 * Backoff expired, this process probes the server.
+			 * Others will wait for another backoff period.
+			 */
+			rec->when = tv.tv_sec;
+			key[i] = 0;
+			logit(64, "health_order: probing %s\n", srv[i]);
+		} else {
+			/* still sick, use only as a last resort */
+			key[i] = 0x2000 + (rec->fails > 0xff ? 0xff : rec->fails);
+			logit(64, "health_order: %s is sick (%u failures)\n",
+			    srv[i], (unsigned long)rec->fails);
+		}
+	}
+	/* stable insertion sort, keeps the configured order for ties */
+	for (i = 1; i < n; i++) {
+		k = order[i];
+		for (j = i; j > 0 && key[order[j - 1]] > key[k]; j--)
+			order[j] = order[j - 1];
+		order[j] = k;
+	}
+}
+
+void
+health_result(const char *srv, int failed, unsigned long msec)
+{
+	struct	health *rec;
+	struct	timeval tv;
+	uint32	h;
+	int	i;
+
+	if (table == 0)
+		return;
+	gettimeofday(&tv, (struct timezone *)0);
+	h = health_hash(srv);
+	rec = health_find(h);
+	if (rec == 0) {
+		if (!failed && msec < 100)
+			return;	/* not worth a record */
+		/* reuse a free or the least recently failed slot */
+		rec = &table[0];
+		for (i = 0; i < HEALTH_RECORDS; i++) {
+			if (table[i].hash == 0) {
+				rec = &table[i];
+				break;
+			}
+			if (table[i].when < rec->when)
+				rec = &table[i];
+		}
+		rec->fails = 0;
+		rec->latency = 0;
+		rec->when = tv.tv_sec;
+		rec->hash = h;
+	}
+	if (failed) {
+		if (rec->fails < 10) rec->fails++;
+		rec->when = tv.tv_sec;
+		logit(64, "health_result: %s failed %u times\n",
+		    srv, (unsigned long)rec->fails);
+	} else {
+		if (rec->fails != 0)
+			logit(64, "health_result: %s recovered\n", srv);
+		rec->fails = 0;
+		if (rec->latency == 0)
+			rec->latency = msec;
+		else
+			rec->latency = (3 * rec->latency + msec) / 4;
+	}
+}
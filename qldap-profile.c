@@ -31,47 +31,130 @@
  * SUCH DAMAGE.
  *
  */
-#include "taia.h"
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "fmt.h"
 #include "qldap-profile.h"
 #include "qldap-debug.h"
+#include "readwrite.h"
+#include "str.h"
+
+/*
+ * Always-on timing of the LDAP operations. Each slot accumulates a count,
+ * the error count, the total and maximum time and a histogram with
+ * power of two buckets in microseconds (bucket n is [2^n, 2^(n+1)) usec,
+ * bucket 0 also covers 0 usec). The numbers are only written out by
+ * profile_write() which resets the counters afterwards.
+ */
 
 struct profile_t {
-	struct taia start;
-	char *function;
+	struct timeval start;
+	const char *function;
+	unsigned long count;
+	unsigned long errors;
+	unsigned long total;	/* usec */
+	unsigned long max;	/* usec */
+	unsigned long hist[PROFILE_BUCKETS];
 };
 	
 static struct profile_t profile_list[PROFILES_MAX];
+static const char *profile_names[PROFILES_MAX] = {
+	"open", "bind", "search", "attr"
+};
 
-void start_timing(unsigned int profile, char *function)
+void
+start_timing(int profile, const char *function)
 {
-	if (profile >= PROFILES_MAX) {
-		debug(0x400, "Max Number of profiles exceeded\n");
+	if (profile < 0 || profile >= PROFILES_MAX) {
+		logit(LOG_PROFILE, "Max Number of profiles exceeded\n");
 		return;
 	}
-	
-	taia_now(&(profile_list[profile].start));
-
+	profile_list[profile].function = function;
+	gettimeofday(&profile_list[profile].start, (struct timezone *)0);
 }
 
-void stop_timing(unsigned int profile) 
+void
+stop_timing(int profile, int failed)
 {
-	struct taia stop;
-	struct taia diff;
-	char nano[TAIA_FMTFRAC];
-	unsigned long sec;
+	struct profile_t *p;
+	struct timeval stop;
+	unsigned long usec, u;
+	int b;
 	
-	if (profile >= PROFILES_MAX) {
-		debug(0x400, "Max Number of profiles exceeded\n");
+	if (profile < 0 || profile >= PROFILES_MAX) {
+		logit(LOG_PROFILE, "Max Number of profiles exceeded\n");
 		return;
 	}
+	p = &profile_list[profile];
 
-	taia_now(&stop);
+	gettimeofday(&stop, (struct timezone *)0);
+	if (stop.tv_sec < p->start.tv_sec)
+		usec = 0;	/* clock stepped back */
+	else
+		usec = (stop.tv_sec - p->start.tv_sec) * 1000000UL +
+		    stop.tv_usec - p->start.tv_usec;
 
-	taia_sub(&diff, &stop, &profile_list[profile].start);
-	nano[taia_fmtfrac(nano, &diff)] = 0; /* terminate to be sure */
-	nano[7] = 0; /* only the first 6-7 figures are != 0, (nano seconds) */
-	sec=(unsigned long) ((unsigned long long) diff.sec.x);
-	debug(0x400, "%s took %u.%s Sec\n", profile_list[profile].function, sec, nano);
+	for (b = 0, u = usec; u > 1 && b < PROFILE_BUCKETS - 1; u >>= 1)
+		b++;
+	p->hist[b]++;
+	p->count++;
+	if (failed)
+		p->errors++;
+	p->total += usec;
+	if (usec > p->max)
+		p->max = usec;
 
+	logit(LOG_PROFILE, "%s took %u usec\n", p->function, usec);
 }
 
+static unsigned int
+catnum(char *s, unsigned long ul, char sep)
+{
+	unsigned int n;
+
+	n = fmt_ulong(s, ul);
+	s[n++] = sep;
+	return n;
+}
+
+int
+profile_write(int fd)
+{
+	/* one line per operation, see QLDAPINSTALL for the format */
+	char	buf[PROFILES_MAX * (PROFILE_BUCKETS + 8) * (FMT_ULONG + 1)];
+	struct	timeval now;
+	unsigned int len, p, b;
+
+	gettimeofday(&now, (struct timezone *)0);
+	len = 0;
+	for (p = 0; p < PROFILES_MAX; p++) {
+		if (profile_list[p].count == 0)
+			continue;
+		len += catnum(buf + len, now.tv_sec, ' ');
+		len += catnum(buf + len, getpid(), ' ');
+		len += str_copy(buf + len, profile_names[p]);
+		buf[len++] = ' ';
+		len += catnum(buf + len, profile_list[p].count, ' ');
+		len += catnum(buf + len, profile_list[p].errors, ' ');
+		len += catnum(buf + len, profile_list[p].total, ' ');
+		len += catnum(buf + len, profile_list[p].max, ' ');
+		for (b = 0; b < PROFILE_BUCKETS; b++)
+			len += catnum(buf + len, profile_list[p].hist[b],
+			    b == PROFILE_BUCKETS - 1 ? '\n' : ',');
+	}
+	if (len == 0)
+		return 0;
+	/* a single write so that concurrent appenders do not mix */
+	if (write(fd, buf, len) != len)
+		return -1;
+	for (p = 0; p < PROFILES_MAX; p++) {
+		profile_list[p].count = 0;
+		profile_list[p].errors = 0;
+		profile_list[p].total = 0;
+		profile_list[p].max = 0;
+		for (b = 0; b < PROFILE_BUCKETS; b++)
+			profile_list[p].hist[b] = 0;
+	}
+	return 0;
+}
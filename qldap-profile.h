@@ -34,12 +34,24 @@
 #ifndef __QLDAP_PROFILE_H__
 #define __QLDAP_PROFILE_H__
 
-#define PROFILES_MAX 4 /* 4 concurrent profiles */
+/* the profiled operations */
+#define PROFILE_OPEN	0	/* ldap_init, ldap_set_option */
+#define PROFILE_BIND	1	/* ldap_simple_bind_s */
+#define PROFILE_SEARCH	2	/* ldap_search_st */
+#define PROFILE_ATTR	3	/* ldap_get_values and decoding */
+#define PROFILES_MAX	4
 
-void start_timing(int profile, char *function);
+#define PROFILE_BUCKETS	25	/* log2 usec histogram, up to ~33 secs */
+
+#define LOG_PROFILE	1024	/* loglevel for the per call output */
+
+void start_timing(int profile, const char *function);
 /* start the timing of a function */
 
-void stop_timing(int profile);
-/* stop the timing of a function and print the difference */
+void stop_timing(int profile, int failed);
+/* stop the timing of a function and account the difference */
+
+int profile_write(int fd);
+/* append the accumulated numbers to fd and reset them, -1 on error */
 
 #endif
@@ -32,6 +32,8 @@
  *
  */
 #include <sys/time.h> /* for ldap search timeout */
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <lber.h>
 #include <ldap.h>
@@ -46,6 +48,8 @@
 #include "fmt.h"
 #include "qldap-debug.h"
 #include "qldap-errno.h"
+#include "qldap-health.h"
+#include "qldap-profile.h"
 #include "qmail-ldap.h"
 #include "scan.h"
 #include "str.h"
@@ -67,9 +71,17 @@ struct qldap {
 	LDAPMessage	*res; /* valid after a search */
 	LDAPMessage	*msg; /* valid after call to ldap_first_entry() */
 	/* should we store server, binddn, basedn, password, ... */
+	unsigned int	order[HEALTH_SERVERS]; /* servers sorted by health */
+	unsigned int	cur;	/* current index into order */
+	int		ordered;
+	struct timeval	start;	/* when the current server was opened */
 };
 
 stralloc	ldap_server = {0};
+stralloc	ldap_servers = {0};	/* ldap_server split into single hosts */
+char		*servers[HEALTH_SERVERS];
+unsigned int	numservers = 0;
+stralloc	ldap_health = {0};
 stralloc	basedn = {0};
 stralloc	objectclass = {0};
 stralloc	ldap_login = {0};
@@ -77,9 +89,11 @@ stralloc	ldap_password = {0};
 stralloc	default_messagestore = {0};
 stralloc	dotmode = {0};
 stralloc	adm = {0};
+stralloc	ldap_stats = {0};
 struct constmap	ad_map;
 int		adok = 0;
 unsigned int	ldap_timeout = QLDAP_TIMEOUT;	/* default timeout is 30 secs */
+unsigned int	ldap_ctimeout = 0;		/* default libldap timeout */
 int		rebind = 0;			/* default off */
 unsigned int	default_uid = 0;
 unsigned int	default_gid = 0;
@@ -90,6 +104,8 @@ unsigned long	quotacount = 0;
 static  int qldap_close(qldap *);
 
 static int qldap_set_option(qldap *, int);
+static int qldap_split_servers(void);
+static int qldap_failover(qldap *, int);
 static int check_next_state(qldap *, int);
 
 #define STATEIN(x, y)	((x)->state == (y))
@@ -149,6 +165,7 @@ qldap_ctrl_generic(void)
 {
 	/* set defaults, so that a reread works */
 	ldap_timeout = QLDAP_TIMEOUT;	/* default timeout is 30 secs */
+	ldap_ctimeout = 0;
 	rebind = 0;			/* default off */
 	default_uid = 0;
 	default_gid = 0;
@@ -162,6 +179,7 @@ qldap_ctrl_generic(void)
 	else
 		if (!stralloc_0(&ldap_server)) return -1;
 	logit(64, "init_ldap: control/ldapserver: '%s'\n", ldap_server.s);
+	if (qldap_split_servers() == -1) return -1;
 
 	if (control_rldef(&basedn, "control/ldapbasedn", 0, "") == -1)
 		return -1;
@@ -176,6 +194,18 @@ qldap_ctrl_generic(void)
 		return -1;
 	logit(64, "init_ldap: control/ldaptimeout: %i\n", ldap_timeout);
 
+	if (control_readint(&ldap_ctimeout, "control/ldapconnecttimeout") == -1)
+		return -1;
+	logit(64, "init_ldap: control/ldapconnecttimeout: %i\n",
+	    ldap_ctimeout);
+
+	if (control_rldef(&ldap_health, "control/ldaphealth", 0, "") == -1)
+		return -1;
+	if (!stralloc_0(&ldap_health)) return -1;
+	if (ldap_health.len > 1)
+		logit(64, "init_ldap: control/ldaphealth: %s\n",
+		    ldap_health.s);
+
 	if (control_readint(&rebind, "control/ldaprebind") == -1) return -1;
 	logit(64, "init_ldap: control/ldaprebind: %i\n", rebind);
 
@@ -203,6 +233,12 @@ qldap_ctrl_generic(void)
 	} else
 		if (!stralloc_copys(&default_messagestore, "")) return -1;
 
+	if (control_rldef(&ldap_stats, "control/ldapstats", 0, "") == -1)
+		return -1;
+	if (!stralloc_0(&ldap_stats)) return -1;
+	if (ldap_stats.len > 1)
+		logit(64, "init_ldap: control/ldapstats: %s\n", ldap_stats.s);
+
 	if (control_rldef(&dotmode, "control/ldapdefaultdotmode",
 		    0, "ldaponly") == -1) return -1;
 	if (!stralloc_0(&dotmode)) return -1;
@@ -254,21 +290,41 @@ qldap_new(void)
 int
 qldap_open(qldap *q)
 {
+	char *server;
 	int rc;
 
 	CHECK(q, OPEN);
 	
+	/*
+	 * The servers are tried one by one in the order of their health,
+	 * see qldap_failover(). Without a server list fall back to the
+	 * libldap default (localhost).
+	 */
+	if (!q->ordered) {
+		if (ldap_health.len > 1)
+			health_init(ldap_health.s);
+		health_order(servers, numservers, q->order);
+		q->cur = 0;
+		q->ordered = 1;
+	}
+	server = numservers ? servers[q->order[q->cur]] : ldap_server.s;
+	logit(128, "qldap_open: using server %s\n", server);
+	gettimeofday(&q->start, (struct timezone *)0);
+
+	start_timing(PROFILE_OPEN, "qldap_open");
 	/* allocate the connection */
-        if ( (strncmp("ldap://",ldap_server.s,7) == 0 ) ||  (strncmp("ldaps://",ldap_server.s,8) == 0 ) ) {
-          if ( (rc = ldap_initialize(& (q->ld), ldap_server.s)) == 0) {
+        if ( (strncmp("ldap://",server,7) == 0 ) ||  (strncmp("ldaps://",server,8) == 0 ) ) {
+          if ( (rc = ldap_initialize(& (q->ld), server)) == 0) {
 	    logit(128, "qldap_open: init successful\n");
           } else {
             q->state = ERROR;
+            stop_timing(PROFILE_OPEN, 1);
             return rc ;
           }
         } else {
-	  if ((q->ld = ldap_init(ldap_server.s,LDAP_PORT)) == 0) {
+	  if ((q->ld = ldap_init(server,LDAP_PORT)) == 0) {
 		logit(128, "qldap_open: init failed\n");
+		stop_timing(PROFILE_OPEN, 1);
 		return ERRNO;
 	  }
         }
@@ -276,6 +332,7 @@ qldap_open(qldap *q)
 	if (rc != OK)
 		logit(128, "qldap_open: qldap_set_option failed\n");
 	q->state = rc==OK?OPEN:ERROR;
+	stop_timing(PROFILE_OPEN, rc != OK);
 	return rc;
 }
 
@@ -295,7 +352,9 @@ qldap_bind(qldap *q, const char *binddn, const char *passwd)
 
 retry:
 	/* connect to the LDAP server */
+	start_timing(PROFILE_BIND, "qldap_bind");
 	rc = ldap_simple_bind_s(q->ld, binddn, passwd);
+	stop_timing(PROFILE_BIND, rc != LDAP_SUCCESS);
 	try++;
 	/* probably more detailed information should be returned, eg.:
 	   LDAP_STRONG_AUTH_NOT_SUPPORTED,
@@ -306,11 +365,24 @@ retry:
 	switch (rc) {
 	case LDAP_SUCCESS:
 		logit(128, "qldap_bind: successful\n");
+		qldap_failover(q, 0);
 		q->state = BIND;
 		return OK;
+	case LDAP_BUSY:
+	case LDAP_UNAVAILABLE:
+#ifdef LDAP_TIMEOUT
+	case LDAP_TIMEOUT:
+#endif
+#ifdef LDAP_CONNECT_ERROR
+	case LDAP_CONNECT_ERROR:
+#endif
 	case LDAP_TIMELIMIT_EXCEEDED:
 	case LDAP_SERVER_DOWN:
 		logit(128, "qldap_bind: failed (%s)\n", ldap_err2string(rc));
+		if (qldap_failover(q, 1)) {
+			try = 0;
+			goto retry;
+		}
 		q->state = ERROR;
 		return LDAP_BIND_UNREACH;
 	case LDAP_INVALID_CREDENTIALS:
@@ -379,11 +451,27 @@ qldap_free_results(qldap *q)
 int
 qldap_free(qldap *q)
 {
+	int	fd;
+
 	qldap_free_results(q);
 	if (!STATEIN(q, NEW) && !STATEIN(q, CLOSE))
 		qldap_close(q);
 	byte_zero(q, sizeof(qldap));
 	alloc_free(q);
+
+	/*
+	 * dump the collected timings, errors are not fatal. The file is
+	 * not created here, it would end up owned by the first writer.
+	 */
+	if (ldap_stats.len > 1) {
+		fd = open(ldap_stats.s, O_WRONLY | O_APPEND);
+		if (fd != -1) {
+			if (profile_write(fd) == -1)
+				logit(2, "warning: qldap_free: "
+				    "write %s failed\n", ldap_stats.s);
+			close(fd);
+		}
+	}
 	return OK;
 }
 
@@ -402,8 +490,10 @@ qldap_lookup(qldap *q, const char *filter, const char *attrs[])
 	tv.tv_sec = ldap_timeout;
 	tv.tv_usec = 0;
 
+	start_timing(PROFILE_SEARCH, "qldap_lookup");
 	rc = ldap_search_st(q->ld, basedn.s, LDAP_SCOPE_SUBTREE,
 		filter, (char **)attrs, 0, &tv, &q->res);
+	stop_timing(PROFILE_SEARCH, rc != LDAP_SUCCESS);
 	
 	switch (rc) {
 	/* probably more detailed information should be returned, eg.:
@@ -489,8 +579,10 @@ qldap_filter(qldap *q, const char *filter, const char *attrs[],
 	tv.tv_sec = ldap_timeout;
 	tv.tv_usec = 0;
 
+	start_timing(PROFILE_SEARCH, "qldap_filter");
 	rc = ldap_search_st(q->ld, bdn, scope, filter,
 	    (char **)attrs, 0, &tv, &q->res);
+	stop_timing(PROFILE_SEARCH, rc != LDAP_SUCCESS);
 	
 	switch (rc) {
 	/* probably more detailed information should be returned, eg.:
@@ -528,6 +620,110 @@ qldap_filter(qldap *q, const char *filter, const char *attrs[],
 	return OK;
 }
 
+/*
+ * Resolve a list of '\0' separated DNs with base searches and append the
+ * single value of attr of every found entry '\0' terminated to vals.
+ * Up to window searches are outstanding at the same time so that large
+ * lists do not pay one round trip per DN. Entries that do not exist or
+ * do not have the attribute are skipped.
+ */
+int
+qldap_dnlist(qldap *q, const char *dns, unsigned int len, const char *attr,
+    stralloc *vals, unsigned int *num, unsigned int window)
+{
+	struct	timeval tv;
+	LDAPMessage	*res, *e;
+	const char	*attrs[2];
+	char	**v;
+	unsigned int	pos, outstanding;
+	int	rc, r;
+
+	CHECK(q, SEARCH);
+	qldap_free_results(q);
+
+	attrs[0] = attr;
+	attrs[1] = 0;
+	if (window == 0)
+		window = 1;
+	pos = 0;
+	outstanding = 0;
+	r = OK;
+	while (pos < len || outstanding > 0) {
+		while (pos < len && outstanding < window) {
+			rc = ldap_search(q->ld, dns + pos, LDAP_SCOPE_BASE,
+			    "objectclass=*", (char **)attrs, 0);
+			if (rc == -1) {
+				logit(64, "qldap_dnlist: search for %s "
+				    "failed\n", dns + pos);
+				r = FAILED;
+				goto done;
+			}
+			pos += str_len(dns + pos) + 1;
+			outstanding++;
+		}
+
+		tv.tv_sec = ldap_timeout;
+		tv.tv_usec = 0;
+		start_timing(PROFILE_SEARCH, "qldap_dnlist");
+		rc = ldap_result(q->ld, LDAP_RES_ANY, LDAP_MSG_ALL, &tv, &res);
+		stop_timing(PROFILE_SEARCH, rc <= 0);
+		if (rc == 0) {
+			logit(64, "qldap_dnlist: search timed out\n");
+			r = TIMEOUT;
+			goto done;
+		} else if (rc == -1) {
+			logit(64, "qldap_dnlist: ldap_result failed\n");
+			r = FAILED;
+			goto done;
+		}
+		outstanding--;
+
+		rc = ldap_result2error(q->ld, res, 0);
+		switch (rc) {
+		case LDAP_SUCCESS:
+			break;
+		case LDAP_NO_SUCH_OBJECT:
+			/* stale member, ignore */
+			break;
+		case LDAP_TIMEOUT:
+		case LDAP_TIMELIMIT_EXCEEDED:
+		case LDAP_BUSY:
+			logit(64, "qldap_dnlist: search failed (%s)\n",
+			    ldap_err2string(rc));
+			r = TIMEOUT;
+			break;
+		default:
+			logit(64, "qldap_dnlist: search failed (%s)\n",
+			    ldap_err2string(rc));
+			r = FAILED;
+			break;
+		}
+		for (e = ldap_first_entry(q->ld, res);
+		    r == OK && e != (LDAPMessage *)0;
+		    e = ldap_next_entry(q->ld, e)) {
+			v = ldap_get_values(q->ld, e, attr);
+			if (v == (char **)0)
+				continue;
+			if (ldap_count_values(v) > 1)
+				r = TOOMANY;
+			else if (!stralloc_cats(vals, v[0]) ||
+			    !stralloc_0(vals))
+				r = ERRNO;
+			else if (num)
+				*num += 1;
+			ldap_value_free(v);
+		}
+		ldap_msgfree(res);
+		if (r != OK)
+			goto done;
+	}
+
+done:
+	/* the results are all consumed, the connection is usable again */
+	q->state = r == OK ? BIND : ERROR;
+	return r;
+}
+
 int
 qldap_count(qldap *q)
 {
@@ -825,8 +1021,21 @@ qldap_get_bool(qldap *q, const char *attr, int *bool)
 	return r;
 }
 
+static int qldap_get_values(qldap *, const char *, stralloc *, int);
+
 int
 qldap_get_attr(qldap *q, const char *attr, stralloc *val, int multi)
+{
+	int	r;
+
+	start_timing(PROFILE_ATTR, "qldap_get_attr");
+	r = qldap_get_values(q, attr, val, multi);
+	stop_timing(PROFILE_ATTR, r != OK && r != NOSUCH);
+	return r;
+}
+
+static int
+qldap_get_values(qldap *q, const char *attr, stralloc *val, int multi)
 {
 	char	**vals;
 	int	nvals, i, j, l, r;
@@ -961,6 +1170,62 @@ dorebind(LDAP *ld, LDAP_CONST char *url, int request, ber_int_t msgid)
 }
 #endif
 
+static int
+qldap_split_servers(void)
+{
+	unsigned int	i, j;
+
+	/* ldap_server is a space separated list of hosts or URLs */
+	if (!stralloc_copy(&ldap_servers, &ldap_server)) return -1;
+	numservers = 0;
+	for (i = 0; i < ldap_servers.len; i = j + 1) {
+		for (j = i; j < ldap_servers.len; j++)
+			if (ldap_servers.s[j] == ' ' ||
+			    ldap_servers.s[j] == '\0')
+				break;
+		if (j == ldap_servers.len)
+			break;
+		ldap_servers.s[j] = '\0';
+		if (j == i) continue;
+		if (numservers >= HEALTH_SERVERS) {
+			logit(64, "init_ldap: too many ldap servers, "
+			    "ignoring %s\n", ldap_servers.s + i);
+			continue;
+		}
+		servers[numservers++] = ldap_servers.s + i;
+	}
+	return 0;
+}
+
+/*
+ * Record the result of the connection attempt to the current server.
+ * On failure switch to the next server and return 1 if there is one
+ * left, the caller needs to rebind in that case.
+ */
+static int
+qldap_failover(qldap *q, int failed)
+{
+	struct	timeval tv;
+	long	ms;
+
+	if (numservers == 0)
+		return 0;
+	gettimeofday(&tv, (struct timezone *)0);
+	ms = (tv.tv_sec - q->start.tv_sec) * 1000 +
+	    (tv.tv_usec - q->start.tv_usec) / 1000;
+	health_result(servers[q->order[q->cur]], failed, ms < 0 ? 0 : ms);
+	if (!failed || q->cur + 1 >= numservers)
+		return 0;
+
+	qldap_close(q);
+	q->cur++;
+	logit(64, "qldap_failover: trying next server %s\n",
+	    servers[q->order[q->cur]]);
+	if (qldap_open(q) != OK)
+		return 0;
+	return 1;
+}
+
 static int
 qldap_set_option(qldap *q, int forceV2)
 {
@@ -995,6 +1260,21 @@ qldap_set_option(qldap *q, int forceV2)
 			return qldap_set_option(q, 1);
 		}
 
+#ifdef LDAP_OPT_NETWORK_TIMEOUT
+		if (ldap_ctimeout != 0) {
+			struct timeval tv;
+
+			tv.tv_sec = ldap_ctimeout;
+			tv.tv_usec = 0;
+			rc = ldap_set_option(q->ld,
+			    LDAP_OPT_NETWORK_TIMEOUT, &tv);
+			if (rc != LDAP_OPT_SUCCESS)
+				logit(128, "qldap_set_option: "
+				    "setting connect timeout failed (%s)\n",
+				    ldap_err2string(rc));
+		}
+#endif
+
 #if defined(LDAP_API_FEATURE_X_OPENLDAP) && (LDAP_API_VERSION > 2000)
 		/*
 		 * currently we support referrals only with OpenLDAP >= 2.x
@@ -78,6 +78,12 @@ int qldap_lookup(qldap *, const char *, const char *[]);
  */
 int qldap_filter(qldap *, const char *, const char *[], char *, int);
 
+/* possible errors:
+ * FAILED TIMEOUT TOOMANY ERRNO
+ */
+int qldap_dnlist(qldap *, const char *, unsigned int, const char *,
+    stralloc *, unsigned int *, unsigned int);
+
 /*
  * returns -1 on error
  */
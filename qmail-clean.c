@@ -48,7 +48,13 @@ void cleanuppid()
 
 char fnbuf[FMTQFN];
 
-void respond(s) char *s; { if (substdio_putflush(subfdoutsmall,s,1) == -1) _exit(100); }
+/* answers to a batch of requests are sent back in one go */
+void respond(s) char *s;
+{
+ if (substdio_put(subfdoutsmall,s,1) == -1) _exit(100);
+ if (!subfdinsmall->p)
+   if (substdio_flush(subfdoutsmall) == -1) _exit(100);
+}
 
 int main()
 {
@@ -31,6 +31,7 @@
  * SUCH DAMAGE.
  *
  */
+#include <stdio.h>
 #include <unistd.h>
 
 #include "alloc.h"
@@ -53,8 +54,10 @@
 #include "qmail-ldap.h"
 #include "read-ctrl.h"
 #include "readwrite.h"
+#include "scan.h"
 #include "seek.h"
 #include "sig.h"
+#include "slurpclose.h"
 #include "str.h"
 #include "stralloc.h"
 #include "strerr.h"
@@ -63,6 +66,11 @@
 
 #define FATAL "qmail-group: fatal: "
 
+/* number of outstanding dn lookups while expanding a group */
+#define DNWINDOW 64
+/* number of member dns resolved before they are handed to qmail-queue */
+#define DNSLICE 1024
+
 void
 temp_nomem(void)
 {
@@ -97,10 +105,15 @@ void init(void);
 void bouncefx(void);
 void reset_sender(void);
 void blast(stralloc *, int);
+void blast_to(char *);
+void blast_done(void);
+void flushrecips(void);
 void reopen(void);
 void trydelete(void);
 void secretary(char *, int);
 void explode(qldap *);
+int cache_read(char *);
+void cache_write(char *);
 void subscribed(qldap *, int);
 qldap *ldapgroup(char *, int *, int *, int *);
 
@@ -116,6 +129,10 @@ stralloc recips = {0};
 stralloc bounceadmin = {0};
 stralloc moderators = {0};
 unsigned int nummoderators;
+stralloc cachekey = {0};
+int streaming = 0;
+int blastflagb = 0;
+unsigned int recipsdone = 0;
 
 
 int
@@ -166,20 +183,34 @@ main(int argc, char **argv)
 	}
 
 	reopen();
-	explode(qlc);
+	/* members are queued while the group is expanded */
+	blastflagb = 1;
+	streaming = 1;
+	if (!cache_read(maildir)) {
+		explode(qlc);
+		cache_write(maildir);
+	} else
+		flushrecips();
 	qldap_free(qlc);
 	
 	/* does not return */
-	blast(&recips, 1);
+	blast_done();
 	return 111;
 }
 
 stralloc grouplogin = {0};
 stralloc grouppassword = {0};
+unsigned int groupcachettl = 0;
+unsigned int groupchunk = 0;
 
 int
 init_controls(void)
 {
+	if (control_readint(&groupcachettl, "control/ldapgroupcachettl") == -1)
+		return -1;
+	if (control_readint(&groupchunk, "control/ldapgroupchunk") == -1)
+		return -1;
+
 	switch (control_readline(&grouplogin, "control/ldapgrouplogin")) {
 	case 0:
 		return 0;
@@ -308,28 +339,33 @@ reset_sender(void)
 }
 
 
+/*
+ * Recipients are passed to qmail-queue as they are produced. If
+ * ~control/ldapgroupchunk is set a new queue entry is started every
+ * groupchunk recipients so that qmail-send can start delivering the
+ * first part of a large group while the rest is still being expanded.
+ */
+struct qmail qqt;
+int qqopen = 0;
+unsigned int qqrcpts;
+unsigned long qqp;
+stralloc qplist = {0};
 char strnum1[FMT_ULONG];
 char strnum2[FMT_ULONG];
 
-void
-blast(stralloc *r, int flagb)
+static void
+blast_open(void)
 {
-	struct qmail qqt;
 	substdio ss;
-	char *s, *smax;
-	const char *qqx;
-	unsigned long qp;
-	datetime_sec when;
 	int match;
 
-	if (r->s == (char *)0 || r->len == 0)
-		strerr_die2x(100, FATAL, "no recipients found in this group.");
-
 	if (seek_begin(0) == -1) temp_rewind();
 	substdio_fdbuf(&ss, subread, 0, buf, sizeof(buf));
 
 	if (qmail_open(&qqt) == -1) temp_fork();
-	qp = qmail_qp(&qqt);
+	qqopen = 1;
+	qqrcpts = 0;
+	qqp = qmail_qp(&qqt);
 	/* mail header */
 	qmail_put(&qqt, dtline.s, dtline.len);
 	qmail_puts(&qqt,"Precedence: bulk\n");
@@ -341,7 +377,7 @@ blast(stralloc *r, int flagb)
 		qmail_put(&qqt, line.s, line.len);
 	} while (match);
 
-	if (flagb && bounceadmin.s && bounceadmin.len) {
+	if (blastflagb && bounceadmin.s && bounceadmin.len) {
 		if (!stralloc_copy(&line,&base)) temp_nomem();
 		if (!stralloc_cats(&line,"-return-@")) temp_nomem();
 		if (!stralloc_cats(&line,host)) temp_nomem();
@@ -351,18 +387,58 @@ blast(stralloc *r, int flagb)
 	} else
 		/* if no bounce admin specified forward with sender address */
 		qmail_from(&qqt, sender);
+}
 
-	for (s = r->s, smax = r->s + r->len; s < smax; s += str_len(s) + 1)
-		qmail_to(&qqt,s);
+static void
+blast_close(void)
+{
+	const char *qqx;
+
+	qqopen = 0;
 	qqx = qmail_close(&qqt);
 	if (*qqx)
 		strerr_die3x(*qqx == 'D' ? 100 : 111,
 		    "Unable to blast message: ", qqx + 1, ".");
+	if (!stralloc_cats(&qplist, " qp ")) temp_nomem();
+	if (!stralloc_catb(&qplist, strnum2, fmt_ulong(strnum2, qqp)))
+		temp_nomem();
+}
+
+void
+blast_to(char *s)
+{
+	if (!qqopen) blast_open();
+	qmail_to(&qqt, s);
+	if (++qqrcpts == groupchunk)
+		blast_close();
+}
+
+void
+blast_done(void)
+{
+	datetime_sec when;
+
+	if (qqopen) blast_close();
+	if (qplist.len == 0)
+		strerr_die2x(100, FATAL, "no recipients found in this group.");
+	if (!stralloc_0(&qplist)) temp_nomem();
 	when = now();
 	strnum1[fmt_ulong(strnum1, (unsigned long) when)] = 0;
-	strnum2[fmt_ulong(strnum2, qp)] = 0;
 	trydelete();
-	strerr_die5x(0, "qmail-group: ok ", strnum1, " qp ", strnum2, ".");
+	strerr_die4x(0, "qmail-group: ok ", strnum1, qplist.s, ".");
+}
+
+void
+blast(stralloc *r, int flagb)
+{
+	char *s, *smax;
+
+	blastflagb = flagb;
+	if (r->s != (char *)0)
+		for (s = r->s, smax = r->s + r->len; s < smax;
+		    s += str_len(s) + 1)
+			blast_to(s);
+	blast_done();
 }
 
 stralloc fname = {0};
@@ -535,8 +611,10 @@ explode(qldap *q)
 	int r;
 
 	sq = 0;
+	recipsdone = 0;
 	if (!stralloc_copys(&recips, "")) { r = ERRNO; goto fail; }
 	extract_addrs822(q, LDAP_GROUPMEMBER822, &recips, 0);
+	flushrecips();
 
 	/* open a second connection and do some dn lookups */
 	sq = qldap_new();
@@ -559,6 +637,25 @@ fail:
 	/* NOTREACHED */
 }
 
+/*
+ * Hand the recipients expanded so far to qmail-queue. The list is only
+ * kept if it is needed for the group cache.
+ */
+void
+flushrecips(void)
+{
+	char *s, *smax;
+
+	if (!streaming) return;
+	for (s = recips.s + recipsdone, smax = recips.s + recips.len;
+	    s < smax; s += str_len(s) + 1)
+		blast_to(s);
+	if (groupcachettl && cachekey.len)
+		recipsdone = recips.len;
+	else
+		recips.len = recipsdone = 0;
+}
+
 stralloc founddn = {0};
 
 void
@@ -676,6 +773,7 @@ ldapgroup(char *dn, int *flagc, int *flags, int *flagS)
 		LDAP_GROUPSENDER822,
 		LDAP_GROUPSENDERFILTER,
 		LDAP_GROUPBOUNCEADMIN,
+		LDAP_GROUPTIMESTAMP,
 		0 };
 	int r;
 		
@@ -753,6 +851,25 @@ ldapgroup(char *dn, int *flagc, int *flags, int *flagS)
 	}
 
 
+	/* the group dn and its modify time identify a cached expansion */
+	r = qldap_get_attr(q, LDAP_GROUPTIMESTAMP, &ldapval, SINGLE_VALUE);
+	switch (r) {
+	case OK:
+		if (!stralloc_copys(&cachekey, dn) ||
+		    !stralloc_0(&cachekey) ||
+		    !stralloc_cats(&cachekey, ldapval.s) ||
+		    !stralloc_0(&cachekey)) {
+			r = ERRNO;
+			goto fail;
+		}
+		break;
+	case NOSUCH:
+		/* no timestamp no caching */
+		break;
+	default:
+		goto fail;
+	}
+
 	getmoderators(q);
 	
 	if (*flags) {
@@ -845,10 +962,8 @@ static void
 extract_addrsdn(qldap *q, qldap *sq, const char *attr,
     stralloc *list, unsigned int *numlist)
 {
-	const char *attrs[] = {
-		LDAP_MAIL,
-		0 };
-	char *s, *smax;
+	char *s, *e, *smax;
+	unsigned int n;
 	int r;
 
 	if (!stralloc_copys(&tmpval, "")) { r = ERRNO; goto fail; }
@@ -859,43 +974,22 @@ extract_addrsdn(qldap *q, qldap *sq, const char *attr,
 		if (r != OK) goto fail;
 		break;
 	case NOSUCH:
-		break;
+		return;
 	default:
 		goto fail;
 	}
 
-	for (s = tmpval.s, smax = tmpval.s + tmpval.len;
-	    s < smax; s += str_len(s) + 1) {
-		r = qldap_filter(sq, "objectclass=*", attrs, s, SCOPE_BASE);
-		if (r == NOSUCH) continue;
+	/*
+	 * resolve DNSLICE dns at a time, keeping DNWINDOW searches in
+	 * flight, and pass the result on before the next slice is done
+	 */
+	for (s = tmpval.s, smax = tmpval.s + tmpval.len; s < smax; s = e) {
+		for (e = s, n = 0; e < smax && n < DNSLICE; n++)
+			e += str_len(e) + 1;
+		r = qldap_dnlist(sq, s, e - s, LDAP_MAIL,
+		    list, numlist, DNWINDOW);
 		if (r != OK) goto fail;
-		r = qldap_count(sq);
-		if (r > 1) {
-			/* TOOMANY should be impossible with SCOPE_BASE */
-			r = TOOMANY;
-			goto fail;
-		} else if (r <= 0)
-			continue;
-		r = qldap_first(sq); /* and only */
-		if (r != OK) goto fail;
-		/* get mail address */
-		r = qldap_get_attr(sq, LDAP_MAIL, &ldapval, SINGLE_VALUE);
-		switch (r) {
-		case OK:
-			if (!stralloc_cat(list, &ldapval)) {
-				r = ERRNO;
-				goto fail;
-			}
-			if (numlist) *numlist += 1;
-			break;
-		case NOSUCH:
-			/* WTF! Ignore. */
-			break;
-		default:
-			goto fail;
-		}
-		/* free stuff for next search */
-		qldap_free_results(sq);
+		if (list == &recips) flushrecips();
 	}
 	return;
 	
@@ -965,6 +1059,7 @@ extract_addrsfilter(qldap *q, qldap *sq, const char *attr,
 		
 		/* free stuff for next search */
 		qldap_free_results(sq);
+		if (list == &recips) flushrecips();
 	}
 	return;
 	
@@ -976,6 +1071,93 @@ fail:
 	/* NOTREACHED */
 }
 
+/*
+ * The expanded member list is cached in Maildir/groupcache. The file
+ * starts with the creation time, followed by the '\0' terminated group
+ * dn and modifyTimestamp of the group entry and the '\0' separated
+ * recipients.
+ * A cache entry is only used if it is younger than ldapgroupcachettl
+ * seconds and the group entry was not modified since.
+ */
+stralloc cachefn = {0};
+stralloc cachetmp = {0};
+stralloc cachebuf = {0};
+
+static int
+cache_name(stralloc *fn, char *maildir, const char *name)
+{
+	if (!stralloc_copys(fn, maildir)) return 0;
+	if (!stralloc_cats(fn, "/")) return 0;
+	if (!stralloc_cats(fn, name)) return 0;
+	if (!stralloc_0(fn)) return 0;
+	return 1;
+}
+
+int
+cache_read(char *maildir)
+{
+	unsigned long when;
+	unsigned int pos;
+	int fd;
+
+	if (groupcachettl == 0 || cachekey.len == 0) return 0;
+	if (!cache_name(&cachefn, maildir, "groupcache")) temp_nomem();
+	if (!stralloc_copys(&cachebuf, "")) temp_nomem();
+	fd = open_read(cachefn.s);
+	if (fd == -1) return 0;
+	if (slurpclose(fd, &cachebuf, 4096) == -1) return 0;
+
+	pos = scan_ulong(cachebuf.s, &when);
+	if (pos == 0 || pos >= cachebuf.len || cachebuf.s[pos++] != '\n')
+		return 0;
+	if (when > (unsigned long)now() ||
+	    when + groupcachettl < (unsigned long)now())
+		return 0;
+	/* cachekey ends in '\0', so this also checks the terminator */
+	if (cachebuf.len - pos < cachekey.len ||
+	    byte_diff(cachebuf.s + pos, cachekey.len, cachekey.s))
+		return 0;
+	pos += cachekey.len;
+	if (!stralloc_copyb(&recips, cachebuf.s + pos, cachebuf.len - pos))
+		temp_nomem();
+	return 1;
+}
+
+void
+cache_write(char *maildir)
+{
+	substdio ss;
+	char num[FMT_ULONG];
+	char sbuf[1024];
+	int fd;
+
+	/* the cache is optional, so any failure just drops it */
+	if (groupcachettl == 0 || cachekey.len == 0) return;
+	if (!cache_name(&cachefn, maildir, "groupcache")) return;
+	if (!stralloc_copy(&cachetmp, &cachefn)) return;
+	cachetmp.len--;
+	if (!stralloc_cats(&cachetmp, ".")) return;
+	if (!stralloc_catb(&cachetmp, num, fmt_ulong(num, getpid()))) return;
+	if (!stralloc_0(&cachetmp)) return;
+
+	fd = open_trunc(cachetmp.s);
+	if (fd == -1) return;
+	substdio_fdbuf(&ss, subwrite, fd, sbuf, sizeof(sbuf));
+	if (substdio_put(&ss, num, fmt_ulong(num, now())) == -1) goto fail;
+	if (substdio_put(&ss, "\n", 1) == -1) goto fail;
+	if (substdio_put(&ss, cachekey.s, cachekey.len) == -1) goto fail;
+	if (substdio_put(&ss, recips.s, recips.len) == -1) goto fail;
+	if (substdio_flush(&ss) == -1) goto fail;
+	if (fsync(fd) == -1) goto fail;
+	if (close(fd) == -1) goto unlink;
+	if (rename(cachetmp.s, cachefn.s) == -1) goto unlink;
+	return;
+fail:
+	close(fd);
+unlink:
+	unlink(cachetmp.s);
+}
+
 stralloc filter = {0};
 
 static int
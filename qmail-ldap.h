@@ -154,6 +154,7 @@
 #define LDAP_GROUPSENDER822	"rfc822sender"
 #define LDAP_GROUPSENDERFILTER	"filtersender"
 #define LDAP_GROUPBOUNCEADMIN	"bounceadmin"
+#define LDAP_GROUPTIMESTAMP	"modifyTimestamp"
 
 
 /*********************************************************************
@@ -182,6 +183,10 @@
 
 #define ENV_GROUP		"QLDAPGROUP"
 
+#define ENV_TIMING		"QMAILLOCALTIMING"
+#define ENV_PARALLEL		"QMAILLOCALPARALLEL"
+#define ENV_DOTCACHE		"QMAILDOTCACHE"
+
 /* qmail-local.c only */
 #define DO_LDAP 	0x01
 #define DO_DOT  	0x02
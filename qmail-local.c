@@ -1,11 +1,17 @@
+#include "hascopyfr.h"
+#ifdef HASCOPYFR
+#define _GNU_SOURCE
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include "readwrite.h"
 #include "sig.h"
 #include "env.h"
 #include "byte.h"
 #include "exit.h"
+#include "fd.h"
 #include "fork.h"
 #include "open.h"
 #include "wait.h"
@@ -35,6 +41,7 @@
 #include "auto_qmail.h"
 #include "scan.h"
 #include "maildir++.h"
+#include "dotcache.h"
 #ifdef AUTOMAILDIRMAKE
 #include "mailmaker.h"
 #endif
@@ -78,8 +85,41 @@ stralloc messline = {0};
 stralloc foo = {0};
 stralloc qapp = {0};
 
-char buf[1024];
-char outbuf[1024];
+char buf[SUBSTDIO_INSIZE];
+char outbuf[SUBSTDIO_OUTSIZE];
+
+/* per phase timings in microseconds, turned on by qmail-lspawn */
+int flagtiming = 0;
+struct timeval timing_begin;
+unsigned long timing_dot = 0;
+unsigned long timing_quota = 0;
+char timing_num[FMT_ULONG];
+
+void timing_mark(tv)
+struct timeval *tv;
+{
+ if (flagtiming) gettimeofday(tv,(struct timezone *) 0);
+}
+
+unsigned long timing_since(tv)
+struct timeval *tv;
+{
+ struct timeval tvnow;
+
+ if (!flagtiming) return 0;
+ gettimeofday(&tvnow,(struct timezone *) 0);
+ return (tvnow.tv_sec - tv->tv_sec) * 1000000 + tvnow.tv_usec - tv->tv_usec;
+}
+
+void timing_put(key,u)
+char *key;
+unsigned long u;
+{
+ substdio_puts(subfdoutsmall," ");
+ substdio_puts(subfdoutsmall,key);
+ substdio_puts(subfdoutsmall,"=");
+ substdio_put(subfdoutsmall,timing_num,fmt_ulong(timing_num,u));
+}
 
 /* child process */
 char fntmptph[80 + FMT_ULONG * 2];
@@ -88,6 +128,38 @@ void tryunlinktmp() { unlink(fntmptph); }
 void sigalrm() { tryunlinktmp(); _exit(3); }
 int msfd = -1; /* global filedescriptor to the quota file */
 
+#ifdef HASCOPYFR
+/* append the rest of the message on fd 0 to fd inside the kernel.
+   returns 0 if copy_file_range() can not be used (nothing copied yet),
+   1 on success and -3 on errors like substdio_copy() */
+int maildir_copy(fd)
+int fd;
+{
+ loff_t off;
+ ssize_t r;
+ int flagcopied;
+
+ off = lseek(0,(off_t) 0,SEEK_CUR);
+ if (off == -1) return 0;
+ flagcopied = 0;
+ for (;;)
+  {
+   r = copy_file_range(0,&off,fd,(loff_t *) 0,1048576,0);
+   if (r == 0) return 1;
+   if (r == -1)
+    {
+     if (errno == error_intr) continue;
+     if (!flagcopied)
+       if ((errno == EXDEV) || (errno == EINVAL) || (errno == ENOSYS)
+	   || (errno == EOPNOTSUPP) || (errno == EBADF))
+	 return 0;
+     return -3;
+    }
+   flagcopied = 1;
+  }
+}
+#endif
+
 void maildir_child(dir)
 char *dir;
 {
@@ -100,6 +172,9 @@ char *dir;
  int fd;
  substdio ss;
  substdio ssout;
+ struct timeval tv;
+ unsigned long tcopy;
+ unsigned long tfsync;
 
  sig_alarmcatch(sigalrm);
  if (chdir(dir) == -1) {
@@ -127,6 +202,7 @@ char *dir;
  byte_copy(fnnewtph,3,"new");
 
  alarm(86400);
+ timing_mark(&tv);
  fd = open_excl(fntmptph);
  if (fd == -1) _exit(1);
 
@@ -135,14 +211,29 @@ char *dir;
  if (substdio_put(&ssout,rpline.s,rpline.len) == -1) goto fail;
  if (substdio_put(&ssout,dtline.s,dtline.len) == -1) goto fail;
 
+#ifdef HASCOPYFR
+ /* headers first, then the body goes straight from the queue file */
+ if (substdio_flush(&ssout) == -1) goto fail;
+ switch(maildir_copy(fd))
+  {
+   case 1: break;
+   case -3: goto fail;
+   default:
+#endif
  switch(substdio_copy(&ssout,&ss))
   {
    case -2: tryunlinktmp(); _exit(4);
    case -3: goto fail;
   }
+#ifdef HASCOPYFR
+  }
+#endif
 
  if (substdio_flush(&ssout) == -1) goto fail;
+ tcopy = timing_since(&tv);
+ timing_mark(&tv);
  if (fsync(fd) == -1) goto fail;
+ tfsync = timing_since(&tv);
  if (fstat(fd, &st) == -1) goto fail;
  if (close(fd) == -1) goto fail; /* NFS dorks */
 
@@ -158,8 +249,20 @@ char *dir;
    close(msfd);
  }
   
+ timing_mark(&tv);
  if (link(fntmptph,fnnewtph) == -1) goto fail;
    /* if it was error_exist, almost certainly successful; i hate NFS */
+ if (flagtiming)
+  {
+   substdio_puts(subfdoutsmall,"timing maildir=");
+   substdio_puts(subfdoutsmall,dir);
+   timing_put("quota",timing_quota);
+   timing_put("copy",tcopy);
+   timing_put("fsync",tfsync);
+   timing_put("link",timing_since(&tv));
+   timing_put("bytes",(unsigned long) st.st_size);
+   substdio_putsflush(subfdoutsmall,"\n");
+  }
  tryunlinktmp(); _exit(0);
 
  fail: tryunlinktmp(); _exit(1);
@@ -224,6 +327,7 @@ char *fn;
  int perc;
  quota_t q;
  unsigned long mailsize;
+ struct timeval tv;
 
 #ifdef AUTOMAILDIRMAKE
  switch (maildir_make(fn)) {
@@ -237,6 +341,7 @@ char *fn;
  }
 #endif
 
+ timing_mark(&tv);
  if (quotastring && *quotastring) {
    if (fstat(0, &mailst) != 0)
        strerr_die3x(111,"Can not stat mail for quota: ",
@@ -273,6 +378,7 @@ char *fn;
      /* drop a warning when mailbox is around 80% full */
      quota_warning(fn);
  }
+ timing_quota = timing_since(&tv);
  
  /* end -- quota handling maildir */
 
@@ -316,7 +422,11 @@ char *fn;
  struct stat filest, mailst;
  unsigned long totalsize;
  quota_t q;
+ struct timeval tv;
+ unsigned long tlock;
+ unsigned long tcopy;
 
+ timing_mark(&tv);
  if( quotastring && *quotastring ) {
    quota_get(&q, quotastring);
    if (stat(fn, &filest) == -1) {
@@ -335,6 +445,7 @@ char *fn;
    if (totalsize > q.quota_size)
      quota_bounce("mailbox");
  }
+ timing_quota = timing_since(&tv);
  
  /* end -- quota handling mbox */
 
@@ -344,15 +455,18 @@ char *fn;
  if (fd == -1)
    strerr_die5x(111,"Unable to open ",fn,": ",error_str(errno),". (#4.2.1)");
 
+ timing_mark(&tv);
  sig_alarmcatch(temp_slowlock);
  alarm(30);
  flaglocked = (lock_ex(fd) != -1);
  alarm(0);
  sig_alarmdefault();
+ tlock = timing_since(&tv);
 
  seek_end(fd);
  pos = seek_cur(fd);
 
+ timing_mark(&tv);
  substdio_fdbuf(&ss,subread,0,buf,sizeof(buf));
  substdio_fdbuf(&ssout,subwrite,fd,outbuf,sizeof(outbuf));
  if (substdio_put(&ssout,ufline.s,ufline.len)) goto writeerrs;
@@ -378,7 +492,20 @@ char *fn;
   }
  if (substdio_bputs(&ssout,"\n")) goto writeerrs;
  if (substdio_flush(&ssout)) goto writeerrs;
+ tcopy = timing_since(&tv);
+ timing_mark(&tv);
  if (fsync(fd) == -1) goto writeerrs;
+ if (flagtiming)
+  {
+   substdio_puts(subfdoutsmall,"timing mbox=");
+   substdio_puts(subfdoutsmall,fn);
+   timing_put("quota",timing_quota);
+   timing_put("lock",tlock);
+   timing_put("copy",tcopy);
+   timing_put("fsync",timing_since(&tv));
+   timing_put("bytes",(unsigned long) (seek_cur(fd) - pos));
+   substdio_putsflush(subfdoutsmall,"\n");
+  }
  close(fd);
  return;
 
@@ -389,28 +516,40 @@ char *fn;
  _exit(111);
 }
 
-void mailprogram(prog)
+int mailprogram_start(prog,flagreopen)
 char *prog;
+int flagreopen;
 {
  int child;
+ int fd;
  char *(args[4]);
- int wstat;
-
- if (seek_begin(0) == -1) temp_rewind();
 
  switch(child = fork())
   {
    case -1:
      temp_fork();
    case 0:
+     if (flagreopen)
+      {
+       /* own offset in the message, the others read it concurrently */
+       fd = open_read("/dev/fd/0");
+       if (fd == -1)
+	 strerr_die3x(111,"Unable to reopen message: ",error_str(errno),". (#4.3.0)");
+       if (fd_move(0,fd) == -1)
+	 strerr_die3x(111,"Unable to reopen message: ",error_str(errno),". (#4.3.0)");
+      }
      args[0] = (char *)"/bin/sh"; args[1] = (char *)"-c";
      args[2] = prog; args[3] = 0;
      sig_pipedefault();
      execv(*args,args);
      strerr_die3x(111,"Unable to run /bin/sh: ",error_str(errno),". (#4.3.0)");
   }
+ return child;
+}
 
- wait_pid(&wstat,child);
+void mailprogram_status(wstat)
+int wstat;
+{
  if (wait_crashed(wstat))
    temp_childcrashed();
  switch(wait_exitcode(wstat))
@@ -423,6 +562,91 @@ char *prog;
   }
 }
 
+void mailprogram(prog)
+char *prog;
+{
+ int child;
+ int wstat;
+
+ if (seek_begin(0) == -1) temp_rewind();
+
+ child = mailprogram_start(prog,0);
+ wait_pid(&wstat,child);
+ mailprogram_status(wstat);
+}
+
+/* consecutive program deliveries, run up to maxparallel at a time */
+struct program {
+  char *cmd;
+  int pid;
+  int wstat;
+};
+struct program *programs;
+unsigned int numprograms = 0;
+unsigned long maxparallel = 1;
+
+void mailprogram_flush()
+{
+ unsigned int started;
+ unsigned int done;
+ unsigned int i;
+ int flagstop;
+ int pid;
+ int wstat;
+
+ /* programs are judged in .qmail order; once one did not exit 0 no
+    more are started, as if they had been run one after the other */
+ started = 0;
+ flagstop = 0;
+ for (done = 0;done < numprograms;++done)
+  {
+   while ((pid = wait_nohang(&wstat)) > 0)
+     for (i = done;i < started;++i)
+       if (programs[i].pid == pid)
+	{
+	 programs[i].pid = 0;
+	 programs[i].wstat = wstat;
+	 if (wstat) flagstop = 1;
+	}
+   while (!flagstop && (started < numprograms) && (started - done < maxparallel))
+    {
+     programs[started].pid = mailprogram_start(programs[started].cmd,1);
+     ++started;
+    }
+   if (programs[done].pid)
+     wait_pid(&programs[done].wstat,programs[done].pid);
+   programs[done].pid = 0;
+   if (programs[done].wstat) break;
+  }
+ numprograms = 0;
+ if (done == started) return;
+
+ /* programs already running behind the failed one still have to finish */
+ wstat = programs[done].wstat;
+ for (i = done + 1;i < started;++i)
+   if (programs[i].pid)
+     wait_pid(&programs[i].wstat,programs[i].pid);
+ mailprogram_status(wstat);
+}
+
+void mailprogram_setup()
+{
+ int fd;
+ int flagown;
+
+ if (maxparallel <= 1) return;
+ /* concurrent programs need their own file offset in the message */
+ if (seek_begin(0) == -1) temp_rewind();
+ flagown = 0;
+ fd = open_read("/dev/fd/0");
+ if (fd != -1)
+  {
+   if (seek_set(fd,(seek_pos) 1) == 0) flagown = (seek_cur(0) == 0);
+   close(fd);
+  }
+ if (!flagown) maxparallel = 1;
+}
+
 unsigned long mailforward_qp = 0;
 
 void mailforward(recips)
@@ -502,6 +726,7 @@ char *dashowner;
  if (!stralloc_cat(&qme,&safeext)) temp_nomem();
  if (!stralloc_cats(&qme,dashowner)) temp_nomem();
  if (!stralloc_0(&qme)) temp_nomem();
+ if (!dotcache_has(qme.s)) return -1;
  if (stat(qme.s,&st) == -1)
   {
    if (error_temp(errno)) temp_qmail(qme.s);
@@ -517,6 +742,7 @@ int *cutable;
   struct stat st;
 
   if (!stralloc_0(&qme)) temp_nomem();
+  if (!dotcache_has(qme.s)) return 0;
 
   *fd = open_read(qme.s);
   if (*fd == -1) {
@@ -602,6 +828,13 @@ void count_print()
    substdio_put(subfdoutsmall,count_buf,fmt_ulong(count_buf,mailforward_qp));
    substdio_puts(subfdoutsmall,"\n");
   }
+ if (flagtiming)
+  {
+   substdio_puts(subfdoutsmall,"timing");
+   timing_put("dot",timing_dot);
+   timing_put("total",timing_since(&timing_begin));
+   substdio_puts(subfdoutsmall,"\n");
+  }
  substdio_flush(subfdoutsmall);
 }
 
@@ -658,6 +891,9 @@ char **argv;
  sig_pipeignore();
 
  if (!env_init()) temp_nomem();
+ if (env_get(ENV_TIMING)) flagtiming = 1;
+ if ((s = env_get(ENV_PARALLEL))) scan_ulong(s,&maxparallel);
+ timing_mark(&timing_begin);
 
  flagdoit = 1;
  while ((opt = getopt(argc,argv,"nN")) != opteof)
@@ -909,6 +1145,10 @@ char **argv;
    if (!stralloc_cats(&cmds, "#\n")) temp_nomem();
  } 
  if (qmode & DO_DOT) { /* start dotqmail */
+   struct timeval tv;
+
+   timing_mark(&tv);
+   if (env_get(ENV_DOTCACHE)) dotcache_init();
    qmesearch(&fd,&flagforwardonly);
    if (fd == -1)
      if (*dash)
@@ -936,6 +1176,7 @@ char **argv;
 
    if (fd != -1)
      if (slurpclose(fd,&cmds,256) == -1) temp_nomem();
+   timing_dot = timing_since(&tv);
 
  } else if (!qmode & DO_LDAP) /* impossible see dotmode handling */
    strerr_die1x(100,"Error: No valid delivery mode selected. (#5.3.5)");
@@ -953,7 +1194,8 @@ char **argv;
  for (j = 0;j < cmds.len;++j)
    if (cmds.s[j] == '\n')
     {
-     switch(cmds.s[i]) { case '#': case '.': case '/': case '|': break;
+     switch(cmds.s[i]) { case '#': case '.': case '/': break;
+       case '|': ++numprograms; break;
        default: ++numforward; }
      i = j + 1;
     }
@@ -964,6 +1206,11 @@ char **argv;
  if (!recips) temp_nomem();
  numforward = 0;
 
+ programs = (struct program *) alloc((numprograms + 1) * sizeof(struct program));
+ if (!programs) temp_nomem();
+ numprograms = 0;
+ if (flagdoit) mailprogram_setup();
+
  flag99 = 0;
 
  i = 0;
@@ -974,6 +1221,11 @@ char **argv;
      k = j;
      while ((k > i) && ((cmds.s[k - 1] == ' ') || (cmds.s[k - 1] == '\t')))
        cmds.s[--k] = 0;
+     if (numprograms && (cmds.s[i] != '|') && (cmds.s[i] != '#'))
+      {
+       mailprogram_flush();
+       if (flag99) break;
+      }
      switch(cmds.s[i])
       {
        case 0: /* k == i */
@@ -1007,7 +1259,9 @@ char **argv;
 	 if (flagforwardonly) strerr_die1x(111,"Uh-oh: .qmail has prog delivery but has x bit set. (#4.7.0)");
 	 if (flagforwardonly2)
 	   strerr_die1x(111,"Uh-oh: user has prog delivery but is not allowed to. (#4.7.0)");
-         if (flagdoit) mailprogram(cmds.s + i + 1);
+         if (flagdoit)
+           if (maxparallel > 1) programs[numprograms++].cmd = cmds.s + i + 1;
+           else mailprogram(cmds.s + i + 1);
          else sayit("program ",cmds.s + i + 1,k - i - 1);
          break;
        case '+':
@@ -1029,6 +1283,7 @@ char **argv;
      i = j + 1;
      if (flag99) break;
     }
+ if (numprograms) mailprogram_flush();
 
  if (numforward) if (flagdoit) if (!flagnoforward)
   {
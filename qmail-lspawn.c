@@ -919,6 +919,16 @@ char *s; char *r; unsigned int at;
    if (prot_gid(gid) == -1) _exit(QLX_USAGE);
    if (prot_uid(uid) == -1) _exit(QLX_USAGE);
    if (!getuid()) _exit(QLX_ROOT);
+   if (localtiming())
+     if (!env_put2(ENV_TIMING, "1")) _exit(QLX_NOMEM);
+   if (localparallel() > 1) {
+     char num[FMT_ULONG];
+
+     num[fmt_ulong(num, localparallel())] = 0;
+     if (!env_put2(ENV_PARALLEL, num)) _exit(QLX_NOMEM);
+   }
+   if (localdotcache())
+     if (!env_put2(ENV_DOTCACHE, "1")) _exit(QLX_NOMEM);
 
 #ifdef AUTOHOMEDIRMAKE
    check_home(args[3], aliasempty);
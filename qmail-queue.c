@@ -1,3 +1,8 @@
+#include "hassyncfr.h"
+#ifdef HASSYNCFR
+#define _GNU_SOURCE
+#include <fcntl.h>
+#endif
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -34,9 +39,9 @@ struct constmap mapbb;
 
 #endif
 
-char inbuf[2048];
+char inbuf[SUBSTDIO_INSIZE];
 struct substdio ssin;
-char outbuf[256];
+char outbuf[SUBSTDIO_OUTSIZE];
 struct substdio ssout;
 
 datetime_sec starttime;
@@ -237,8 +242,12 @@ int main()
   }
 
  if (substdio_flush(&ssout) == -1) die_write();
- if (fsync(messfd) == -1) die_write();
+#ifdef HASSYNCFR
+ /* start writing the message out while the envelope is read */
+ sync_file_range(messfd,0,0,SYNC_FILE_RANGE_WRITE);
+#endif
 
+ /* intd/ is invisible to qmail-send, so mess/ may be synced later */
  intdfd = open_excl(intdfn);
  if (intdfd == -1) die(65);
  flagmadeintd = 1;
@@ -311,6 +320,7 @@ int main()
 #endif
  
  if (substdio_flush(&ssout) == -1) die_write();
+ if (fsync(messfd) == -1) die_write();
  if (fsync(intdfd) == -1) die_write();
 
  if (link(intdfn,todofn) == -1) die(66);
@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2000-2004 Claudio Jeker,
+ *      Internet Business Solutions AG, CH-8005 Zrich, Switzerland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Internet Business
+ *      Solutions AG and its contributors.
+ * 4. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "auto_qmail.h"
+#include "byte.h"
+#include "error.h"
+#include "exit.h"
+#include "fmt.h"
+#include "readwrite.h"
+#include "sig.h"
+#include "substdio.h"
+
+/*
+ * qmail-queuec is a drop-in replacement for qmail-queue (e.g. via
+ * QMAILQUEUE) that hands the message to qmail-queued. If the daemon
+ * is not running qmail-queue is executed instead.
+ */
+
+#define SOCKET "queue/lock/queued"
+#define DEATH 86400 /* 24 hours; _must_ be below q-s's OSSIFIED (36 hours) */
+
+char *qqargs[2] = { "bin/qmail-queue", 0 };
+
+void die(int e) { _exit(e); }
+void sigalrm(void) { die(52); }
+void sigbug(void) { die(81); }
+
+char inbuf[4096];
+char outbuf[4096];
+char envbuf[1024];
+char num[FMT_ULONG];
+substdio ssout;
+substdio ssenv;
+int flagerr = 0;
+
+static void
+put(const char *s, unsigned int len)
+{
+	if (!flagerr)
+		if (substdio_put(&ssout, s, len) == -1) flagerr = 1;
+}
+
+static void
+putnum(char ch, unsigned long u)
+{
+	put(&ch, 1);
+	put(num, fmt_ulong(num, u));
+	put("", 1);
+}
+
+static int
+connectqueued(void)
+{
+	struct sockaddr_un sa;
+	int s;
+
+	byte_zero(&sa, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	byte_copy(sa.sun_path, sizeof(SOCKET), SOCKET);
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1) return -1;
+	if (connect(s, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+int
+main(void)
+{
+	int s, r;
+	char ch;
+
+	sig_pipeignore();
+	sig_alarmcatch(sigalrm);
+	sig_bugcatch(sigbug);
+	alarm(DEATH);
+
+	if (chdir(auto_qmail) == -1) die(61);
+	s = connectqueued();
+	if (s == -1) {
+		execv(*qqargs, qqargs);
+		die(120);
+	}
+	substdio_fdbuf(&ssout, subwrite, s, outbuf, sizeof(outbuf));
+
+	putnum('u', getuid());
+	putnum('p', getpid());
+
+	/* the message in chunks */
+	for (;;) {
+		r = read(0, inbuf, sizeof(inbuf));
+		if (r == -1) {
+			if (errno == error_intr) continue;
+			die(54);
+		}
+		put(num, fmt_ulong(num, r));
+		put(":", 1);
+		if (r == 0) break;
+		put(inbuf, r);
+	}
+
+	/* the envelope, up to and including the terminating \0 */
+	substdio_fdbuf(&ssenv, subread, 1, envbuf, sizeof(envbuf));
+	if (substdio_get(&ssenv, &ch, 1) < 1) die(54);
+	if (ch != 'F') die(91);
+	for (;;) {
+		put(&ch, 1);
+		do {
+			if (substdio_get(&ssenv, &ch, 1) < 1) die(54);
+			put(&ch, 1);
+		} while (ch);
+		if (substdio_get(&ssenv, &ch, 1) < 1) die(54);
+		if (!ch) break;
+		if (flagerr) break;
+	}
+	put("", 1);
+	if (!flagerr)
+		if (substdio_flush(&ssout) == -1) flagerr = 1;
+
+	/* qmail-queued answers with the exit code, even on errors */
+	while ((r = read(s, &ch, 1)) == -1)
+		if (errno != error_intr) break;
+	if (r != 1) die(flagerr ? 53 : 74);
+	die((unsigned char)ch);
+	/* NOTREACHED */
+	return 111;
+}
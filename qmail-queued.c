@@ -0,0 +1,752 @@
+/*
+ * Copyright (c) 2000-2004 Claudio Jeker,
+ *      Internet Business Solutions AG, CH-8005 Zrich, Switzerland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Internet Business
+ *      Solutions AG and its contributors.
+ * 4. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#include "hassyncfr.h"
+#include "hasuring.h"
+#ifdef HASSYNCFR
+#define _GNU_SOURCE
+#include <fcntl.h>
+#endif
+#ifdef HASURING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "alloc.h"
+#include "auto_qmail.h"
+#include "auto_uids.h"
+#include "byte.h"
+#ifdef BIGBROTHER
+#include "constmap.h"
+#include "control.h"
+#endif
+#include "date822fmt.h"
+#include "datetime.h"
+#include "error.h"
+#include "extra.h"
+#include "fmt.h"
+#include "fmtqfn.h"
+#include "ndelay.h"
+#include "now.h"
+#include "open.h"
+#include "readwrite.h"
+#include "scan.h"
+#include "seek.h"
+#include "select.h"
+#include "sig.h"
+#include "str.h"
+#include "stralloc.h"
+#include "strerr.h"
+#include "triggerpull.h"
+
+/*
+ * qmail-queued accepts messages from qmail-queuec over a local socket
+ * and puts them into the queue just like qmail-queue would. Messages
+ * that are complete at the same time are synced together and only then
+ * linked into todo/ and acknowledged. So the fsync costs are shared by
+ * all concurrent injections instead of being paid by each of them.
+ *
+ * Protocol (all numbers decimal):
+ *   u<uid>\0p<pid>\0	the caller of qmail-queuec
+ *   <len>:<data>	message body in chunks, terminated by 0:
+ *   F<addr>\0T<addr>\0...\0	the envelope as read by qmail-queue
+ * The answer is a single byte holding the qmail-queue exit code.
+ * With BIGBROTHER ~control/bigbrother is read once at startup, so the
+ * daemon needs a restart after the file was changed.
+ */
+
+#define FATAL "qmail-queued: fatal: "
+#define WARN "qmail-queued: warning: "
+
+#define SOCKET "lock/queued"
+#define MAXCONN 64
+#define DEATH 86400 /* 24 hours; _must_ be below q-s's OSSIFIED (36 hours) */
+#define ADDR 1003
+
+enum cstate {
+	S_FREE, S_HEAD, S_LEN, S_DATA, S_ENVF, S_FADDR, S_ENVT, S_TADDR,
+	S_DONE
+};
+
+struct conn {
+	enum cstate	state;
+	int		fd;
+	int		messfd;
+	int		intdfd;
+	int		flagmademess;
+	int		flagmadeintd;
+	datetime_sec	start;
+	unsigned long	left;
+	unsigned int	addrlen;
+	stralloc	env;
+#ifdef HASURING
+	unsigned int	uring;	/* steps done, failed steps << 4 */
+#endif
+#ifdef BIGBROTHER
+	stralloc	bbaddr;
+#endif
+	char		messfn[FMTQFN];
+	char		intdfn[FMTQFN];
+	char		todofn[FMTQFN];
+};
+
+struct conn conns[MAXCONN];
+unsigned int numconns = 0;
+unsigned long mypid;
+unsigned long seq = 0;
+char buf[4096];
+
+#ifdef BIGBROTHER
+int bbon = 0;
+stralloc bbs = {0};
+struct constmap mapbb;
+#endif
+
+static void
+cleanup(struct conn *c)
+{
+	if (c->flagmadeintd) {
+		seek_trunc(c->intdfd, 0);
+		unlink(c->intdfn);
+	}
+	if (c->flagmademess) {
+		seek_trunc(c->messfd, 0);
+		unlink(c->messfn);
+	}
+}
+
+static void
+finish(struct conn *c, int code)
+{
+	char ch;
+
+	if (code != 0)
+		cleanup(c);
+	if (c->messfd != -1) close(c->messfd);
+	if (c->intdfd != -1) close(c->intdfd);
+	ch = code;
+	write(c->fd, &ch, 1); /* if the client is gone, bummer */
+	close(c->fd);
+	c->state = S_FREE;
+	c->fd = c->messfd = c->intdfd = -1;
+	--numconns;
+}
+
+static int
+writeall(int fd, const char *s, unsigned int len)
+{
+	int w;
+
+	while (len > 0) {
+		w = write(fd, s, len);
+		if (w == -1) {
+			if (errno == error_intr) continue;
+			return -1;
+		}
+		s += w;
+		len -= w;
+	}
+	return 0;
+}
+
+static unsigned int
+receivedfmt(char *s, unsigned long uid, unsigned long pid)
+{
+	struct datetime dt;
+	unsigned int i;
+	unsigned int len;
+
+	datetime_tai(&dt, now());
+	len = 0;
+	i = fmt_str(s, "Received: (qmail "); len += i; if (s) s += i;
+	i = fmt_ulong(s, pid); len += i; if (s) s += i;
+	i = fmt_str(s, " invoked "); len += i; if (s) s += i;
+	if (uid == auto_uida) {
+		i = fmt_str(s, "by alias"); len += i; if (s) s += i;
+	} else if (uid == auto_uidd) {
+		i = fmt_str(s, "from network"); len += i; if (s) s += i;
+	} else if (uid == auto_uids) {
+		i = fmt_str(s, "for bounce"); len += i; if (s) s += i;
+	} else {
+		i = fmt_str(s, "by uid "); len += i; if (s) s += i;
+		i = fmt_ulong(s, uid); len += i; if (s) s += i;
+	}
+	i = fmt_str(s, "); "); len += i; if (s) s += i;
+	i = date822fmt(s, &dt); len += i; if (s) s += i;
+	return len;
+}
+
+/* the u and p records are complete, create the message file */
+static int
+messopen(struct conn *c)
+{
+	struct stat st;
+	char pidfn[FMTQFN + 3 * FMT_ULONG];
+	char received[200];
+	unsigned long uid, pid, messnum;
+	unsigned int i, len;
+
+	i = 0;
+	if (c->env.s[i++] != 'u') return 91;
+	i += scan_ulong(c->env.s + i, &uid);
+	if (c->env.s[i++] != '\0') return 91;
+	if (c->env.s[i++] != 'p') return 91;
+	i += scan_ulong(c->env.s + i, &pid);
+	if (c->env.s[i++] != '\0' || i != c->env.len) return 91;
+
+	len = fmt_str(pidfn, "pid/");
+	len += fmt_ulong(pidfn + len, mypid);
+	len += fmt_str(pidfn + len, ".");
+	len += fmt_ulong(pidfn + len, c->start);
+	len += fmt_str(pidfn + len, ".");
+	len += fmt_ulong(pidfn + len, ++seq);
+	pidfn[len] = '\0';
+	c->messfd = open_excl(pidfn);
+	if (c->messfd == -1) return 63;
+	if (fstat(c->messfd, &st) == -1) { unlink(pidfn); return 63; }
+
+	messnum = st.st_ino;
+	fmtqfn(c->messfn, "mess/", messnum, 1);
+#ifndef BIGTODO
+	fmtqfn(c->todofn, "todo/", messnum, 0);
+	fmtqfn(c->intdfn, "intd/", messnum, 0);
+#else
+	fmtqfn(c->todofn, "todo/", messnum, 1);
+	fmtqfn(c->intdfn, "intd/", messnum, 1);
+#endif
+	if (link(pidfn, c->messfn) == -1) { unlink(pidfn); return 64; }
+	if (unlink(pidfn) == -1) return 63;
+	c->flagmademess = 1;
+
+	if (receivedfmt((char *)0, uid, pid) > sizeof(received))
+		return 81;
+	len = receivedfmt(received, uid, pid);
+	if (writeall(c->messfd, received, len) == -1) return 53;
+	return 0;
+}
+
+/* the envelope is complete, write it to intd/ without syncing it */
+static int
+intdopen(struct conn *c)
+{
+#ifdef HASSYNCFR
+	/* start writing the message out, it is synced with the batch */
+	sync_file_range(c->messfd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+	c->intdfd = open_excl(c->intdfn);
+	if (c->intdfd == -1) return 65;
+	c->flagmadeintd = 1;
+	if (writeall(c->intdfd, c->env.s, c->env.len) == -1) return 53;
+	return 0;
+}
+
+#ifdef BIGBROTHER
+/* add the observers of the sender and the recipients to the envelope */
+static int
+bigbrother(struct conn *c)
+{
+	const char *b;
+	char *x;
+	unsigned int xlen, n, j;
+
+	if (!bbon) return 0;
+	x = c->bbaddr.s;
+	xlen = c->bbaddr.len;
+	while (xlen > 0) {
+		n = byte_chr(x, xlen, 0);
+		if (!(b = constmap(&mapbb, x, n)))
+			if ((j = byte_rchr(x, n, '@')) < n)
+				b = constmap(&mapbb, x + j, n - j);
+		if (b && *b) {
+			if (!stralloc_append(&c->env, "T")) return 51;
+			if (!stralloc_cats(&c->env, b)) return 51;
+			if (!stralloc_0(&c->env)) return 51;
+		}
+		if (n++ >= xlen) break;
+		x += n; xlen -= n;
+	}
+	return 0;
+}
+#endif
+
+/* feed the bytes read from the client through the protocol machine */
+static int
+parse(struct conn *c, char *s, unsigned int len)
+{
+	unsigned int n;
+	int r;
+	char ch;
+
+	while (len > 0) {
+		switch (c->state) {
+		case S_HEAD:
+			ch = *s++; --len;
+			if (!stralloc_append(&c->env, &ch)) return 51;
+			if (c->env.len > 2 * FMT_ULONG + 4) return 91;
+			if (ch == '\0' && c->env.s[0] == 'u' &&
+			    byte_chr(c->env.s, c->env.len, 'p') <
+			    c->env.len) {
+				r = messopen(c);
+				if (r != 0) return r;
+				c->left = 0;
+				c->state = S_LEN;
+			}
+			break;
+		case S_LEN:
+			ch = *s++; --len;
+			if (ch == ':') {
+				c->state = c->left ? S_DATA : S_ENVF;
+				break;
+			}
+			if ((unsigned char)(ch - '0') > 9) return 91;
+			if (c->left > sizeof(buf) * 1024) return 91;
+			c->left = c->left * 10 + (ch - '0');
+			break;
+		case S_DATA:
+			n = len < c->left ? len : c->left;
+			if (writeall(c->messfd, s, n) == -1) return 53;
+			s += n; len -= n;
+			c->left -= n;
+			if (c->left == 0) c->state = S_LEN;
+			break;
+		case S_ENVF:
+		case S_ENVT:
+			ch = *s++; --len;
+			if (c->state == S_ENVT && ch == '\0') {
+#ifdef BIGBROTHER
+				r = bigbrother(c);
+				if (r != 0) return r;
+#endif
+				r = intdopen(c);
+				if (r != 0) return r;
+				c->state = S_DONE;
+				break;
+			}
+			if (ch != (c->state == S_ENVF ? 'F' : 'T')) return 91;
+			if (!stralloc_append(&c->env, &ch)) return 51;
+			c->addrlen = 0;
+			c->state = c->state == S_ENVF ? S_FADDR : S_TADDR;
+			break;
+		case S_FADDR:
+		case S_TADDR:
+			ch = *s++; --len;
+			if (!stralloc_append(&c->env, &ch)) return 51;
+#ifdef BIGBROTHER
+			if (bbon)
+				if (!stralloc_append(&c->bbaddr, &ch))
+					return 51;
+#endif
+			if (ch != '\0') {
+				if (++c->addrlen >= ADDR) return 11;
+				break;
+			}
+			if (c->state == S_FADDR)
+				if (!stralloc_catb(&c->env,
+				    QUEUE_EXTRA, QUEUE_EXTRALEN))
+					return 51;
+			c->state = S_ENVT;
+			break;
+		case S_DONE:
+			/* garbage after the envelope */
+			return 91;
+		default:
+			return 81;
+		}
+	}
+	return 0;
+}
+
+static void
+doread(struct conn *c)
+{
+	int r;
+
+	r = read(c->fd, buf, sizeof(buf));
+	if (r == -1) {
+		if (errno == error_intr || errno == error_again) return;
+		finish(c, 54);
+		return;
+	}
+	if (r == 0) {
+		/* client went away before the envelope was complete */
+		finish(c, 54);
+		return;
+	}
+	r = parse(c, buf, r);
+	if (r != 0) finish(c, r);
+}
+
+static void
+doaccept(int s)
+{
+	struct conn *c;
+	unsigned int i;
+	int fd;
+
+	fd = accept(s, (struct sockaddr *)0, (socklen_t *)0);
+	if (fd == -1) return;
+	for (i = 0; i < MAXCONN; i++)
+		if (conns[i].state == S_FREE)
+			break;
+	if (i >= MAXCONN) { close(fd); return; }
+	if (ndelay_on(fd) == -1) { close(fd); return; }
+	c = &conns[i];
+	c->fd = fd;
+	c->messfd = c->intdfd = -1;
+	c->flagmademess = c->flagmadeintd = 0;
+	c->start = now();
+	c->env.len = 0;
+#ifdef BIGBROTHER
+	c->bbaddr.len = 0;
+#endif
+	c->state = S_HEAD;
+	++numconns;
+}
+
+#ifdef HASURING
+/*
+ * With io_uring the fsyncs and the link into todo/ of all complete
+ * messages are handed to the kernel with a single system call and run
+ * in parallel. Each message is one linked chain: fsync mess, fsync intd,
+ * link. A failing step cancels the rest of its chain, so a message is
+ * still never linked before it is on disk. The ring is set up once;
+ * a kernel without io_uring or IORING_OP_LINKAT uses the plain path.
+ */
+struct {
+	int			fd;
+	unsigned int		*sqtail;
+	unsigned int		*sqmask;
+	unsigned int		*sqarray;
+	unsigned int		*cqhead;
+	unsigned int		*cqtail;
+	unsigned int		*cqmask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+} ring;
+int flaguring = 0;
+
+static void
+uring_init(void)
+{
+	struct io_uring_params p;
+	struct io_uring_probe *probe;
+	unsigned int len;
+	char *sq, *cq;
+	int ok;
+
+	byte_zero(&p, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, 4 * MAXCONN, &p);
+	if (ring.fd == -1)
+		return;
+	len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	if (!(probe = (struct io_uring_probe *)alloc(len)))
+		goto fail;
+	byte_zero(probe, len);
+	ok = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE,
+	    probe, 256) == 0 && probe->last_op >= IORING_OP_LINKAT &&
+	    probe->ops[IORING_OP_FSYNC].flags & IO_URING_OP_SUPPORTED &&
+	    probe->ops[IORING_OP_LINKAT].flags & IO_URING_OP_SUPPORTED;
+	alloc_free(probe);
+	if (!ok)
+		goto fail;
+
+	sq = mmap(0, p.sq_off.array + p.sq_entries * sizeof(unsigned int),
+	    PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, IORING_OFF_SQ_RING);
+	cq = mmap(0, p.cq_off.cqes + p.cq_entries *
+	    sizeof(struct io_uring_cqe), PROT_READ | PROT_WRITE, MAP_SHARED,
+	    ring.fd, IORING_OFF_CQ_RING);
+	ring.sqes = mmap(0, p.sq_entries * sizeof(struct io_uring_sqe),
+	    PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, IORING_OFF_SQES);
+	if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED)
+		goto fail; /* the mappings go away with the process */
+	ring.sqtail = (unsigned int *)(sq + p.sq_off.tail);
+	ring.sqmask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ring.sqarray = (unsigned int *)(sq + p.sq_off.array);
+	ring.cqhead = (unsigned int *)(cq + p.cq_off.head);
+	ring.cqtail = (unsigned int *)(cq + p.cq_off.tail);
+	ring.cqmask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	flaguring = 1;
+	return;
+fail:
+	close(ring.fd);
+}
+
+static struct io_uring_sqe *
+uring_prep(unsigned int n, int op, int fd, unsigned int i,
+    unsigned int step)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int k;
+
+	k = (*ring.sqtail + n) & *ring.sqmask;
+	ring.sqarray[k] = k;
+	sqe = &ring.sqes[k];
+	byte_zero(sqe, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = i << 2 | step;
+	if (step < 2)
+		sqe->flags = IOSQE_IO_LINK;
+	return sqe;
+}
+
+/* messages whose chains were not run are left to the plain path */
+static int
+commit_uring(void)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct conn *c;
+	unsigned int i, n, got, head, tail;
+	int r, flagtrigger;
+
+	n = 0;
+	for (i = 0; i < MAXCONN; i++) {
+		c = &conns[i];
+		if (c->state != S_DONE) continue;
+		c->uring = 0;
+		uring_prep(n++, IORING_OP_FSYNC, c->messfd, i, 0);
+		uring_prep(n++, IORING_OP_FSYNC, c->intdfd, i, 1);
+		sqe = uring_prep(n++, IORING_OP_LINKAT, AT_FDCWD, i, 2);
+		sqe->addr = (unsigned long)c->intdfn;
+		sqe->len = AT_FDCWD;
+		sqe->addr2 = (unsigned long)c->todofn;
+	}
+	if (!n)
+		return 0;
+	__atomic_store_n(ring.sqtail, *ring.sqtail + n, __ATOMIC_RELEASE);
+	do
+		r = syscall(__NR_io_uring_enter, ring.fd, n, n,
+		    IORING_ENTER_GETEVENTS, (void *)0, 0);
+	while (r == -1 && errno == error_intr);
+	if (r != (int)n) {
+		if (r == -1)
+			strerr_warn2(WARN, "io_uring_enter failed, "
+			    "using plain fsync: ", &strerr_sys);
+		else
+			strerr_warn2(WARN, "io_uring did not take all "
+			    "requests, using plain fsync", 0);
+		flaguring = 0;
+		if (r <= 0)
+			return 0;
+	}
+
+	for (got = 0; got < (unsigned int)r; ) {
+		head = *ring.cqhead;
+		tail = __atomic_load_n(ring.cqtail, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			if (syscall(__NR_io_uring_enter, ring.fd, 0, 1,
+			    IORING_ENTER_GETEVENTS, (void *)0, 0) == -1 &&
+			    errno != error_intr)
+				strerr_die2sys(111, FATAL,
+				    "unable to wait for io_uring: ");
+			continue;
+		}
+		for (; head != tail; head++, got++) {
+			cqe = &ring.cqes[head & *ring.cqmask];
+			c = &conns[cqe->user_data >> 2];
+			if (cqe->res >= 0)
+				c->uring |= 1 << (cqe->user_data & 3);
+			else if (cqe->res != -ECANCELED)
+				c->uring |= 16 << (cqe->user_data & 3);
+		}
+		__atomic_store_n(ring.cqhead, head, __ATOMIC_RELEASE);
+	}
+
+	flagtrigger = 0;
+	for (i = 0; i < MAXCONN; i++) {
+		c = &conns[i];
+		if (c->state != S_DONE) continue;
+		if (c->uring == 7) {
+			flagtrigger = 1;
+			finish(c, 0);
+		} else if (c->uring & 48)
+			finish(c, 53);
+		else if (c->uring & 64)
+			finish(c, 66);
+	}
+	return flagtrigger;
+}
+#endif
+
+/*
+ * All messages that are complete are synced in one go. The first
+ * fsync pays for the journal commit, the others are mostly free.
+ */
+static void
+commit(void)
+{
+	struct conn *c;
+	unsigned int i;
+	int flagtrigger;
+
+	flagtrigger = 0;
+#ifdef HASURING
+	if (flaguring)
+		flagtrigger = commit_uring();
+#endif
+	for (i = 0; i < MAXCONN; i++) {
+		c = &conns[i];
+		if (c->state != S_DONE) continue;
+		if (fsync(c->messfd) == -1 || fsync(c->intdfd) == -1)
+			finish(c, 53);
+	}
+	for (i = 0; i < MAXCONN; i++) {
+		c = &conns[i];
+		if (c->state != S_DONE) continue;
+		if (link(c->intdfn, c->todofn) == -1) {
+			finish(c, 66);
+			continue;
+		}
+		flagtrigger = 1;
+		finish(c, 0);
+	}
+	if (flagtrigger) triggerpull();
+}
+
+int
+main(void)
+{
+	struct sockaddr_un sa;
+	struct timeval tv;
+	fd_set rfds;
+	datetime_sec t;
+	unsigned int i;
+	int s, maxfd, flagdone;
+
+	sig_pipeignore();
+	umask(033);
+	if (chdir(auto_qmail) == -1)
+		strerr_die4sys(111, FATAL, "unable to chdir to ",
+		    auto_qmail, ": ");
+#ifdef BIGBROTHER
+	if (control_init() == -1)
+		strerr_die2sys(111, FATAL, "unable to read controls: ");
+	switch (control_readfile(&bbs, "control/bigbrother", 0)) {
+	case -1:
+		strerr_die2sys(111, FATAL,
+		    "unable to read control/bigbrother: ");
+	case 0:
+		if (!constmap_init(&mapbb, "", 0, 1))
+			strerr_die2x(111, FATAL, "out of memory");
+		break;
+	case 1:
+		bbon = 1;
+		if (!constmap_init(&mapbb, bbs.s, bbs.len, 1))
+			strerr_die2x(111, FATAL, "out of memory");
+		break;
+	}
+#endif
+	if (chdir("queue") == -1)
+		strerr_die2sys(111, FATAL, "unable to chdir to queue: ");
+	mypid = getpid();
+
+	byte_zero(&sa, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	byte_copy(sa.sun_path, sizeof(SOCKET), SOCKET);
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1)
+		strerr_die2sys(111, FATAL, "unable to create socket: ");
+	if (unlink(SOCKET) == -1 && errno != error_noent)
+		strerr_die2sys(111, FATAL, "unable to remove old socket: ");
+	if (bind(s, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+		strerr_die2sys(111, FATAL, "unable to bind socket: ");
+	if (chmod(SOCKET, 0600) == -1)
+		strerr_die2sys(111, FATAL, "unable to chmod socket: ");
+	if (listen(s, MAXCONN) == -1)
+		strerr_die2sys(111, FATAL, "unable to listen on socket: ");
+	if (ndelay_on(s) == -1)
+		strerr_die2sys(111, FATAL, "unable to set socket non-blocking: ");
+
+	for (i = 0; i < MAXCONN; i++) {
+		conns[i].state = S_FREE;
+		conns[i].fd = conns[i].messfd = conns[i].intdfd = -1;
+	}
+#ifdef HASURING
+	uring_init();
+#endif
+
+	for (;;) {
+		FD_ZERO(&rfds);
+		maxfd = -1;
+		if (numconns < MAXCONN) {
+			FD_SET(s, &rfds);
+			maxfd = s;
+		}
+		for (i = 0; i < MAXCONN; i++) {
+			if (conns[i].state == S_FREE ||
+			    conns[i].state == S_DONE)
+				continue;
+			FD_SET(conns[i].fd, &rfds);
+			if (conns[i].fd > maxfd) maxfd = conns[i].fd;
+		}
+		tv.tv_sec = 60;
+		tv.tv_usec = 0;
+		if (select(maxfd + 1, &rfds, (fd_set *)0, (fd_set *)0,
+		    &tv) == -1) {
+			if (errno == error_intr) continue;
+			strerr_die2sys(111, FATAL, "select failed: ");
+		}
+
+		flagdone = 0;
+		for (i = 0; i < MAXCONN; i++) {
+			if (conns[i].state == S_FREE ||
+			    conns[i].state == S_DONE)
+				continue;
+			if (FD_ISSET(conns[i].fd, &rfds))
+				doread(&conns[i]);
+			if (conns[i].state == S_DONE)
+				flagdone = 1;
+		}
+		if (FD_ISSET(s, &rfds))
+			doaccept(s);
+		if (flagdone)
+			commit();
+
+		t = now();
+		for (i = 0; i < MAXCONN; i++)
+			if (conns[i].state != S_FREE &&
+			    conns[i].start + DEATH < t)
+				finish(&conns[i], 52);
+	}
+	/* NOTREACHED */
+	return 111;
+}
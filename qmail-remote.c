@@ -15,6 +15,8 @@
 #include "auto_qmail.h"
 #include "control.h"
 #include "dns.h"
+#include "dnscache.h"
+#include "qmtpconn.h"
 #include "alloc.h"
 #include "quote.h"
 #include "fmt.h"
@@ -34,6 +36,12 @@
 #include "timeoutwrite.h"
 #include "base64.h"
 #include "xtext.h"
+#include "byte.h"
+#include "hassendfile.h"
+#ifdef HASSENDFILE
+#include <sys/sendfile.h>
+#include "select.h"
+#endif
 #ifdef TLS_REMOTE /* openssl/ssh.h needs to be included befor zlib.h else ... */
 #include <sys/stat.h>
 #include <openssl/ssl.h>
@@ -42,6 +50,7 @@
 #endif
 #endif
 #ifdef DATA_COMPRESS
+#include <sys/time.h>
 #include <zlib.h>
 #endif
 
@@ -68,6 +77,10 @@ stralloc helohost = {0};
 stralloc outgoingip = {0};
 stralloc routes = {0};
 struct constmap maproutes;
+#ifdef DATA_COMPRESS
+stralloc zroutes = {0};
+struct constmap mapzroutes;
+#endif
 stralloc host = {0};
 stralloc sender = {0};
 stralloc auth_login = {0};
@@ -129,8 +142,11 @@ void outhost(void)
 }
 
 int flagcritical = 0;
+int flagreused = 0; /* smtpfd is an idle QMTP connection from qmtpconn */
+void qmtp_retry(void);
 
 void dropped(void) {
+  if (flagreused && !flagcritical) qmtp_retry(); /* only returns on failure */
   out("ZConnected to ");
   outhost();
   out(" but connection died. ");
@@ -142,6 +158,8 @@ void dropped(void) {
 int timeoutconnect = 60;
 int smtpfd;
 int timeout = 1200;
+int dnscachettl = 3600;
+int qmtpidle = 0;
 
 #ifdef TLS_REMOTE
 int flagtimedout = 0;
@@ -177,19 +195,68 @@ int ssl_timeoutwrite(int tout, int fd, void *buf, int n)
 
 #ifdef DATA_COMPRESS
 z_stream stream;
-char zbuf[4096];
+char zbuf[16384];
 int compdata = 0;
 int wantcomp = 0;
+int zcodecs = 0;	/* server listed its codecs after DATAZ */
+int zlevel = Z_DEFAULT_COMPRESSION;
+int zhuffman = 0;	/* inside a part that is compressed already */
+unsigned long zusec = 0;
+
+void zwrite(void)
+{
+  char *z;
+  int len, r;
+
+  z = zbuf;
+  len = sizeof(zbuf) - stream.avail_out;
+  while (len > 0) {
+#ifdef TLS_REMOTE
+    if (ssl)
+      r = ssl_timeoutwrite(timeout,smtpfd,z,len);
+    else
+#endif
+    r = timeoutwrite(timeout,smtpfd,z,len);
+    if (r <= 0) dropped();
+    z += r;
+    len -= r;
+  }
+  stream.avail_out = sizeof(zbuf);
+  stream.next_out = zbuf;
+}
+
+int zdeflate(int flush)
+{
+  struct timeval start, stop;
+  int r;
+
+  gettimeofday(&start,(struct timezone *) 0);
+  r = deflate(&stream,flush);
+  gettimeofday(&stop,(struct timezone *) 0);
+  zusec += (stop.tv_sec - start.tv_sec) * 1000000 +
+    stop.tv_usec - start.tv_usec;
+  return r;
+}
+
+void zfailed(void)
+{
+  out("ZSending compressed data to "); outhost();
+  out("but compression failed: ");
+  out(stream.msg ? stream.msg : "unknown error"); out(" (#4.4.2)\n");
+  zerodie();
+}
 
 void compression_init(void)
 {
   compdata = 1;
+  zhuffman = 0;
+  zusec = 0;
   stream.zalloc = Z_NULL;
   stream.zfree = Z_NULL;
   stream.opaque = Z_NULL;
   stream.avail_out = sizeof(zbuf);
   stream.next_out = zbuf;
-  if (deflateInit(&stream,Z_DEFAULT_COMPRESSION) != Z_OK) {
+  if (deflateInit(&stream,zlevel) != Z_OK) {
     out("ZInitalizing data compression failed: ");
     out(stream.msg); out(" #(4.3.0)\n");
     zerodie();
@@ -201,41 +268,21 @@ void compression_done(void)
 
   compdata = 0;
   do {
-    r = deflate(&stream,Z_FINISH);
+    r = zdeflate(Z_FINISH);
     switch (r) {
     case Z_OK:
-      if (stream.avail_out == 0) {
-#ifdef TLS_REMOTE
-	if (ssl)
-	  r = ssl_timeoutwrite(timeout,smtpfd,zbuf,sizeof(zbuf));
-	else
-#endif
-	r = timeoutwrite(timeout,smtpfd,zbuf,sizeof(zbuf));
-	if (r <= 0) dropped();
-	stream.avail_out = sizeof(zbuf);
-	stream.next_out = zbuf;
-	r = Z_OK;
-      }
+      if (stream.avail_out == 0)
+	zwrite();
       break;
     case Z_STREAM_END:
       break;
     default:
-      out("ZSending compressed data to "); outhost();
-      out("but compression failed: ");
-      out(stream.msg); out(" (#4.4.2)\n");
-      zerodie();
+      zfailed();
     }
   } while (r!=Z_STREAM_END);
-  if (stream.avail_out != sizeof(zbuf)) {
-    /* write left data */
-#ifdef TLS_REMOTE
-    if (ssl)
-      r = ssl_timeoutwrite(timeout,smtpfd,zbuf,sizeof(zbuf)-stream.avail_out);
-    else
-#endif
-    r = timeoutwrite(timeout,smtpfd,zbuf,sizeof(zbuf)-stream.avail_out);
-    if (r <= 0) dropped();
-  }
+  /* write left data */
+  if (stream.avail_out != sizeof(zbuf))
+    zwrite();
   if (deflateEnd(&stream) != Z_OK) {
     out("ZFinishing data compression failed: ");
     if (stream.msg) out(stream.msg); else out("unknown error");
@@ -244,6 +291,21 @@ void compression_done(void)
     zerodie();
   }
 }
+
+/* parse the DATAZ EHLO keyword, without arguments it means deflate */
+void compression_ehlo(const char *s)
+{
+  unsigned int i;
+
+  if (zlevel == 0) return; /* turned off for this route */
+  if (*s != ' ') { wantcomp = 1; zcodecs = 0; return; }
+  while (*s == ' ') {
+    ++s;
+    for (i = 0; s[i] && s[i] != ' ' && s[i] != '\n'; i++) ;
+    if (i == 7 && !case_diffb(s,7,"DEFLATE")) { wantcomp = 1; zcodecs = 1; }
+    s += i;
+  }
+}
 #endif
 
 int saferead(int fd, void *buf, int len)
@@ -266,26 +328,14 @@ int safewrite(int fd, void *buf, int len)
     stream.avail_in = len;
     stream.next_in = buf;
     do {
-      r = deflate(&stream, 0);
+      r = zdeflate(0);
       switch (r) {
       case Z_OK:
-	if (stream.avail_out == 0) {
-#ifdef TLS_REMOTE
-	  if (ssl)
-	    r = ssl_timeoutwrite(timeout,smtpfd,zbuf,sizeof(zbuf));
-	  else
-#endif
-	  r = timeoutwrite(timeout,smtpfd,zbuf,sizeof(zbuf));
-	  if (r <= 0) dropped();
-	  stream.avail_out = sizeof(zbuf);
-	  stream.next_out = zbuf;
-	}
+	if (stream.avail_out == 0)
+	  zwrite();
 	break;
       default:
-	out("ZSending compressed data to "); outhost();
-	out("but compression failed: ");
-	out(stream.msg); out(" (#4.4.2)\n");
-	zerodie();
+	zfailed();
       }
     } while (stream.avail_in != 0);
     return len;
@@ -301,9 +351,9 @@ int safewrite(int fd, void *buf, int len)
   return r;
 }
 
-char inbuf[1500];
+char inbuf[8192];
 substdio ssin = SUBSTDIO_FDBUF(subread,0,inbuf,sizeof inbuf);
-char smtptobuf[1500];
+char smtptobuf[16384];
 substdio smtpto = SUBSTDIO_FDBUF(safewrite,-1,smtptobuf,sizeof smtptobuf);
 char smtpfrombuf[128];
 substdio smtpfrom = SUBSTDIO_FDBUF(saferead,-1,smtpfrombuf,sizeof smtpfrombuf);
@@ -374,7 +424,17 @@ void quit(const char *prepend, const char *append)
 	    num[0] = ' ';
 	  num[fmt_uint(num+1,r) + 1] = 0;
 	  out("DDC saved ");
-	  out(num); out(" percent.\n");
+	  out(num); out(" percent (deflate");
+	  if (zlevel != Z_DEFAULT_COMPRESSION) {
+	    num[fmt_uint(num,zlevel)] = 0;
+	    out(" level "); out(num);
+	  }
+	  num[fmt_ulong(num,stream.total_in)] = 0;
+	  out(", "); out(num);
+	  num[fmt_ulong(num,stream.total_out)] = 0;
+	  out(" to "); out(num);
+	  num[fmt_ulong(num,zusec / 1000)] = 0;
+	  out(" bytes in "); out(num); out(" ms).\n");
   }
 #endif
 /* TAG */
@@ -408,25 +468,78 @@ void quit(const char *prepend, const char *append)
   zerodie();
 }
 
+#ifdef DATA_COMPRESS
+/*
+ * Content types that are compressed already. Their parts are sent with
+ * Huffman coding only, that still wins back the quarter base64 wastes
+ * while searching for repeated strings would find nothing.
+ */
+const char *zskiptypes[] = {
+  "image/jpeg", "image/png", "image/gif", "audio/", "video/",
+  "application/zip", "application/gzip", "application/x-gzip",
+  "application/x-bzip2", "application/x-xz", "application/x-7z-compressed",
+  "application/x-rar", "application/vnd.openxmlformats-",
+  "application/vnd.oasis.opendocument.", 0
+};
+
+void compression_part(const char *s, unsigned int len)
+{
+  int flag, r;
+  unsigned int i;
+
+  while (len > 0 && (*s == ' ' || *s == '\t')) { ++s; --len; }
+  flag = 0;
+  for (i = 0; zskiptypes[i]; i++)
+    if (case_startb(s,len,zskiptypes[i])) { flag = 1; break; }
+  if (flag == zhuffman) return;
+  zhuffman = flag;
+
+  /* everything up to here goes out with the old parameters */
+  substdio_flush(&smtpto);
+  for (;;) {
+    r = deflateParams(&stream,flag ? 1 : zlevel,
+	flag ? Z_HUFFMAN_ONLY : Z_DEFAULT_STRATEGY);
+    if (r == Z_OK) break;
+    if (r != Z_BUF_ERROR || stream.avail_out == sizeof(zbuf)) zfailed();
+    zwrite();
+  }
+  if (stream.avail_out == 0) zwrite();
+}
+#endif
+
 void blast(void)
 {
-  int r;
-  char ch;
+  int n;
+  unsigned int i;
+  int flagbol;
+  char *x;
 
+  /* copy the message a line (or a buffer) at a time, only the line
+     ends and leading dots need to be touched */
+  flagbol = 1;
   for (;;) {
-    r = substdio_get(&ssin,&ch,1);
-    if (r == 0) break;
-    if (r == -1) temp_read();
-    if (ch == '.')
+    n = substdio_feed(&ssin);
+    if (n == 0) break;
+    if (n == -1) temp_read();
+    x = substdio_PEEK(&ssin);
+    if (flagbol && *x == '.')
       substdio_put(&smtpto,".",1);
-    while (ch != '\n') {
-      substdio_put(&smtpto,&ch,1);
-      r = substdio_get(&ssin,&ch,1);
-      if (r == 0) perm_partialline();
-      if (r == -1) temp_read();
+    i = byte_chr(x,n,'\n');
+#ifdef DATA_COMPRESS
+    if (flagbol && compdata && i > 13 && case_startb(x,13,"content-type:"))
+      compression_part(x + 13,i - 13);
+#endif
+    substdio_put(&smtpto,x,i);
+    if (i == (unsigned int)n) {
+      flagbol = 0;
+      substdio_SEEK(&ssin,n);
+      continue;
     }
     substdio_put(&smtpto,"\r\n",2);
+    substdio_SEEK(&ssin,i + 1);
+    flagbol = 1;
   }
+  if (!flagbol) perm_partialline();
  
   flagcritical = 1;
   substdio_put(&smtpto,".\r\n",3);
@@ -497,7 +610,7 @@ void smtp(void)
       flagsize = 1;
 #ifdef DATA_COMPRESS
     else if (i+9 < smtptext.len && !case_diffb("DATAZ", 5, smtptext.s+i+4))
-            wantcomp = 1;
+      compression_ehlo(smtptext.s+i+9);
 #endif
 #ifdef TLS_REMOTE
     else if (i+12 < smtptext.len && !case_diffb("STARTTLS", 8, smtptext.s+i+4))
@@ -588,7 +701,7 @@ void smtp(void)
 	  flagsize = 1;
 #ifdef DATA_COMPRESS
 	else if (i+9 < smtptext.len && !case_diffb("DATAZ", 5, smtptext.s+i+4))
-	  wantcomp = 1;
+	  compression_ehlo(smtptext.s+i+9);
 #endif
         else if (i+9 < smtptext.len &&
 	    !case_diffb("AUTH ", 5, smtptext.s+i+4)) {
@@ -677,7 +790,10 @@ void smtp(void)
  
 #ifdef DATA_COMPRESS
   if (wantcomp == 1) {
-    substdio_putsflush(&smtpto,"DATAZ\r\n");
+    if (zcodecs)
+      substdio_putsflush(&smtpto,"DATAZ DEFLATE\r\n");
+    else
+      substdio_putsflush(&smtpto,"DATAZ\r\n");
     compression_init();
   } else
 #endif
@@ -710,6 +826,44 @@ void smtp(void)
   quit("K"," accepted message");
 }
 
+#ifdef HASSENDFILE
+/*
+ * Send len bytes of the message on fd 0 straight from the page cache.
+ * Returns 0 if sendfile(2) can not be used, the caller falls back to
+ * copying through ssin then.
+ */
+int sendmessage(unsigned long len)
+{
+  fd_set wfds;
+  struct timeval tv;
+  off_t off;
+  ssize_t r;
+  int flagsent;
+
+  off = lseek(0,(off_t) 0,SEEK_CUR);
+  if (off == -1) return 0;
+  flagsent = 0;
+  while (len > 0) {
+    tv.tv_sec = timeout;
+    tv.tv_usec = 0;
+    FD_ZERO(&wfds);
+    FD_SET(smtpfd,&wfds);
+    if (select(smtpfd + 1,(fd_set *) 0,&wfds,(fd_set *) 0,&tv) <= 0)
+      dropped();
+    r = sendfile(smtpfd,0,&off,len > 65536 ? 65536 : len);
+    if (r == -1) {
+      if (errno == error_intr || errno == error_again) continue;
+      if (!flagsent && (errno == EINVAL || errno == ENOSYS)) return 0;
+      dropped();
+    }
+    if (r == 0) temp_read(); /* file shrunk */
+    flagsent = 1;
+    len -= r;
+  }
+  return 1;
+}
+#endif
+
 int qmtp_priority(int pref)
 {
   if (pref < 12800) return 0;
@@ -736,6 +890,11 @@ void qmtp(void)
   /* the following code was substantially taken from serialmail's serialqmtp.c */
   substdio_put(&smtpto,num,fmt_ulong(num,len+1));
   substdio_put(&smtpto,":\n",2);
+#ifdef HASSENDFILE
+  /* no TLS and no compression on QMTP, the message goes out as is */
+  substdio_flush(&smtpto);
+  if (sendmessage(len)) len = 0;
+#endif
   while (len > 0) {
     n = substdio_feed(&ssin);
     if (n <= 0) temp_read(); /* wise guy again */
@@ -765,6 +924,7 @@ void qmtp(void)
   }
   substdio_put(&smtpto,",",1);
   substdio_flush(&smtpto);
+  flagcritical = 1;
 
   flagbother = 0;
 
@@ -813,9 +973,35 @@ void qmtp(void)
   } else {
     out("K");outhost();out(" accepted message.\n"); outsmtptext();
   }
+  /* the next message to this relay can use the same connection */
+  qmtpconn_keep(smtpfd,&partner,qmtp_port,qmtpidle);
   zerodie();
 }
 
+/*
+ * The relay closed the reused connection before it got the whole
+ * message, most likely because its idle timeout hit in the meantime.
+ * Nothing was delivered yet, so start over on a new connection.
+ */
+void qmtp_retry(void)
+{
+  flagreused = 0;
+  close(smtpfd);
+  smtpfd = socket(AF_INET,SOCK_STREAM,0);
+  if (smtpfd == -1) temp_oserr();
+  if (timeoutconn(smtpfd,&partner,&outip,(unsigned int) qmtp_port,timeoutconnect) != 0) {
+    tcpto_err(&partner,errno == error_timeout);
+    return;
+  }
+  tcpto_err(&partner,0);
+  if (lseek(0,(off_t) 0,SEEK_SET) == -1) temp_read();
+  substdio_fdbuf(&ssin,subread,0,inbuf,sizeof inbuf);
+  substdio_fdbuf(&smtpto,safewrite,-1,smtptobuf,sizeof smtptobuf);
+  substdio_fdbuf(&smtpfrom,saferead,-1,smtpfrombuf,sizeof smtpfrombuf);
+  if (!stralloc_copys(&smtptext,"")) temp_nomem();
+  qmtp(); /* does not return */
+}
+
 stralloc canonhost = {0};
 stralloc canonbox = {0};
 
@@ -860,6 +1046,11 @@ void getcontrols(void)
   if (control_readint(&timeout,"control/timeoutremote") == -1) temp_control();
   if (control_readint(&timeoutconnect,"control/timeoutconnect") == -1)
     temp_control();
+  if (control_readint(&dnscachettl,"control/dnscachettl") == -1)
+    temp_control();
+  if (dnscachettl < 0) dnscachettl = 0;
+  if (control_readint(&qmtpidle,"control/qmtpidle") == -1)
+    temp_control();
   if (control_rldef(&helohost,"control/helohost",1,(char *) 0) != 1)
     temp_control();
   switch(control_readfile(&routes,"control/smtproutes",0)) {
@@ -870,6 +1061,16 @@ void getcontrols(void)
     case 1:
       if (!constmap_init(&maproutes,routes.s,routes.len,1)) temp_nomem(); break;
   }
+#ifdef DATA_COMPRESS
+  switch(control_readfile(&zroutes,"control/datazroutes",0)) {
+    case -1:
+      temp_control();
+    case 0:
+      if (!constmap_init(&mapzroutes,"",0,1)) temp_nomem(); break;
+    case 1:
+      if (!constmap_init(&mapzroutes,zroutes.s,zroutes.len,1)) temp_nomem(); break;
+  }
+#endif
   if (control_rldef(&outgoingip, "control/outgoingip", 0, "0.0.0.0") == -1)
     temp_control();
   if (!stralloc_0(&outgoingip)) temp_nomem();
@@ -893,6 +1094,10 @@ int main(int argc, char **argv)
   int flagallaliases;
   int flagalias;
   const char *relayhost;
+#ifdef DATA_COMPRESS
+  const char *zroute;
+  unsigned long u;
+#endif
 
 #ifdef TLS_REMOTE
   sig_alarmcatch(sigalrm);
@@ -901,7 +1106,8 @@ int main(int argc, char **argv)
   if (argc < 4) perm_usage();
   if (chdir(auto_qmail) == -1) temp_chdir();
   getcontrols();
- 
+  /* the cache is optional, without queue/lock/dnscache resolve directly */
+  dnscache_init("queue/lock/dnscache", dnscachettl);
  
   if (!stralloc_copys(&host,argv[1])) temp_nomem();
   if (!stralloc_copys(&auth_login, "")) temp_nomem();
@@ -913,6 +1119,14 @@ int main(int argc, char **argv)
       if ((relayhost = constmap(&maproutes,host.s + i,host.len - i)))
         break;
   if (relayhost && !*relayhost) relayhost = 0;
+#ifdef DATA_COMPRESS
+  for (i = 0;i <= host.len;++i)
+    if ((i == 0) || (i == host.len) || (host.s[i] == '.'))
+      if ((zroute = constmap(&mapzroutes,host.s + i,host.len - i))) {
+	if (*zroute && scan_ulong(zroute,&u) && u <= 9) zlevel = u;
+	break;
+      }
+#endif
  
   if (relayhost) {
     j = str_chr(relayhost,' ');
@@ -980,6 +1194,15 @@ int main(int argc, char **argv)
  
   for (i = 0;i < ip.len;++i) if (ip.ix[i].pref < prefme) {
     if (tcpto(&ip.ix[i].ip)) continue;
+
+    if (qmtpidle > 0 && qmtp_priority(ip.ix[i].pref)) {
+      smtpfd = qmtpconn_get(&ip.ix[i].ip,qmtp_port);
+      if (smtpfd != -1) {
+	partner = ip.ix[i].ip;
+	flagreused = 1;
+	qmtp(); /* does not return */
+      }
+    }
  
     smtpfd = socket(AF_INET,SOCK_STREAM,0);
     if (smtpfd == -1) temp_oserr();
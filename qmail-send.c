@@ -1,5 +1,6 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include "readwrite.h"
@@ -30,10 +31,13 @@
 #include "qmail.h"
 #include "qsutil.h"
 #include "prioq.h"
+#include "wheel.h"
+#include "retry.h"
 #include "constmap.h"
 #include "fmtqfn.h"
 #include "readsubdir.h"
 #include "cdb.h"
+#include "auto_split.h"
 
 /* critical timing feature #1: if not triggered, do not busy-loop */
 /* critical timing feature #2: if triggered, respond within fixed time */
@@ -43,6 +47,7 @@
 #define SLEEP_FOREVER 86400 /* absolute maximum time spent in select() */
 #define SLEEP_CLEANUP 76431 /* time between cleanups */
 #define SLEEP_SYSFAIL 123
+#define SLEEP_LIMIT 60 /* retry for recipients over a domain limit */
 #define OSSIFIED 129600 /* 36 hours; _must_ exceed q-q's DEATH (24 hours) */
 
 int lifetime = 604800;
@@ -53,6 +58,9 @@ stralloc locals = {0};
 struct constmap maplocals;
 stralloc vdoms = {0};
 struct constmap mapvdoms;
+stralloc retries = {0};
+struct constmap mapretry;
+int retryjitter = 0;
 stralloc envnoathost = {0};
 stralloc bouncefrom = {0};
 stralloc bouncehost = {0};
@@ -384,6 +392,40 @@ fd_set *wfds;
 
 /* this file is too long ------------------------------------------ CLEANUPS */
 
+/* foop/ requests are sent in batches, qmail-clean answers them in order */
+#define CLEANBATCH 256
+unsigned long cleanids[CLEANBATCH];
+unsigned int numclean = 0;
+
+void clean_flush()
+{
+ unsigned int i;
+ char ch;
+
+ if (!numclean) return;
+ if (substdio_flush(&sstoqc) == -1) { numclean = 0; cleandied(); return; }
+ for (i = 0;i < numclean;++i)
+  {
+   if (substdio_get(&ssfromqc,&ch,1) != 1)
+    { numclean = 0; cleandied(); return; }
+   if (ch != '+')
+    {
+     fnmake_foop(cleanids[i]);
+     log3("warning: qmail-clean unable to clean up ",fn.s,"\n");
+    }
+  }
+ numclean = 0;
+}
+
+void clean_foop(id)
+unsigned long id;
+{
+ fnmake_foop(id);
+ if (substdio_put(&sstoqc,fn.s,fn.len) == -1) { cleandied(); return; }
+ cleanids[numclean++] = id;
+ if (numclean >= CLEANBATCH) clean_flush();
+}
+
 int flagcleanup; /* if 1, cleanupdir is initialized and ready */
 readsubdir cleanupdir;
 datetime_sec cleanuptime;
@@ -403,7 +445,6 @@ datetime_sec *wakeup;
 
 void cleanup_do()
 {
- char ch;
  struct stat st;
  unsigned long id;
 
@@ -436,21 +477,17 @@ void cleanup_do()
  if (stat(fn.s,&st) == 0) return;
  if (errno != error_noent) return;
 
- fnmake_foop(id);
- if (substdio_putflush(&sstoqc,fn.s,fn.len) == -1) { cleandied(); return; }
- if (substdio_get(&ssfromqc,&ch,1) != 1) { cleandied(); return; }
- if (ch != '+')
-   log3("warning: qmail-clean unable to clean up ",fn.s,"\n");
+ clean_foop(id);
 }
 
 
 /* this file is too long ----------------------------------- PRIORITY QUEUES */
 
-prioq pqdone = {0}; /* -todo +info; HOPEFULLY -local -remote */
-prioq pqchan[CHANNELS] = { {0}, {0} };
+wheel pqdone = {0}; /* -todo +info; HOPEFULLY -local -remote */
+wheel pqchan[CHANNELS] = { {0}, {0} };
 /* pqchan 0: -todo +info +local ?remote */
 /* pqchan 1: -todo +info ?local +remote */
-prioq pqfail = {0}; /* stat() failure; has to be pqadded again */
+wheel pqfail = {0}; /* stat() failure; has to be pqadded again */
 
 void pqadd(id)
 unsigned long id;
@@ -483,13 +520,13 @@ unsigned long id;
 
  for (c = 0;c < CHANNELS;++c)
    if (flagchan[c])
-     while (!prioq_insert(&pqchan[c],&pechan[c])) nomem();
+     while (!wheel_insert(&pqchan[c],&pechan[c])) nomem();
 
  for (c = 0;c < CHANNELS;++c) if (flagchan[c]) break;
  if (c == CHANNELS)
   {
    pe.id = id; pe.dt = now();
-   while (!prioq_insert(&pqdone,&pe)) nomem();
+   while (!wheel_insert(&pqdone,&pe)) nomem();
   }
 
  return;
@@ -497,14 +534,43 @@ unsigned long id;
  fail:
  log3("warning: unable to stat ",fn.s,"; will try again later\n");
  pe.id = id; pe.dt = now() + SLEEP_SYSFAIL;
- while (!prioq_insert(&pqfail,&pe)) nomem();
+ while (!wheel_insert(&pqfail,&pe)) nomem();
 }
 
+int snapshot_load();
+char *snaptrusted = 0; /* if 1, the snapshot is valid for this split */
+
 void pqstart()
 {
  readsubdir rs;
  int x;
  unsigned long id;
+ DIR *dir;
+ direntry *d;
+ char name[FMT_ULONG + 6];
+ unsigned int n;
+ unsigned int len;
+
+ if (snapshot_load())
+  {
+   /* only rescan what changed since the snapshot was taken */
+   for (n = 0;n < auto_split;++n)
+    {
+     if (snaptrusted[n]) continue;
+     len = fmt_str(name,"info/");
+     len += fmt_uint(name + len,n);
+     name[len] = 0;
+     while (!(dir = opendir(name))) pausedir(name);
+     while ((d = readdir(dir)))
+      {
+       len = scan_ulong(d->d_name,&id);
+       if (!len || d->d_name[len]) continue;
+       pqadd(id);
+      }
+     closedir(dir);
+    }
+   return;
+  }
 
  readsubdir_init(&rs,"info",pausedir);
 
@@ -520,9 +586,9 @@ void pqfinish()
  struct timeval tvv[2];
 
  for (c = 0;c < CHANNELS;++c)
-   while (prioq_min(&pqchan[c],&pe))
+   while (wheel_min(&pqchan[c],&pe))
     {
-     prioq_delmin(&pqchan[c]);
+     wheel_delmin(&pqchan[c]);
      fnmake_chanaddr(pe.id,c);
      tvv[0].tv_sec = tvv[1].tv_sec = pe.dt;
      tvv[0].tv_usec = tvv[1].tv_usec = 0;
@@ -534,12 +600,8 @@ void pqfinish()
 void pqrun()
 {
  int c;
- unsigned int i;
  for (c = 0;c < CHANNELS;++c)
-   if (pqchan[c].p)
-     if (pqchan[c].len)
-       for (i = 0;i < pqchan[c].len;++i)
-	 pqchan[c].p[i].dt = recent;
+   while (!wheel_run(&pqchan[c],recent)) nomem();
 }
 
 
@@ -551,6 +613,10 @@ struct job
   unsigned long id;
   int channel;
   datetime_sec retry;
+  datetime_sec birth;
+  datetime_sec retrydef; /* retry for recipients without own schedule */
+  int flagretry; /* retry was taken from a recipient */
+  int flaglimited; /* recipients were skipped because of a domain limit */
   stralloc sender;
   int numtodo;
   int flaghiteof;
@@ -591,6 +657,7 @@ int channel;
  jo[j].channel = channel;
  jo[j].numtodo = 0;
  jo[j].flaghiteof = 0;
+ jo[j].flaglimited = 0;
  return j;
 }
 
@@ -604,7 +671,12 @@ int j;
 
  pe.id = jo[j].id;
  pe.dt = jo[j].retry;
- if (jo[j].flaghiteof && !jo[j].numtodo)
+ if (jo[j].flaglimited)
+  {
+   /* not all recipients were tried, come back soon for the rest */
+   if (pe.dt > recent + SLEEP_LIMIT) pe.dt = recent + SLEEP_LIMIT;
+  }
+ else if (jo[j].flaghiteof && !jo[j].numtodo)
   {
    fnmake_chanaddr(jo[j].id,jo[j].channel);
    if (unlink(fn.s) == -1)
@@ -626,12 +698,211 @@ int j;
 	}
       }
      pe.dt = now();
-     while (!prioq_insert(&pqdone,&pe)) nomem();
+     while (!wheel_insert(&pqdone,&pe)) nomem();
      return;
     }
   }
 
- while (!prioq_insert(&pqchan[jo[j].channel],&pe)) nomem();
+ while (!wheel_insert(&pqchan[jo[j].channel],&pe)) nomem();
+}
+
+
+/* this file is too long ----------------------------------------- SNAPSHOTS */
+
+/* the queues are saved to state/snapshot every snapinterval seconds. */
+/* on startup a split is taken from the snapshot if none of its todo, */
+/* info, local and remote directories was modified after the snapshot. */
+/* qmail-todo cleans up todo/ right before it sends the 'D'; a 'D' */
+/* sent before the snapshot is read first (todo_drain), one sent later */
+/* comes with a todo mtime that is not older than the snapshot. */
+/* the snapshot is removed once it is loaded, it is only good once. */
+
+int snapinterval = 0;
+datetime_sec nextsnapshot = 0;
+
+int snapshot_unchanged(dir,n,when)
+const char *dir;
+unsigned int n;
+datetime_sec when;
+{
+ struct stat st;
+ char name[FMT_ULONG + 8];
+ unsigned int len;
+
+ len = fmt_str(name,dir);
+ name[len++] = '/';
+ len += fmt_uint(name + len,n);
+ name[len] = 0;
+ if (stat(name,&st) == -1) return 0;
+ return st.st_mtime < when;
+}
+
+int snapshot_todo(n,when)
+unsigned int n;
+datetime_sec when;
+{
+#ifdef BIGTODO
+ return snapshot_unchanged("todo",n,when);
+#else
+ struct stat st;
+
+ /* todo/ is only split with BIGTODO */
+ if (stat("todo",&st) == -1) return 0;
+ return st.st_mtime < when;
+#endif
+}
+
+int snapshot_load()
+{
+ substdio ss;
+ char buf[4096];
+ struct prioq_elt pe;
+ struct stat st;
+ stralloc line = {0};
+ unsigned long u;
+ unsigned int i;
+ unsigned int n;
+ datetime_sec when;
+ wheel *pq;
+ int match;
+ int fd;
+ int c;
+
+ /* a leftover from an earlier configuration must never be trusted */
+ if (!snapinterval) { unlink("state/snapshot"); return 0; }
+ fd = open_read("state/snapshot");
+ if (fd == -1) return 0;
+ unlink("state/snapshot");
+ /* a snapshot that does not end in "end\n" is incomplete */
+ if (fstat(fd,&st) == -1 || st.st_size < 4) goto fail;
+ if (seek_set(fd,st.st_size - 4) == -1) goto fail;
+ if (read(fd,buf,4) != 4 || !byte_equal(buf,4,"end\n")) goto fail;
+ if (seek_begin(fd) == -1) goto fail;
+ substdio_fdbuf(&ss,subread,fd,buf,sizeof(buf));
+
+ if (getln(&ss,&line,&match,'\n') == -1 || !match) goto fail;
+ if (!stralloc_0(&line)) goto fail;
+ if (!str_start(line.s,"snapshot ")) goto fail;
+ if (!scan_ulong(line.s + 9,&u)) goto fail;
+ when = u;
+
+ if (!snaptrusted)
+   while (!(snaptrusted = alloc(auto_split))) nomem();
+ for (n = 0;n < auto_split;++n)
+   snaptrusted[n] = snapshot_todo(n,when) &&
+       snapshot_unchanged("info",n,when) &&
+       snapshot_unchanged("local",n,when) &&
+       snapshot_unchanged("remote",n,when);
+
+ for (;;)
+  {
+   if (getln(&ss,&line,&match,'\n') == -1 || !match) goto undo;
+   if (line.len == 4 && byte_equal(line.s,4,"end\n")) break;
+   if (!stralloc_0(&line)) goto undo;
+   switch(line.s[0])
+    {
+     case 'd': pq = &pqdone; break;
+     case 'f': pq = &pqfail; break;
+     default:
+       c = line.s[0] - '0';
+       if (c < 0 || c >= CHANNELS) goto undo;
+       pq = &pqchan[c];
+    }
+   i = 1;
+   if (line.s[i++] != ' ') goto undo;
+   n = scan_ulong(line.s + i,&u); if (!n) goto undo;
+   pe.id = u; i += n;
+   if (line.s[i++] != ' ') goto undo;
+   n = scan_ulong(line.s + i,&u); if (!n) goto undo;
+   pe.dt = u;
+   if (snaptrusted[pe.id % auto_split])
+     while (!wheel_insert(pq,&pe)) nomem();
+  }
+ close(fd);
+ alloc_free(line.s);
+
+ for (n = i = 0;n < auto_split;++n) if (!snaptrusted[n]) ++i;
+ strnum2[fmt_uint(strnum2,i)] = 0;
+ log3("status: loaded queue snapshot, rescanning ",strnum2," splits\n");
+ return 1;
+
+ undo:
+ for (c = 0;c < CHANNELS;++c) wheel_clear(&pqchan[c]);
+ wheel_clear(&pqdone);
+ wheel_clear(&pqfail);
+ fail:
+ close(fd);
+ if (line.s) alloc_free(line.s);
+ log1("warning: unable to use queue snapshot, scanning the whole queue\n");
+ return 0;
+}
+
+void snapshot_put(ss,q,pe)
+substdio *ss;
+char q;
+struct prioq_elt *pe;
+{
+ char num[FMT_ULONG];
+
+ substdio_put(ss,&q,1);
+ substdio_put(ss," ",1);
+ substdio_put(ss,num,fmt_ulong(num,pe->id));
+ substdio_put(ss," ",1);
+ substdio_put(ss,num,fmt_ulong(num,(unsigned long) pe->dt));
+ substdio_put(ss,"\n",1);
+}
+
+void snapshot_write()
+{
+ substdio ss;
+ char buf[4096];
+ char num[FMT_ULONG];
+ struct prioq_elt pe;
+ struct wheel_pos pos;
+ datetime_sec when;
+ unsigned int i;
+ int fd;
+ int c;
+
+ when = now();
+ fd = open_trunc("state/snapshot.tmp");
+ if (fd == -1)
+  { log1("warning: unable to create state/snapshot.tmp\n"); return; }
+ substdio_fdbuf(&ss,subwrite,fd,buf,sizeof(buf));
+ substdio_puts(&ss,"snapshot ");
+ substdio_put(&ss,num,fmt_ulong(num,(unsigned long) when));
+ substdio_puts(&ss,"\n");
+ for (c = 0;c < CHANNELS;++c)
+  {
+   wheel_walkstart(&pos);
+   while (wheel_walk(&pqchan[c],&pos,&pe))
+     snapshot_put(&ss,'0' + c,&pe);
+  }
+ wheel_walkstart(&pos);
+ while (wheel_walk(&pqdone,&pos,&pe))
+   snapshot_put(&ss,'d',&pe);
+ wheel_walkstart(&pos);
+ while (wheel_walk(&pqfail,&pos,&pe))
+   snapshot_put(&ss,'f',&pe);
+ /* messages in delivery are retried right away after a crash */
+ for (i = 0;i < numjobs;++i)
+   if (jo[i].refs)
+    {
+     pe.id = jo[i].id;
+     pe.dt = when;
+     snapshot_put(&ss,'0' + jo[i].channel,&pe);
+    }
+ substdio_puts(&ss,"end\n");
+ if (substdio_flush(&ss) == -1) goto fail;
+ if (fsync(fd) == -1) goto fail;
+ if (close(fd) == -1) { fd = -1; goto fail; }
+ if (rename("state/snapshot.tmp","state/snapshot") == -1) { fd = -1; goto fail; }
+ return;
+
+ fail:
+ if (fd != -1) close(fd);
+ unlink("state/snapshot.tmp");
+ log1("warning: unable to write queue snapshot\n");
 }
 
 
@@ -852,6 +1123,115 @@ I tried to deliver a bounce message to this address, but the bounce bounced!\n\
 }
 
 
+/* this file is too long ------------------------------------------- RETRIES */
+
+/* the retry schedules themselves are computed in retry.c */
+
+/* remote messages deferred because the host could not be reached are */
+/* remembered per domain. the next successful delivery to that domain */
+/* moves them to the front of the queue instead of waiting for retry. */
+
+#define DEFERDOMAINS 64
+#define DEFERIDS 32
+
+struct deferred
+ {
+  stralloc domain;
+  unsigned long id[DEFERIDS];
+  unsigned int num;
+ }
+;
+
+struct deferred deferred[DEFERDOMAINS];
+unsigned int deferrednext = 0;
+
+int defer_unreachable(report)
+char *report;
+{
+ unsigned int i;
+ i = str_len(report);
+ while (i >= 8)
+  {
+   if (byte_equal(report + i - 8,8,"(#4.4.1)")) return 1;
+   if (byte_equal(report + i - 8,8,"(#4.4.2)")) return 1;
+   --i;
+  }
+ return 0;
+}
+
+struct deferred *defer_find(recip)
+char *recip;
+{
+ unsigned int i;
+ unsigned int j;
+ unsigned int len;
+
+ i = str_rchr(recip,'@');
+ if (!recip[i]) return 0;
+ recip += i + 1;
+ len = str_len(recip);
+ for (j = 0;j < DEFERDOMAINS;++j)
+   if (deferred[j].num && (deferred[j].domain.len == len))
+     if (!case_diffb(deferred[j].domain.s,len,recip))
+       return &deferred[j];
+ return 0;
+}
+
+void defer_add(id,recip)
+unsigned long id;
+char *recip;
+{
+ struct deferred *dp;
+ unsigned int i;
+
+ dp = defer_find(recip);
+ if (!dp)
+  {
+   i = str_rchr(recip,'@');
+   if (!recip[i]) return;
+   dp = &deferred[deferrednext];
+   deferrednext = (deferrednext + 1) % DEFERDOMAINS;
+   if (!stralloc_copys(&dp->domain,recip + i + 1)) return;
+   dp->num = 0;
+  }
+ for (i = 0;i < dp->num;++i) if (dp->id[i] == id) return;
+ if (dp->num < DEFERIDS) dp->id[dp->num++] = id;
+}
+
+void defer_wake(recip)
+char *recip;
+{
+ struct prioq_elt pe;
+ struct deferred *dp;
+ unsigned int i;
+ unsigned int k;
+ unsigned int j;
+
+ dp = defer_find(recip);
+ if (!dp) return;
+ for (i = k = 0;i < dp->num;++i)
+  {
+   if (wheel_find(&pqchan[1],dp->id[i],&pe))
+    {
+     if (pe.dt > recent)
+      {
+       pe.dt = recent; /* moves it, the old entry goes stale */
+       while (!wheel_insert(&pqchan[1],&pe)) nomem();
+      }
+     continue;
+    }
+   /* still being delivered, wake it with the next success */
+   for (j = 0;j < numjobs;++j)
+     if (jo[j].refs && (jo[j].id == dp->id[i]) && (jo[j].channel == 1))
+      {
+       dp->id[k++] = dp->id[i];
+       break;
+      }
+  }
+ dp->num = k;
+}
+
+
 /* this file is too long ---------------------------------------- DELIVERIES */
 
 struct del
@@ -918,6 +1298,8 @@ int c;
   return flagspawnalive[c] && comm_canwrite(c) && (concurrencyused[c] < concurrency[c]);
 }
 
+void limit_started();
+
 void del_start(j,mpos,recip)
 unsigned int j;
 seek_pos mpos;
@@ -939,6 +1321,7 @@ char *recip;
  d[c][i].delid = masterdelid++;
  d[c][i].mpos = mpos;
  d[c][i].used = 1; ++concurrencyused[c];
+ if (c == 1) limit_started(recip);
 
  comm_write(c,i,jo[j].id,jo[j].sender.s,recip);
 
@@ -973,6 +1356,8 @@ seek_pos pos;
  log3("warning: trouble marking ",fn.s,"; message will be delivered twice!\n");
 }
 
+void limit_done();
+
 void del_dochan(c)
 int c;
 {
@@ -1024,11 +1409,14 @@ int c;
 	   log1("\n");
 	   markdone(c,jo[d[c][delnum].j].id,d[c][delnum].mpos);
 	   --jo[d[c][delnum].j].numtodo;
+	   if (c == 1) defer_wake(d[c][delnum].recip.s);
 	   break;
 	 case 'Z':
 	   log3("delivery ",strnum3,": deferral: ");
 	   logsafe(dline[c].s + 3);
 	   log1("\n");
+	   if ((c == 1) && defer_unreachable(dline[c].s + 3))
+	     defer_add(jo[d[c][delnum].j].id,d[c][delnum].recip.s);
 	   break;
 	 case 'D':
 	   log3("delivery ",strnum3,": failure: ");
@@ -1048,6 +1436,7 @@ int c;
 	   log3("delivery ",strnum3,": report mangled, will defer\n");
 	}
        if (dline[c].s[2] != 'L') {
+	 if (c == 1) limit_done(d[c][delnum].recip.s);
 	 job_close(d[c][delnum].j);
 	 d[c][delnum].used = 0; --concurrencyused[c];
 	 del_status();
@@ -1083,6 +1472,261 @@ fd_set *rfds;
 }
 
 
+/* this file is too long -------------------------------------------- LIMITS */
+
+/* control/concurrencydomains limits the remote deliveries to a domain, */
+/* one line per domain as domain:concurrency[:perminute], 0 is no limit. */
+/* recipients over the limit are held in memory and started as soon as */
+/* the domain allows it. if too many are held, the rest of the message */
+/* is skipped and the message comes back after SLEEP_LIMIT seconds. */
+
+#define LIMITHELD 32
+
+struct held
+ {
+  unsigned int j;
+  seek_pos mpos;
+  stralloc recip;
+ }
+;
+
+struct dlimit
+ {
+  char *domain;
+  unsigned int len;
+  unsigned long concurrency;
+  unsigned long rate;
+  unsigned long active;
+  unsigned long started; /* in this minute */
+  datetime_sec minute;
+  struct held held[LIMITHELD];
+  unsigned int numheld;
+ }
+;
+
+stralloc limits = {0};
+struct dlimit *dlimit = 0;
+unsigned int numdlimit = 0;
+unsigned int limitheld = 0; /* held over all domains, each holds a job */
+
+/* the table points into sa, which must stay untouched while in use */
+int limit_table(sa)
+stralloc *sa;
+{
+ unsigned int i;
+ unsigned int j;
+ unsigned int k;
+ unsigned int n;
+ unsigned long u;
+
+ numdlimit = 0;
+ for (i = n = 0;i < sa->len;++i) if (!sa->s[i]) ++n;
+ dlimit = (struct dlimit *) alloc(n * sizeof(struct dlimit));
+ if (!dlimit) return 0;
+ for (i = 0;i < sa->len;i += str_len(sa->s + i) + 1)
+  {
+   j = str_chr(sa->s + i,':');
+   if (!sa->s[i + j] || !j) continue;
+   dlimit[numdlimit].domain = sa->s + i;
+   dlimit[numdlimit].len = j;
+   k = i + j + 1;
+   k += scan_ulong(sa->s + k,&u);
+   dlimit[numdlimit].concurrency = u;
+   u = 0;
+   if (sa->s[k] == ':') scan_ulong(sa->s + k + 1,&u);
+   dlimit[numdlimit].rate = u;
+   dlimit[numdlimit].active = 0;
+   dlimit[numdlimit].started = 0;
+   dlimit[numdlimit].minute = 0;
+   dlimit[numdlimit].numheld = 0;
+   for (k = 0;k < LIMITHELD;++k) dlimit[numdlimit].held[k].recip.s = 0;
+   ++numdlimit;
+  }
+ return 1;
+}
+
+int limit_init()
+{
+ switch(control_readfile(&limits,"control/concurrencydomains",0))
+  {
+   case -1: return 0;
+   case 0: return 1;
+  }
+ return limit_table(&limits);
+}
+
+struct dlimit *limit_find(recip)
+char *recip;
+{
+ unsigned int i;
+ unsigned int len;
+
+ if (!numdlimit) return 0;
+ i = str_rchr(recip,'@');
+ if (!recip[i]) return 0;
+ recip += i + 1;
+ len = str_len(recip);
+ for (i = 0;i < numdlimit;++i)
+   if (dlimit[i].len == len)
+     if (!case_diffb(dlimit[i].domain,len,recip))
+       return &dlimit[i];
+ return 0;
+}
+
+int limit_ok(dl)
+struct dlimit *dl;
+{
+ if (dl->minute != recent / 60) { dl->minute = recent / 60; dl->started = 0; }
+ if (dl->concurrency && dl->active >= dl->concurrency) return 0;
+ if (dl->rate && dl->started >= dl->rate) return 0;
+ return 1;
+}
+
+/* 1 if the recipient may be delivered now, 0 if it was held or skipped */
+int limit_start(j,mpos,recip)
+unsigned int j;
+seek_pos mpos;
+char *recip;
+{
+ struct dlimit *dl;
+ struct held *h;
+
+ dl = limit_find(recip);
+ if (!dl) return 1;
+ if (!dl->numheld && limit_ok(dl)) return 1;
+ if (dl->numheld < LIMITHELD && limitheld < concurrency[1] / 2)
+  {
+   h = &dl->held[dl->numheld];
+   if (stralloc_copys(&h->recip,recip) && stralloc_0(&h->recip))
+    {
+     h->j = j; ++jo[j].refs;
+     h->mpos = mpos;
+     ++jo[j].numtodo;
+     ++dl->numheld; ++limitheld;
+     return 0;
+    }
+  }
+ jo[j].flaglimited = 1;
+ return 0;
+}
+
+/* called by del_start once the delivery is really under way */
+void limit_started(recip)
+char *recip;
+{
+ struct dlimit *dl;
+
+ dl = limit_find(recip);
+ if (dl) { ++dl->active; ++dl->started; }
+}
+
+void limit_done(recip)
+char *recip;
+{
+ struct dlimit *dl;
+
+ dl = limit_find(recip);
+ if (dl && dl->active) --dl->active;
+}
+
+void limit_selprep(wakeup)
+datetime_sec *wakeup;
+{
+ unsigned int i;
+
+ if (flagexitasap) return;
+ for (i = 0;i < numdlimit;++i)
+   if (dlimit[i].numheld)
+    {
+     if (limit_ok(&dlimit[i]))
+      { if (del_avail(1)) *wakeup = 0; }
+     else if (!dlimit[i].concurrency ||
+	 dlimit[i].active < dlimit[i].concurrency)
+       /* only the rate is exhausted, wait for the next minute */
+       if (*wakeup > (recent / 60 + 1) * 60)
+	 *wakeup = (recent / 60 + 1) * 60;
+    }
+}
+
+void limit_do()
+{
+ struct dlimit *dl;
+ struct held h;
+ unsigned int i;
+
+ if (flagexitasap) return;
+ for (i = 0;i < numdlimit;++i)
+  {
+   dl = &dlimit[i];
+   while (dl->numheld && del_avail(1) && limit_ok(dl))
+    {
+     h = dl->held[0];
+     --dl->numheld; --limitheld;
+     byte_copy(dl->held,dl->numheld * sizeof(struct held),dl->held + 1);
+     dl->held[dl->numheld] = h; /* keep the stralloc for reuse */
+     del_start(h.j,h.mpos,h.recip.s);
+     --jo[h.j].refs; /* del_start took its own reference */
+    }
+  }
+}
+
+stralloc newlimits = {0};
+
+void limit_reread()
+{
+ stralloc sa;
+ struct dlimit *dl;
+ struct dlimit *old;
+ unsigned int numold;
+ unsigned int i;
+ unsigned int k;
+ int r;
+
+ r = control_readfile(&newlimits,"control/concurrencydomains",0);
+ if (r == -1)
+  { log1("alert: unable to reread control/concurrencydomains\n"); return; }
+ if (!r) newlimits.len = 0;
+
+ /* held recipients are dropped, their messages come back after SLEEP_LIMIT */
+ for (i = 0;i < numdlimit;++i)
+   for (k = 0;k < LIMITHELD;++k)
+    {
+     if (k < dlimit[i].numheld)
+      {
+       --jo[dlimit[i].held[k].j].numtodo;
+       jo[dlimit[i].held[k].j].flaglimited = 1;
+       job_close(dlimit[i].held[k].j);
+      }
+     if (dlimit[i].held[k].recip.s) alloc_free(dlimit[i].held[k].recip.s);
+    }
+ limitheld = 0;
+
+ old = dlimit; numold = numdlimit;
+ while (!limit_table(&newlimits)) nomem();
+ /* keep the rate of this minute for domains that are still listed */
+ for (i = 0;i < numdlimit;++i)
+   for (k = 0;k < numold;++k)
+     if (old[k].len == dlimit[i].len)
+       if (!case_diffb(old[k].domain,old[k].len,dlimit[i].domain))
+	{
+	 dlimit[i].started = old[k].started;
+	 dlimit[i].minute = old[k].minute;
+	 break;
+	}
+ if (old) alloc_free(old);
+ /* the new table points into newlimits, keep it as limits */
+ sa = limits; limits = newlimits; newlimits = sa;
+
+ /* deliveries in progress still count against the new limits */
+ for (i = 0;i < concurrency[1];++i)
+   if (d[1][i].used)
+    {
+     dl = limit_find(d[1][i].recip.s);
+     if (dl) ++dl->active;
+    }
+}
+
+
 /* this file is too long -------------------------------------------- PASSES */
 
 struct
@@ -1115,59 +1759,40 @@ datetime_sec *wakeup;
  if (job_avail())
    for (c = 0;c < CHANNELS;++c)
      if (!pass[c].id)
-       if (prioq_min(&pqchan[c],&pe))
+       if (wheel_min(&pqchan[c],&pe))
          if (*wakeup > pe.dt)
            *wakeup = pe.dt;
- if (prioq_min(&pqfail,&pe))
+ if (wheel_min(&pqfail,&pe))
    if (*wakeup > pe.dt)
      *wakeup = pe.dt;
- if (prioq_min(&pqdone,&pe))
+ if (wheel_min(&pqdone,&pe))
    if (*wakeup > pe.dt)
      *wakeup = pe.dt;
 }
 
-static datetime_sec squareroot(x) /* result^2 <= x < (result + 1)^2 */
-datetime_sec x; /* assuming: >= 0 */
-{
- datetime_sec y;
- datetime_sec yy;
- datetime_sec y21;
- int j;
-
- y = 0; yy = 0;
- for (j = 15;j >= 0;--j)
-  {
-   y21 = (y << (j + 1)) + (1 << (j + j));
-   if (y21 <= x - yy) { y += (1 << j); yy += y21; }
-  }
- return y;
-}
-
-datetime_sec nextretry(birth,c)
+datetime_sec nextretry(birth,c,recip)
 datetime_sec birth;
 int c;
+char *recip;
 {
- unsigned int n;
+ const char *sched;
+ datetime_sec t;
 
- if (birth > recent) n = 0;
- else {
-#ifdef notyet
-   /*
-    * add some fuzz to recent so that storms to a single host are
-    * dampened over the time.
-    */
-   recent += (int)random() % (((recent - birth) >> 2) + 1);
-#endif
-   n = squareroot(recent - birth);
- }
- n += chanskip[c];
- return birth + n * n;
+ sched = retry_sched(&mapretry,c,recip);
+ if (sched && (birth <= recent))
+  {
+   t = retry_next(birth,recent,sched);
+   if (t) return retry_jitter(t,recent,retryjitter);
+  }
+ t = retry_curve(birth,recent,chanskip[c]);
+ return retry_jitter(t,recent,retryjitter);
 }
 
 void pass_dochan(c)
 int c;
 {
  datetime_sec birth;
+ datetime_sec t;
  struct prioq_elt pe;
  static stralloc line = {0};
  int match;
@@ -1177,11 +1802,11 @@ int c;
  if (!pass[c].id)
   {
    if (!job_avail()) return;
-   if (!prioq_min(&pqchan[c],&pe)) return;
+   if (!wheel_min(&pqchan[c],&pe)) return;
    if (pe.dt > recent) return;
    fnmake_chanaddr(pe.id,c);
 
-   prioq_delmin(&pqchan[c]);
+   wheel_delmin(&pqchan[c]);
    pass[c].mpos = 0;
    pass[c].fd = open_read(fn.s);
    if (pass[c].fd == -1) goto trouble;
@@ -1189,7 +1814,10 @@ int c;
    pass[c].id = pe.id;
    substdio_fdbuf(&pass[c].ss,subread,pass[c].fd,pass[c].buf,sizeof(pass[c].buf));
    pass[c].j = job_open(pe.id,c);
-   jo[pass[c].j].retry = nextretry(birth,c);
+   jo[pass[c].j].retry = nextretry(birth,c,(char *) 0);
+   jo[pass[c].j].retrydef = jo[pass[c].j].retry;
+   jo[pass[c].j].birth = birth;
+   jo[pass[c].j].flagretry = 0;
    /* XXX add fast timeouts for bounce double bounce here */
    jo[pass[c].j].flagdying = (recent > birth + lifetime);
    while (!stralloc_copy(&jo[pass[c].j].sender,&line)) nomem();
@@ -1217,6 +1845,17 @@ int c;
  switch(line.s[0])
   {
    case 'T':
+     /* the message is retried when its most urgent recipient is due */
+     t = jo[pass[c].j].retrydef;
+     if (retry_sched(&mapretry,c,line.s + 1) !=
+         retry_sched(&mapretry,c,(char *) 0))
+       t = nextretry(jo[pass[c].j].birth,c,line.s + 1);
+     if (!jo[pass[c].j].flagretry || (t < jo[pass[c].j].retry))
+       jo[pass[c].j].retry = t;
+     jo[pass[c].j].flagretry = 1;
+     if (c == 1)
+       if (!limit_start(pass[c].j,pass[c].mpos,line.s + 1))
+	 break;
      ++jo[pass[c].j].numtodo;
      del_start(pass[c].j,pass[c].mpos,line.s + 1);
      break;
@@ -1237,13 +1876,12 @@ int c;
  trouble:
  log3("warning: trouble opening ",fn.s,"; will try again later\n");
  pe.dt = recent + SLEEP_SYSFAIL;
- while (!prioq_insert(&pqchan[c],&pe)) nomem();
+ while (!wheel_insert(&pqchan[c],&pe)) nomem();
 }
 
 void messdone(id)
 unsigned long id;
 {
- char ch;
  int c;
  struct prioq_elt pe;
  struct stat st;
@@ -1291,17 +1929,12 @@ unsigned long id;
   }
 
  /* -todo -info -local -remote -bounce; we can relax */
- fnmake_foop(id);
- if (substdio_putflush(&sstoqc,fn.s,fn.len) == -1) { cleandied(); return; }
- if (substdio_get(&ssfromqc,&ch,1) != 1) { cleandied(); return; }
- if (ch != '+')
-   log3("warning: qmail-clean unable to clean up ",fn.s,"\n");
-
+ clean_foop(id);
  return;
 
  fail:
  pe.id = id; pe.dt = now() + SLEEP_SYSFAIL;
- while (!prioq_insert(&pqdone,&pe)) nomem();
+ while (!wheel_insert(&pqdone,&pe)) nomem();
 }
 
 void pass_do()
@@ -1310,18 +1943,20 @@ void pass_do()
  struct prioq_elt pe;
 
  for (c = 0;c < CHANNELS;++c) pass_dochan(c);
- if (prioq_min(&pqfail,&pe))
+ if (wheel_min(&pqfail,&pe))
    if (pe.dt <= recent)
     {
-     prioq_delmin(&pqfail);
+     wheel_delmin(&pqfail);
      pqadd(pe.id);
     }
- if (prioq_min(&pqdone,&pe))
-   if (pe.dt <= recent)
-    {
-     prioq_delmin(&pqdone);
-     messdone(pe.id);
-    }
+ /* finish a whole wave of messages, their cleanups are batched */
+ for (c = 0;c < CLEANBATCH;++c)
+  {
+   if (!wheel_min(&pqdone,&pe)) break;
+   if (pe.dt > recent) break;
+   wheel_delmin(&pqdone);
+   messdone(pe.id);
+  }
 }
 
 
@@ -1558,6 +2193,7 @@ fd_set *rfds;
      close(fdchan[c]); fdchan[c] = -1;
     }
 
+ clean_flush(); /* keep the answers in order */
  fnmake_todo(id);
  if (substdio_putflush(&sstoqc,fn.s,fn.len) == -1) { cleandied(); return; }
  if (substdio_get(&ssfromqc,&ch,1) != 1) { cleandied(); return; }
@@ -1570,11 +2206,11 @@ fd_set *rfds;
  pe.id = id; pe.dt = now();
  for (c = 0;c < CHANNELS;++c)
    if (flagchan[c])
-     while (!prioq_insert(&pqchan[c],&pe)) nomem();
+     while (!wheel_insert(&pqchan[c],&pe)) nomem();
 
  for (c = 0;c < CHANNELS;++c) if (flagchan[c]) break;
  if (c == CHANNELS)
-   while (!prioq_insert(&pqdone,&pe)) nomem();
+   while (!wheel_insert(&pqdone,&pe)) nomem();
 
  return;
 
@@ -1668,11 +2304,11 @@ void todo_del(char* s)
  pe.id = id; pe.dt = now();
  for (c = 0;c < CHANNELS;++c)
    if (flagchan[c])
-     while (!prioq_insert(&pqchan[c],&pe)) nomem();
+     while (!wheel_insert(&pqchan[c],&pe)) nomem();
 
  for (c = 0;c < CHANNELS;++c) if (flagchan[c]) break;
  if (c == CHANNELS)
-   while (!prioq_insert(&pqdone,&pe)) nomem();
+   while (!wheel_insert(&pqdone,&pe)) nomem();
 
  return;
 }
@@ -1705,7 +2341,7 @@ fd_set *rfds;
     if (!ch && (todoline.len > 1)) {
       switch (todoline.s[0]) {
 	case 'D':
-	  if (flagexitasap) break;
+	  /* even when exiting, the exit snapshot needs it */
 	  todo_del(todoline.s + 1);
 	  break;
 	case 'L':
@@ -1726,6 +2362,23 @@ fd_set *rfds;
   }
 }
 
+/* take in the 'D's qmail-todo already sent before writing a snapshot */
+void todo_drain()
+{
+ fd_set rfds;
+ struct timeval tv;
+
+ while (flagtodoalive)
+  {
+   FD_ZERO(&rfds);
+   FD_SET(todofdin,&rfds);
+   tv.tv_sec = 0;
+   tv.tv_usec = 0;
+   if (select(todofdin + 1,&rfds,(fd_set *) 0,(fd_set *) 0,&tv) < 1) return;
+   todo_do(&rfds);
+  }
+}
+
 #endif
 
 /* this file is too long ---------------------------------------------- MAIN */
@@ -1736,6 +2389,7 @@ int getcontrols()
 
  if (control_init() == -1) return 0;
  if (control_readint(&lifetime,"control/queuelifetime") == -1) return 0;
+ if (control_readint(&snapinterval,"control/snapshotinterval") == -1) return 0;
  if (control_readint(&concurrency[0],"control/concurrencylocal") == -1) return 0;
  if (control_readint(&concurrency[1],"control/concurrencyremote") == -1) return 0;
  if (control_rldef(&envnoathost,"control/envnoathost",1,"envnoathost") != 1) return 0;
@@ -1772,10 +2426,19 @@ int getcontrols()
    case 0: if (!constmap_init(&mapvdoms,"",0,1)) return 0; break;
    case 1: if (!constmap_init(&mapvdoms,vdoms.s,vdoms.len,1)) return 0; break;
   }
+ switch(control_readfile(&retries,"control/retryschedule",0))
+  {
+   case -1: return 0;
+   case 0: if (!constmap_init(&mapretry,"",0,1)) return 0; break;
+   case 1: if (!constmap_init(&mapretry,retries.s,retries.len,1)) return 0; break;
+  }
+ if (control_readint(&retryjitter,"control/retryjitter") == -1) return 0;
+ if (!limit_init()) return 0;
  return 1; }
 
 stralloc newlocals = {0};
 stralloc newvdoms = {0};
+stralloc newretries = {0};
 stralloc newcbtext = {0};
 
 void regetcontrols()
@@ -1786,6 +2449,21 @@ void regetcontrols()
  if (control_readint(&bouncemaxbytes,"control/bouncemaxbytes") == -1)
   { log1("alert: unable to reread control/bouncemaxbytes\n"); return; }
  
+ if (control_readint(&retryjitter,"control/retryjitter") == -1)
+  { log1("alert: unable to reread control/retryjitter\n"); return; }
+
+ r = control_readfile(&newretries,"control/retryschedule",0);
+ if (r == -1)
+  { log1("alert: unable to reread control/retryschedule\n"); return; }
+ constmap_free(&mapretry);
+ if (r)
+  {
+   while (!stralloc_copy(&retries,&newretries)) nomem();
+   while (!constmap_init(&mapretry,retries.s,retries.len,1)) nomem();
+  }
+ else
+   while (!constmap_init(&mapretry,"",0,1)) nomem();
+
  if (control_readrawfile(&newcbtext,"control/custombouncetext") == -1)
   { log1("alert: unable to reread control/custombouncetext\n"); return; }
  while (!stralloc_0(&newcbtext)) nomem();
@@ -1822,6 +2500,8 @@ void regetcontrols()
   }
  else
    while (!constmap_init(&mapvdoms,"",0,1)) nomem();
+
+ limit_reread();
 }
 
 void reread()
@@ -1841,9 +2521,7 @@ void reread()
    log1("alert: unable to switch back to queue directory; HELP! sleeping...\n");
    sleep(10);
   }
-#ifdef notyet
  srandom(now());
-#endif
 }
 
 int main()
@@ -1862,9 +2540,7 @@ int main()
   { log1("alert: cannot start: unable to read controls\n"); _exit(111); }
  if (chdir("queue") == -1)
   { log1("alert: cannot start: unable to switch to queue directory\n"); _exit(111); }
-#ifdef notyet
  srandom(now() + (getpid() << 16));
-#endif
  sig_pipeignore();
  sig_termcatch(sigterm);
  sig_alarmcatch(sigalrm);
@@ -1931,6 +2607,7 @@ int main()
    comm_selprep(&nfds,&wfds);
    del_selprep(&nfds,&rfds);
    pass_selprep(&wakeup);
+   limit_selprep(&wakeup);
    todo_selprep(&nfds,&rfds,&wakeup);
    cleanup_selprep(&wakeup);
 
@@ -1950,10 +2627,22 @@ int main()
      comm_do(&wfds);
      del_do(&rfds);
      todo_do(&rfds);
+     limit_do();
      pass_do();
      cleanup_do();
+     clean_flush();
+     if (snapinterval && recent >= nextsnapshot)
+      {
+#ifdef EXTERNAL_TODO
+       todo_drain();
+#endif
+       snapshot_write();
+       nextsnapshot = recent + snapinterval;
+      }
     }
   }
+ clean_flush();
+ if (snapinterval) snapshot_write();
  pqfinish();
  log1("status: exiting\n");
  return 0;
@@ -40,6 +40,7 @@ SSL *ssl = NULL;
 #endif
 #ifdef DATA_COMPRESS
 /* zlib needs to be after openssl includes or build will fail */
+#include <sys/time.h>
 #include <zlib.h>
 #endif
 
@@ -915,7 +916,7 @@ void smtp_ehlo(char *arg)
     out("250-SIZE "); out(smtpsize); out("\r\n");
   }
 #ifdef DATA_COMPRESS
-  out("250-DATAZ\r\n");
+  out("250-DATAZ DEFLATE\r\n");
 #endif
 #ifdef TLS_SMTPD
   if (!ssl && sslcert.s && *sslcert.s)
@@ -1259,10 +1260,25 @@ z_stream stream;
 char zbuf[4096];
 int wantcomp = 0;
 int compdata = 0;
+unsigned long zusec = 0;
+
+int zinflate(void)
+{
+  struct timeval start, stop;
+  int r;
+
+  gettimeofday(&start,(struct timezone *) 0);
+  r = inflate(&stream,0);
+  gettimeofday(&stop,(struct timezone *) 0);
+  zusec += (stop.tv_sec - start.tv_sec) * 1000000 +
+    stop.tv_usec - start.tv_usec;
+  return r;
+}
 
 int compression_init(void)
 {
   compdata = 1;
+  zusec = 0;
   stream.zalloc = Z_NULL;
   stream.zfree = Z_NULL;
   stream.opaque = Z_NULL;
@@ -1299,7 +1315,16 @@ int compression_done(void)
   logpid(3);
   logstring(3,"DDC saved ");
   logstring(3,num);
-  logstring(3," percent");
+  logstring(3," percent, ");
+  num[fmt_ulong(num,stream.total_in)] = 0;
+  logstring(3,num);
+  logstring(3," to ");
+  num[fmt_ulong(num,stream.total_out)] = 0;
+  logstring(3,num);
+  logstring(3," bytes in ");
+  num[fmt_ulong(num,zusec / 1000)] = 0;
+  logstring(3,num);
+  logstring(3," ms");
   logflush(3);
   return 0;
 }
@@ -1326,7 +1351,7 @@ int saferead(int fd,void *buf,int len)
 	stream.avail_in = r;
 	stream.next_in = zbuf;
       }
-      r = inflate(&stream, 0);
+      r = zinflate();
       switch (r) {
       case Z_OK:
 	if (stream.avail_out == 0)
@@ -1358,22 +1383,31 @@ int saferead(int fd,void *buf,int len)
   return r;
 }
 
-char ssinbuf[1024];
+char ssinbuf[SUBSTDIO_INSIZE];
 substdio ssin = SUBSTDIO_FDBUF(saferead,0,ssinbuf,sizeof ssinbuf);
 
 unsigned long bytestooverflow = 0;
 unsigned long bytesreceived = 0;
 
-void put(const char *ch)
+void putb(const char *buf, unsigned int len)
 {
 #ifdef SMTPEXECCHECK
-  execcheck_put(&qqt, ch);
+  execcheck_putb(&qqt, buf, len);
 #endif
-  if (bytestooverflow)
-    if (!--bytestooverflow)
+  if (bytestooverflow) {
+    if (len >= bytestooverflow) {
+      bytestooverflow = 0;
       qmail_fail(&qqt);
-  qmail_put(&qqt,ch,1);
-  ++bytesreceived;
+    } else
+      bytestooverflow -= len;
+  }
+  qmail_put(&qqt,buf,len);
+  bytesreceived += len;
+}
+
+void put(const char *ch)
+{
+  putb(ch,1);
 }
 
 void stutter(const char *str)
@@ -1404,6 +1438,9 @@ void stutter(const char *str)
 void blast(unsigned int *hops)
 {
   char ch;
+  char *buf;
+  int n;
+  unsigned int i;
   int state;
   int flaginheader;
   unsigned int pos; /* number of bytes since most recent \n, if fih */
@@ -1416,6 +1453,25 @@ void blast(unsigned int *hops)
   flaginheader = 1;
   pos = 0; flagmaybex = flagmaybey = flagmaybez = 1;
   for (;;) {
+    if (!flaginheader && state == 0) {
+      /* inside a body line only \r\n matters, forward whole runs */
+      n = substdio_feed(&ssin);
+      if (n <= 0) die_read();
+      buf = substdio_PEEK(&ssin);
+      i = byte_chr(buf,n,'\n');
+      if (i == (unsigned int)n) {
+        if (buf[i - 1] == '\r') { --i; state = 4; }
+        putb(buf,i);
+        substdio_SEEK(&ssin,n);
+        continue;
+      }
+      if (i == 0 || buf[i - 1] != '\r') straynewline();
+      putb(buf,i - 1);
+      put("\n");
+      substdio_SEEK(&ssin,i + 1);
+      state = 1;
+      continue;
+    }
     substdio_get(&ssin,&ch,1);
     if (flaginheader) {
       if (pos < 9) {
@@ -1601,8 +1657,15 @@ void smtp_data(char *arg) {
 #ifdef DATA_COMPRESS
 void smtp_dataz(char *arg)
 {
+  /* DATAZ without an argument is deflate too */
+  if (*arg && case_diffs(arg,"deflate")) {
+    out("504 compression method not supported (#5.5.4)\r\n");
+    logline2(3,"unsupported DATAZ method: ",arg);
+    return;
+  }
   wantcomp = 1;
   smtp_data((char *)0);
+  wantcomp = 0;
 }
 #endif
 
@@ -37,6 +37,7 @@
 #include <unistd.h>
 #include "alloc.h"
 #include "auto_qmail.h"
+#include "auto_split.h"
 #include "byte.h"
 #include "case.h"
 #include "cdb.h"
@@ -45,8 +46,10 @@
 #include "direntry.h"
 #include "error.h"
 #include "exit.h"
+#include "fd.h"
 #include "fmt.h"
 #include "fmtqfn.h"
+#include "fork.h"
 #include "getln.h"
 #include "open.h"
 #include "ndelay.h"
@@ -68,6 +71,7 @@
 #define SLEEP_FUZZ 1 /* slop a bit on sleeps to avoid zeno effect */
 #define SLEEP_FOREVER 86400 /* absolute maximum time spent in select() */
 #define SLEEP_SYSFAIL 123
+#define MAXWORKERS 32
 
 stralloc percenthack = {0};
 struct constmap mappercenthack;
@@ -85,8 +89,15 @@ const char *chanaddr[CHANNELS] = { "local/", "remote/" };
 
 datetime_sec recent;
 
+int numworkers = 1; /* control/todoworkers */
+int worker = -1; /* the worker number, -1 for the coordinator */
+int flagkicked = 0; /* worker: the coordinator saw the trigger */
+
 void log1(const char *);
 void log3(const char *, const char *, const char *);
+void worker_sendall(char);
+void worker_acked(void);
+int worker_busy(void);
 
 int flagstopasap = 0;
 void sigterm(void)
@@ -210,8 +221,8 @@ int rewrite(char *recip)
 
 /* this file is not so long --------------------------------- COMMUNICATION */
 
-substdio sstoqc; char sstoqcbuf[1024];
-substdio ssfromqc; char ssfromqcbuf[1024];
+substdio sstoqc; char sstoqcbuf[SUBSTDIO_OUTSIZE];
+substdio ssfromqc; char ssfromqcbuf[SUBSTDIO_INSIZE];
 stralloc comm_buf = {0};
 unsigned int comm_pos;
 int fdout = -1;
@@ -349,7 +360,7 @@ void comm_exit(void)
 void comm_selprep(int *nfds, fd_set *wfds, fd_set *rfds)
 {
   if (flagsendalive) {
-    if (flagstopasap && comm_canwrite() == 0)
+    if (flagstopasap && comm_canwrite() == 0 && !worker_busy())
       comm_exit();
     if (comm_canwrite()) {
       FD_SET(fdout,wfds);
@@ -385,20 +396,29 @@ void comm_do(fd_set *wfds, fd_set *rfds)
       }
   if (flagsendalive)
     if (FD_ISSET(fdin,rfds)) {
-      /* there are only two messages 'H' and 'X' */
-      char c;
+      /* there are only two messages 'H' and 'X', workers get 'T' and '+' */
+      char buf[64];
       int r;
-      r = read(fdin, &c, 1);
+      int i;
+      r = read(fdin, buf, sizeof(buf));
       if (r <= 0) {
 	if (r != -1 || errno != error_intr)
 	  senddied();
-      } else {
-	switch(c) {
+      } else for (i = 0;i < r;++i) {
+	switch(buf[i]) {
 	  case 'H':
 	    sighup();
+	    worker_sendall('H');
 	    break;
 	  case 'X':
 	    sigterm();
+	    worker_sendall('X');
+	    break;
+	  case 'T':
+	    flagkicked = 1;
+	    break;
+	  case '+':
+	    worker_acked();
 	    break;
 	  default:
 	    log1("warning: qmail-todo: qmail-send speaks an obscure dialect\n");
@@ -408,6 +428,269 @@ void comm_do(fd_set *wfds, fd_set *rfds)
     }
 }
 
+/* this file is not so long --------------------------------------- WORKERS */
+
+/*
+ * With control/todoworkers set to more than one, qmail-todo forks that
+ * many workers. Worker k preprocesses the todo entries of the splits
+ * with split % numworkers == k and reports to the coordinator just like
+ * qmail-todo reports to qmail-send. The coordinator owns the trigger
+ * and the qmail-clean connection. It passes log lines through and
+ * forwards a D record to qmail-send only after qmail-clean removed the
+ * todo entry, so the order seen by qmail-send stays the same. Each
+ * cleanup is acknowledged to the worker with a '+'; until then the
+ * worker must not pick up that todo entry again. With BIGTODO a worker
+ * only reads its own todo/<split> directories, a flat todo/ is read by
+ * every worker.
+ */
+
+#define MAXPENDING 64
+unsigned long pending[MAXPENDING]; /* worker: reported but not cleaned */
+unsigned int pendpos = 0;
+unsigned int pendnum = 0;
+
+struct todoworker {
+  int pid;
+  int fdin;  /* reports from the worker */
+  int fdout; /* H, X, T and + to the worker */
+  stralloc line;
+  stralloc out; /* waiting for fdout to become writable */
+  unsigned int outpos;
+} workers[MAXWORKERS];
+
+stralloc cleanrecs = {0}; /* D records waiting for qmail-clean */
+stralloc cleanwho = {0}; /* and the workers they came from */
+
+void worker_died(int k)
+{
+  strnum[fmt_ulong(strnum,(unsigned long) k)] = 0;
+  log3("alert: qmail-todo: lost worker ",strnum,"! dying...\n");
+  flagstopasap = 1;
+  close(workers[k].fdin); workers[k].fdin = -1;
+  close(workers[k].fdout); workers[k].fdout = -1;
+  workers[k].out.len = 0; workers[k].outpos = 0;
+  worker_sendall('X');
+}
+
+void worker_start(void)
+{
+  int pin[2];
+  int pout[2];
+  int k;
+  int j;
+
+  if (numworkers <= 1) return;
+  for (k = 0;k < numworkers;++k) {
+    if (pipe(pin) == -1 || pipe(pout) == -1) {
+      log1("alert: qmail-todo: cannot start: unable to create pipes\n");
+      _exit(111);
+    }
+    switch (workers[k].pid = fork()) {
+      case -1:
+	log1("alert: qmail-todo: cannot start: unable to fork\n");
+	_exit(111);
+      case 0:
+	close(pin[0]); close(pout[1]);
+	for (j = 0;j < k;++j) {
+	  close(workers[j].fdin);
+	  close(workers[j].fdout);
+	}
+	/* the worker talks to us like we talk to qmail-send */
+	if (fd_move(0,pout[0]) == -1) _exit(111);
+	if (fd_move(1,pin[1]) == -1) _exit(111);
+	close(2); close(3); /* qmail-clean is ours */
+	worker = k;
+	comm_buf.len = 0; /* the coordinator sends what it has buffered */
+	comm_pos = 0;
+	comm_init();
+	return;
+    }
+    close(pin[1]); close(pout[0]);
+    workers[k].fdin = pin[0];
+    workers[k].fdout = pout[1];
+    ndelay_on(workers[k].fdout);
+  }
+}
+
+void worker_send(int k, char c)
+{
+  struct todoworker *w;
+
+  w = &workers[k];
+  if (w->fdout == -1) return;
+  /* one unsent T is as good as many */
+  if (c == 'T' && byte_chr(w->out.s + w->outpos,w->out.len - w->outpos,'T')
+      < w->out.len - w->outpos)
+    return;
+  while (!stralloc_append(&w->out,&c)) nomem();
+}
+
+void worker_sendall(char c)
+{
+  int k;
+
+  if (worker != -1) return;
+  for (k = 0;k < numworkers && numworkers > 1;++k)
+    worker_send(k,c);
+}
+
+int worker_busy(void)
+{
+  int k;
+
+  if (worker != -1) return 0;
+  for (k = 0;k < numworkers && numworkers > 1;++k)
+    if (workers[k].fdin != -1) return 1;
+  return cleanrecs.len != 0;
+}
+
+int worker_mine(unsigned long id)
+{
+  unsigned int i;
+
+  if (worker == -1) return 1;
+  if ((id % auto_split) % numworkers != worker) return 0;
+  for (i = 0;i < pendnum;++i)
+    if (pending[(pendpos + i) % MAXPENDING] == id) return 0;
+  return 1;
+}
+
+int worker_full(void)
+{
+  return worker != -1 && pendnum == MAXPENDING;
+}
+
+void worker_pending(unsigned long id)
+{
+  pending[(pendpos + pendnum) % MAXPENDING] = id;
+  ++pendnum;
+}
+
+void worker_acked(void)
+{
+  if (!pendnum) return;
+  pendpos = (pendpos + 1) % MAXPENDING;
+  --pendnum;
+}
+
+void worker_selprep(int *nfds, fd_set *wfds, fd_set *rfds)
+{
+  int k;
+
+  if (worker != -1) return;
+  for (k = 0;k < numworkers && numworkers > 1;++k) {
+    if (workers[k].fdin != -1) {
+      FD_SET(workers[k].fdin,rfds);
+      if (*nfds <= workers[k].fdin)
+	*nfds = workers[k].fdin + 1;
+    }
+    if (workers[k].fdout != -1 && workers[k].out.len) {
+      FD_SET(workers[k].fdout,wfds);
+      if (*nfds <= workers[k].fdout)
+	*nfds = workers[k].fdout + 1;
+    }
+  }
+}
+
+/* all cleanups of one round go to qmail-clean as one batch */
+void worker_clean(void)
+{
+  unsigned long id;
+  unsigned int i;
+  unsigned int n;
+  unsigned int len;
+  char ch;
+
+  if (!cleanrecs.len) return;
+  for (i = 0;i < cleanrecs.len;i += len + 1) {
+    len = str_len(cleanrecs.s + i);
+    scan_ulong(cleanrecs.s + i + 2,&id);
+    fnmake_todo(id);
+    if (substdio_put(&sstoqc,fn.s,fn.len) == -1) goto fail;
+  }
+  if (substdio_flush(&sstoqc) == -1) goto fail;
+  for (i = n = 0;i < cleanrecs.len;i += len + 1, ++n) {
+    len = str_len(cleanrecs.s + i);
+    if (substdio_get(&ssfromqc,&ch,1) != 1) goto fail;
+    worker_send((unsigned char) cleanwho.s[n],'+');
+    if (ch != '+') {
+      scan_ulong(cleanrecs.s + i + 2,&id);
+      fnmake_todo(id);
+      log3("warning: qmail-clean unable to clean up ",fn.s,"\n");
+      continue;
+    }
+    while (!stralloc_catb(&comm_buf,cleanrecs.s + i,len + 1)) nomem();
+  }
+  cleanrecs.len = 0;
+  cleanwho.len = 0;
+  return;
+
+fail:
+  cleanrecs.len = 0;
+  cleanwho.len = 0;
+  cleandied();
+}
+
+void worker_do(fd_set *wfds, fd_set *rfds)
+{
+  char buf[1024];
+  struct todoworker *w;
+  char ch;
+  int k;
+  int r;
+  int i;
+
+  if (worker != -1) return;
+  /* first write then read */
+  for (k = 0;k < numworkers && numworkers > 1;++k) {
+    w = &workers[k];
+    if (w->fdout == -1 || !w->out.len || !FD_ISSET(w->fdout,wfds)) continue;
+    r = subwrite(w->fdout,w->out.s + w->outpos,w->out.len - w->outpos);
+    if (r <= 0) {
+      if (r == -1 && errno == error_pipe) worker_died(k);
+      continue;
+    }
+    w->outpos += r;
+    if (w->outpos == w->out.len) {
+      w->out.len = 0;
+      w->outpos = 0;
+    }
+  }
+  for (k = 0;k < numworkers && numworkers > 1;++k) {
+    w = &workers[k];
+    if (w->fdin == -1 || !FD_ISSET(w->fdin,rfds)) continue;
+    r = read(w->fdin,buf,sizeof(buf));
+    if (r == -1) continue;
+    if (r == 0) { worker_died(k); continue; }
+    for (i = 0;i < r;++i) {
+      while (!stralloc_append(&w->line,&buf[i])) nomem();
+      if (buf[i]) continue;
+      switch (w->line.s[0]) {
+	case 'L':
+	  while (!stralloc_cat(&comm_buf,&w->line)) nomem();
+	  break;
+	case 'D':
+	  if (w->line.len <= 3) break;
+	  while (!stralloc_cat(&cleanrecs,&w->line)) nomem();
+	  ch = k;
+	  while (!stralloc_append(&cleanwho,&ch)) nomem();
+	  break;
+	case 'X':
+	  /* the worker is done, closing its input lets it exit */
+	  close(w->fdin); w->fdin = -1;
+	  close(w->fdout); w->fdout = -1;
+	  w->out.len = 0; w->outpos = 0;
+	  break;
+	default:
+	  log1("warning: qmail-todo: worker speaks an obscure dialect\n");
+      }
+      w->line.len = 0;
+      if (w->fdin == -1) break;
+    }
+  }
+  worker_clean();
+}
+
 /* this file is not so long ------------------------------------------ TODO */
 
 datetime_sec nexttodorun;
@@ -436,7 +719,10 @@ void todo_init(void)
 void todo_selprep(int *nfds, fd_set *rfds, datetime_sec *wakeup)
 {
  if (flagstopasap) return;
- trigger_selprep(nfds,rfds);
+ if (worker == -1) trigger_selprep(nfds,rfds);
+ if (worker == -1 && numworkers > 1) return;
+ if (worker_full()) return; /* wait for the coordinator */
+ if (flagkicked) *wakeup = 0;
 #ifndef BIGTODO
  if (tododir) *wakeup = 0;
 #else
@@ -470,16 +756,38 @@ void todo_do(fd_set *rfds)
 
  if (flagstopasap) return;
 
+ if (worker == -1 && numworkers > 1)
+  {
+   /* the workers scan todo/ on their own, just pass the trigger on */
+   if (trigger_pulled(rfds))
+    {
+     trigger_set();
+     worker_sendall('T');
+    }
+   return;
+  }
+ if (worker_full()) return;
+
 #ifndef BIGTODO
  if (!tododir)
 #else
  if (!flagtododir)
 #endif
   {
-   if (!trigger_pulled(rfds))
-     if (recent < nexttodorun)
-       return;
-   trigger_set();
+   if (worker == -1)
+    {
+     if (!trigger_pulled(rfds))
+       if (recent < nexttodorun)
+	 return;
+     trigger_set();
+    }
+   else
+    {
+     if (!flagkicked)
+       if (recent < nexttodorun)
+	 return;
+     flagkicked = 0;
+    }
 #ifndef BIGTODO
    tododir = opendir("todo");
    if (!tododir)
@@ -489,6 +797,8 @@ void todo_do(fd_set *rfds)
     }
 #else
    readsubdir_init(&todosubdir, "todo", pausedir);
+   /* a worker only opens the splits it owns */
+   if (worker != -1) readsubdir_split(&todosubdir, worker, numworkers);
    flagtododir = 1;
 #endif
    nexttodorun = recent + SLEEP_TODO;
@@ -514,6 +824,7 @@ void todo_do(fd_set *rfds)
    default: return;
   }
 #endif
+ if (!worker_mine(id)) return;
 
  fnmake_todo(id);
 
@@ -626,6 +937,14 @@ void todo_do(fd_set *rfds)
      close(fdchan[c]); fdchan[c] = -1;
     }
 
+ if (worker != -1)
+  {
+   /* the coordinator cleans up todo/ before it tells qmail-send */
+   worker_pending(id);
+   comm_write(id, flagchan[0], flagchan[1]);
+   return;
+  }
+
  fnmake_todo(id);
  if (substdio_putflush(&sstoqc,fn.s,fn.len) == -1) { cleandied(); return; }
  if (substdio_get(&ssfromqc,&ch,1) != 1) { cleandied(); return; }
@@ -654,6 +973,9 @@ int getcontrols(void)
  
  if (control_init() == -1) return 0;
  if (control_rldef(&envnoathost,"control/envnoathost",1,"envnoathost") != 1) return 0;
+ if (control_readint(&numworkers,"control/todoworkers") == -1) return 0;
+ if (numworkers < 1) numworkers = 1;
+ if (numworkers > MAXWORKERS) numworkers = MAXWORKERS;
  
  if (stat("control/locals.cdb", &st) == 0) {
    if (!stralloc_copys(&localscdb, auto_qmail)) return 0;
@@ -767,6 +1089,8 @@ int main()
    if (r == 0) /* Uh-oh, qmail-send died. */
      _exit(100);
  } while (r != 1); /* we assume it is a 'S' */
+
+ worker_start();
  
  for (;;)
   {
@@ -789,6 +1113,7 @@ int main()
    nfds = 1;
 
    todo_selprep(&nfds,&rfds,&wakeup);
+   worker_selprep(&nfds,&wfds,&rfds);
    comm_selprep(&nfds,&wfds,&rfds);
 
    if (wakeup <= recent) tv.tv_sec = 0;
@@ -805,6 +1130,7 @@ int main()
      recent = now();
 
      todo_do(&rfds);
+     worker_do(&wfds,&rfds);
      comm_do(&wfds, &rfds);
     }
   }
@@ -10,7 +10,7 @@ struct qmail {
   int fde;
   int fderr;
   substdio ss;
-  char buf[1024];
+  char buf[SUBSTDIO_OUTSIZE];
 } ;
 
 extern int qmail_open(struct qmail *);
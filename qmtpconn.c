@@ -0,0 +1,250 @@
+/*
+ * Copyright (c) 2000-2004 Claudio Jeker,
+ *      Internet Business Solutions AG, CH-8005 Zrich, Switzerland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Internet Business
+ *      Solutions AG and its contributors.
+ * 4. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "byte.h"
+#include "fmt.h"
+#include "ip.h"
+#include "lock.h"
+#include "open.h"
+#include "qmtpconn.h"
+#include "select.h"
+#include "str.h"
+
+/*
+ * QMTP allows any number of messages per connection but every
+ * qmail-remote process delivers exactly one. To save the connection
+ * setup and slow start for the next message to the same relay the
+ * connection is handed to a child that waits up to control/qmtpidle
+ * seconds on QMTPCONN_DIR/ip:port. The next qmail-remote for that
+ * relay connects to the socket and gets the QMTP connection passed
+ * over it (SCM_RIGHTS). A lock file makes sure only one connection
+ * per relay is kept, the holder gives up as soon as the server closes
+ * the connection or sends anything.
+ */
+
+static int
+qmtpconn_path(struct sockaddr_un *sun, struct ip_address *ip,
+    unsigned long port)
+{
+	char *s;
+	unsigned int len;
+
+	byte_zero(sun, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	s = sun->sun_path;
+	len = str_len(QMTPCONN_DIR);
+	if (len + 1 + IPFMT + 1 + FMT_ULONG + 5 >= sizeof(sun->sun_path))
+		return -1;
+	byte_copy(s, len, QMTPCONN_DIR);
+	s += len;
+	*s++ = '/';
+	s += ip_fmt(s, ip);
+	*s++ = ':';
+	s += fmt_ulong(s, port);
+	*s = 0;
+	return 0;
+}
+
+/* returns 1 if fd has something to read (data, EOF or error) */
+static int
+readable(int fd, int sec)
+{
+	fd_set rfds;
+	struct timeval tv;
+
+	FD_ZERO(&rfds);
+	FD_SET(fd, &rfds);
+	tv.tv_sec = sec;
+	tv.tv_usec = 0;
+	return select(fd + 1, &rfds, (fd_set *)0, (fd_set *)0, &tv) > 0;
+}
+
+/*
+ * Returns an idle connection to ip:port or -1 if there is none.
+ */
+int
+qmtpconn_get(struct ip_address *ip, unsigned long port)
+{
+	struct sockaddr_un sun;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	char ch;
+	int s, fd;
+
+	if (qmtpconn_path(&sun, ip, port) == -1)
+		return -1;
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1)
+		return -1;
+	if (connect(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		goto fail;
+	if (!readable(s, 2))
+		goto fail;
+
+	byte_zero(&msg, sizeof(msg));
+	iov.iov_base = &ch;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+	if (recvmsg(s, &msg, 0) != 1)
+		goto fail;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == 0 || cmsg->cmsg_level != SOL_SOCKET ||
+	    cmsg->cmsg_type != SCM_RIGHTS ||
+	    cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+		goto fail;
+	byte_copy(&fd, sizeof(int), CMSG_DATA(cmsg));
+	close(s);
+
+	/* the server closed it in the meantime */
+	if (readable(fd, 0)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+
+fail:
+	close(s);
+	return -1;
+}
+
+static int
+passfd(int s, int fd)
+{
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(sizeof(int))];
+	} cbuf;
+	char ch = 'Q';
+
+	byte_zero(&msg, sizeof(msg));
+	iov.iov_base = &ch;
+	iov.iov_len = 1;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf.buf;
+	msg.msg_controllen = sizeof(cbuf.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	byte_copy(CMSG_DATA(cmsg), sizeof(int), &fd);
+	return sendmsg(s, &msg, 0) == 1 ? 0 : -1;
+}
+
+/*
+ * Keep the QMTP connection fd to ip:port open for idle seconds so the
+ * next qmail-remote can reuse it. The caller must not use fd afterwards.
+ */
+void
+qmtpconn_keep(int fd, struct ip_address *ip, unsigned long port, int idle)
+{
+	struct sockaddr_un sun;
+	char lockfn[sizeof(sun.sun_path) + 5];
+	fd_set rfds;
+	struct timeval tv;
+	unsigned int len;
+	int fdlock, s, c, m;
+
+	if (idle <= 0 || qmtpconn_path(&sun, ip, port) == -1) {
+		close(fd);
+		return;
+	}
+	switch (fork()) {
+	case -1:
+	default:
+		close(fd);
+		return;
+	case 0:
+		break;
+	}
+
+	/* don't keep the report pipe or the message open */
+	close(0);
+	close(1);
+	close(2);
+
+	len = str_len(sun.sun_path);
+	byte_copy(lockfn, len, sun.sun_path);
+	byte_copy(lockfn + len, 6, ".lock");
+	fdlock = open_append(lockfn);
+	if (fdlock == -1)
+		_exit(0);
+	if (lock_exnb(fdlock) == -1)
+		_exit(0);	/* somebody else keeps one already */
+
+	s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == -1)
+		_exit(0);
+	unlink(sun.sun_path);
+	if (bind(s, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+		_exit(0);
+	if (listen(s, 1) == -1)
+		goto done;
+
+	tv.tv_sec = idle;
+	tv.tv_usec = 0;
+	m = s > fd ? s : fd;
+	FD_ZERO(&rfds);
+	FD_SET(s, &rfds);
+	FD_SET(fd, &rfds);
+	if (select(m + 1, &rfds, (fd_set *)0, (fd_set *)0, &tv) <= 0)
+		goto done;
+	if (FD_ISSET(fd, &rfds))
+		goto done;	/* closed by the server */
+	c = accept(s, (struct sockaddr *)0, (socklen_t *)0);
+	/* nobody else may find the socket once the connection is gone */
+	unlink(sun.sun_path);
+	if (c != -1)
+		passfd(c, fd);
+	_exit(0);
+
+done:
+	unlink(sun.sun_path);
+	_exit(0);
+}
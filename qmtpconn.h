@@ -0,0 +1,12 @@
+#ifndef QMTPCONN_H
+#define QMTPCONN_H
+
+#include "ip.h"
+
+/* directory holding one socket per idle connection, named ip:port */
+#define QMTPCONN_DIR	"queue/lock/qmtp"
+
+extern int qmtpconn_get(struct ip_address *, unsigned long);
+extern void qmtpconn_keep(int, struct ip_address *, unsigned long, int);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * queuebench [-n messages] [-s bytes] recipient [concurrency ...]
+ * Injects messages through qmail_open() at each given concurrency (by
+ * default 1, 4, 16 and 64) and prints the messages per second. Like
+ * qmail-smtpd it runs qmail-queue, or $QMAILQUEUE with ALTQUEUE, so
+ * "env QMAILQUEUE=bin/qmail-queuec queuebench ..." measures the way
+ * through qmail-queued. The messages are really queued: use a test
+ * installation and a recipient that throws the mail away.
+ */
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "bench.h"
+#include "fork.h"
+#include "qmail.h"
+#include "scan.h"
+#include "sgetopt.h"
+#include "strerr.h"
+#include "wait.h"
+
+#define FATAL "queuebench: fatal: "
+#define USAGE "queuebench: usage: queuebench [-n messages] " \
+    "[-s bytes] recipient [concurrency ...]"
+#define WARN "queuebench: warning: "
+
+unsigned long messages = 1000;
+unsigned long size = 4096;
+char *recip;
+char line[78];
+
+/* inject num messages, the exit code tells the number of failures */
+static void
+worker(unsigned long num)
+{
+	struct qmail qq;
+	const char *err;
+	unsigned long left;
+	unsigned int fails;
+
+	fails = 0;
+	while (num-- > 0) {
+		if (qmail_open(&qq) == -1) {
+			strerr_warn2(WARN, "unable to fork: ", &strerr_sys);
+			if (fails < 100) ++fails;
+			continue;
+		}
+		qmail_puts(&qq, "Subject: queuebench\n\n");
+		for (left = size; left > sizeof(line); left -= sizeof(line))
+			qmail_put(&qq, line, sizeof(line));
+		qmail_put(&qq, line + sizeof(line) - left, left);
+		qmail_from(&qq, "");
+		qmail_to(&qq, recip);
+		err = qmail_close(&qq);
+		if (*err) {
+			strerr_warn2(WARN, err + 1, 0);
+			if (fails < 100) ++fails;
+		}
+	}
+	_exit(fails);
+}
+
+static void
+run(unsigned long conc)
+{
+	struct timeval t0, t1;
+	unsigned long i, ms, fails;
+	int wstat;
+	int pid;
+
+	gettimeofday(&t0, (struct timezone *)0);
+	for (i = 0; i < conc; i++)
+		switch (fork()) {
+		case -1:
+			strerr_die2sys(111, FATAL, "unable to fork: ");
+		case 0:
+			worker(messages / conc + (i < messages % conc));
+		}
+	fails = 0;
+	for (i = 0; i < conc; i++) {
+		pid = wait_pid(&wstat, -1);
+		if (pid == -1)
+			strerr_die2sys(111, FATAL, "unable to wait: ");
+		if (wait_crashed(wstat))
+			strerr_die2x(111, FATAL, "worker crashed");
+		fails += wait_exitcode(wstat);
+	}
+	gettimeofday(&t1, (struct timezone *)0);
+	ms = (t1.tv_sec - t0.tv_sec) * 1000;
+	ms += (t1.tv_usec - t0.tv_usec) / 1000;
+	if (!ms) ms = 1;
+
+	bench_put("concurrency "); bench_putnum(conc);
+	bench_put(": "); bench_putnum(messages);
+	bench_put(" messages in "); bench_putnum(ms);
+	bench_put(" ms, "); bench_putnum(messages * 1000 / ms);
+	bench_put(" msg/s");
+	if (fails) {
+		bench_put(", "); bench_putnum(fails); bench_put(" failed");
+	}
+	bench_put("\n");
+	bench_flush();
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long conc;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != opteof)
+		switch (opt) {
+		case 'n':
+			scan_ulong(optarg, &messages);
+			break;
+		case 's':
+			scan_ulong(optarg, &size);
+			break;
+		default:
+			bench_usage(USAGE);
+		}
+	argc -= optind;
+	argv += optind;
+	if (!*argv || !messages)
+		bench_usage(USAGE);
+	recip = *argv++;
+
+	for (i = 0; i < sizeof(line) - 1; i++)
+		line[i] = 'a' + i % 26;
+	line[i] = '\n';
+
+	if (!*argv) {
+		for (conc = 1; conc <= 64; conc *= 4)
+			run(conc);
+		return 0;
+	}
+	for (; *argv; argv++) {
+		scan_ulong(*argv, &conc);
+		if (!conc || conc > messages)
+			bench_usage(USAGE);
+		run(conc);
+	}
+	return 0;
+}
@@ -13,6 +13,17 @@ void (*pause)();
  rs->pause = pause;
  rs->dir = 0;
  rs->pos = 0;
+ rs->step = 1;
+}
+
+/* read only the subdirectories first, first + step, first + 2 * step, ... */
+void readsubdir_split(rs,first,step)
+readsubdir *rs;
+unsigned int first;
+unsigned int step;
+{
+ rs->pos = first;
+ rs->step = step ? step : 1;
 }
 
 static char namepos[FMT_ULONG + 4 + READSUBDIR_NAMELEN];
@@ -27,14 +38,15 @@ unsigned long *id;
  if (!rs->dir)
   {
    if (rs->pos >= auto_split) return 0;
-   if (str_len(rs->name) > READSUBDIR_NAMELEN) { rs->pos++; return -1; }
+   if (str_len(rs->name) > READSUBDIR_NAMELEN)
+    { rs->pos += rs->step; return -1; }
    len = 0;
    len += fmt_str(namepos + len,rs->name);
    namepos[len++] = '/';
    len += fmt_uint(namepos + len, rs->pos);
    namepos[len] = 0;
    while (!(rs->dir = opendir(namepos))) rs->pause(namepos);
-   rs->pos++;
+   rs->pos += rs->step;
    return -1;
   }
 
@@ -7,12 +7,14 @@ typedef struct readsubdir
  {
   DIR *dir;
   unsigned int pos;
+  unsigned int step;
   const char *name;
   void (*pause)();
  }
 readsubdir;
 
 extern void readsubdir_init(readsubdir *, const char *, void (*)());
+extern void readsubdir_split(readsubdir *, unsigned int, unsigned int);
 extern int readsubdir_next(readsubdir *, unsigned long *);
 
 #define READSUBDIR_NAMELEN 10
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2000-2004 Claudio Jeker,
+ *      Internet Business Solutions AG, CH-8005 Zrich, Switzerland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Internet Business
+ *      Solutions AG and its contributors.
+ * 4. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#include <stdlib.h>
+#include "constmap.h"
+#include "datetime.h"
+#include "retry.h"
+#include "scan.h"
+#include "str.h"
+
+/*
+ * control/retryschedule lists retry intervals in seconds per channel
+ * (local, remote) or per recipient domain, e.g. remote:60,300,900,3600.
+ * Once the message is older than the sum of the list the last interval
+ * repeats. Without a schedule the old quadratic curve is used.
+ */
+
+const char *
+retry_sched(struct constmap *map, int c, const char *recip)
+{
+	const char *sched;
+	unsigned int i;
+
+	if (recip) {
+		i = str_rchr(recip, '@');
+		if (recip[i]) {
+			++i;
+			sched = constmap(map, recip + i, str_len(recip + i));
+			if (sched)
+				return sched;
+		}
+	}
+	return constmap(map, c ? "remote" : "local", c ? 6 : 5);
+}
+
+/* returns 0 if sched holds no interval */
+datetime_sec
+retry_next(datetime_sec birth, datetime_sec now, const char *sched)
+{
+	datetime_sec t;
+	unsigned long u;
+	unsigned long last;
+	unsigned int i;
+
+	t = birth;
+	last = 0;
+	for (;;) {
+		i = scan_ulong(sched, &u);
+		if (!i)
+			break;
+		if (!u)
+			u = 1;
+		last = u;
+		t += u;
+		if (t > now)
+			return t;
+		sched += i;
+		if (*sched != ',')
+			break;
+		++sched;
+	}
+	if (!last)
+		return 0;
+	return t + ((now - t) / last + 1) * last;
+}
+
+static datetime_sec
+squareroot(datetime_sec x) /* result^2 <= x < (result + 1)^2 */
+{
+	datetime_sec y;
+	datetime_sec yy;
+	datetime_sec y21;
+	int j;
+
+	y = 0; yy = 0;
+	for (j = 15; j >= 0; --j) {
+		y21 = (y << (j + 1)) + (1 << (j + j));
+		if (y21 <= x - yy) { y += (1 << j); yy += y21; }
+	}
+	return y;
+}
+
+/* the classic qmail curve, birth + (sqrt(age) + skip)^2 */
+datetime_sec
+retry_curve(datetime_sec birth, datetime_sec now, unsigned int skip)
+{
+	unsigned int n;
+
+	if (birth > now)
+		n = 0;
+	else
+		n = squareroot(now - birth);
+	n += skip;
+	return birth + n * n;
+}
+
+/*
+ * Spread the retries of messages deferred together over up to jitter
+ * percent of the interval, so they do not come back as a herd against
+ * the recovering host.
+ */
+datetime_sec
+retry_jitter(datetime_sec t, datetime_sec now, int jitter)
+{
+	unsigned long gap;
+
+	if (jitter <= 0)
+		return t;
+	if (t <= now)
+		return t;
+	gap = t - now;
+	gap = gap / 100 * jitter + (gap % 100) * jitter / 100;
+	return t + (unsigned long)random() % (gap + 1);
+}
@@ -0,0 +1,12 @@
+#ifndef RETRY_H
+#define RETRY_H
+
+#include "constmap.h"
+#include "datetime.h"
+
+extern const char *retry_sched(struct constmap *, int, const char *);
+extern datetime_sec retry_next(datetime_sec, datetime_sec, const char *);
+extern datetime_sec retry_curve(datetime_sec, datetime_sec, unsigned int);
+extern datetime_sec retry_jitter(datetime_sec, datetime_sec, int);
+
+#endif
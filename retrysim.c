@@ -0,0 +1,242 @@
+/*
+ * retrysim [-l] [-d domain] [-u up] [-b bucket] [-j jitter] [-s seed]
+ * Replays message births (one time in seconds per line on stdin) against
+ * a host that is unreachable for the first up seconds and prints how
+ * many delivery attempts fall into each bucket of time. The retry times
+ * come from ~control/retryschedule and ~control/retryjitter through the
+ * same code qmail-send uses. For the remote channel the first successful
+ * delivery wakes the messages deferred before, like qmail-send does.
+ */
+#include <stdlib.h>
+#include <unistd.h>
+#include "alloc.h"
+#include "auto_qmail.h"
+#include "bench.h"
+#include "constmap.h"
+#include "control.h"
+#include "getln.h"
+#include "retry.h"
+#include "scan.h"
+#include "sgetopt.h"
+#include "str.h"
+#include "stralloc.h"
+#include "strerr.h"
+#include "subfd.h"
+#include "substdio.h"
+#include "wheel.h"
+
+#define FATAL "retrysim: fatal: "
+#define USAGE "retrysim: usage: retrysim [-l] [-d domain] " \
+    "[-u up] [-b bucket] [-j jitter] [-s seed] < births"
+#define WAKEIDS 32 /* DEFERIDS in qmail-send.c */
+
+stralloc line = {0};
+stralloc recip = {0};
+stralloc retries = {0};
+struct constmap mapretry;
+int retryjitter = 0;
+int channel = 1;
+int chanskip[2] = { 10, 20 };
+
+datetime_sec *birth;
+unsigned int num = 0;
+unsigned int size = 0;
+unsigned long wakeid[WAKEIDS];
+unsigned int wakenum = 0;
+wheel events;
+
+static void
+die_nomem(void)
+{
+	strerr_die2x(111, FATAL, "out of memory");
+}
+
+/* the same decision as nextretry() in qmail-send.c */
+static datetime_sec
+nextretry(datetime_sec b, datetime_sec now)
+{
+	const char *sched;
+	datetime_sec t;
+
+	sched = retry_sched(&mapretry, channel, recip.len ? recip.s : 0);
+	if (sched && b <= now) {
+		t = retry_next(b, now, sched);
+		if (t)
+			return retry_jitter(t, now, retryjitter);
+	}
+	t = retry_curve(b, now, chanskip[channel]);
+	return retry_jitter(t, now, retryjitter);
+}
+
+static void
+readbirths(void)
+{
+	unsigned long u;
+	int match;
+
+	for (;;) {
+		if (getln(subfdin, &line, &match, '\n') == -1)
+			strerr_die2sys(111, FATAL, "unable to read input: ");
+		if (!line.len)
+			break;
+		if (!stralloc_0(&line)) die_nomem();
+		if (!scan_ulong(line.s, &u))
+			continue;
+		if (num == size) {
+			size = size ? 2 * size : 1024;
+			if (!alloc_re((char **)&birth,
+			    num * sizeof(datetime_sec),
+			    size * sizeof(datetime_sec)))
+				die_nomem();
+		}
+		birth[num++] = u;
+		if (!match)
+			break;
+	}
+}
+
+static void
+putbucket(datetime_sec t, unsigned long attempts, unsigned long done)
+{
+	bench_putnum(t); bench_put(" ");
+	bench_putnum(attempts); bench_put(" ");
+	bench_putnum(done); bench_put("\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	struct prioq_elt pe;
+	datetime_sec t0, up, now, cur;
+	unsigned long bucket, seed, u;
+	unsigned long attempts, done, total, delivered, delay, maxdelay;
+	unsigned int i;
+	int flagjitter;
+	int opt;
+
+	up = 3600;
+	bucket = 300;
+	seed = 1;
+	flagjitter = 0;
+	while ((opt = getopt(argc, argv, "ld:u:b:j:s:")) != opteof)
+		switch (opt) {
+		case 'l':
+			channel = 0;
+			break;
+		case 'd':
+			if (!stralloc_copys(&recip, "x@")) die_nomem();
+			if (!stralloc_cats(&recip, optarg)) die_nomem();
+			if (!stralloc_0(&recip)) die_nomem();
+			break;
+		case 'u':
+			scan_ulong(optarg, &u);
+			up = u;
+			break;
+		case 'b':
+			scan_ulong(optarg, &bucket);
+			break;
+		case 'j':
+			scan_ulong(optarg, &u);
+			retryjitter = u;
+			flagjitter = 1;
+			break;
+		case 's':
+			scan_ulong(optarg, &seed);
+			break;
+		default:
+			bench_usage(USAGE);
+		}
+	if (!bucket)
+		bench_usage(USAGE);
+	srandom(seed);
+
+	if (chdir(auto_qmail) == -1)
+		strerr_die4sys(111, FATAL, "unable to chdir to ",
+		    auto_qmail, ": ");
+	if (control_init() == -1)
+		strerr_die2sys(111, FATAL, "unable to read controls: ");
+	switch (control_readfile(&retries, "control/retryschedule", 0)) {
+	case -1:
+		strerr_die2sys(111, FATAL,
+		    "unable to read control/retryschedule: ");
+	case 0:
+		if (!constmap_init(&mapretry, "", 0, 1)) die_nomem();
+		break;
+	case 1:
+		if (!constmap_init(&mapretry, retries.s, retries.len, 1))
+			die_nomem();
+		break;
+	}
+	if (!flagjitter)
+		if (control_readint(&retryjitter, "control/retryjitter") == -1)
+			strerr_die2sys(111, FATAL,
+			    "unable to read control/retryjitter: ");
+
+	readbirths();
+	if (!num)
+		strerr_die2x(100, FATAL, "no births on stdin");
+
+	t0 = birth[0];
+	for (i = 0; i < num; i++) {
+		if (birth[i] < t0)
+			t0 = birth[i];
+		pe.id = i;
+		pe.dt = birth[i];
+		if (!wheel_insert(&events, &pe)) die_nomem();
+	}
+	up += t0;
+
+	bench_put("# seconds attempts deliveries\n");
+	cur = 0;
+	attempts = done = total = delivered = delay = maxdelay = 0;
+	while (wheel_min(&events, &pe)) {
+		wheel_delmin(&events);
+		now = pe.dt;
+		while ((datetime_sec)(now - t0) >= cur + bucket) {
+			putbucket(cur, attempts, done);
+			attempts = done = 0;
+			cur += bucket;
+		}
+		++attempts;
+		++total;
+		if (now < up) {
+			pe.dt = nextretry(birth[pe.id], now);
+			if (pe.dt <= now)
+				pe.dt = now + 1;
+			if (!wheel_insert(&events, &pe)) die_nomem();
+			if (channel == 0)
+				continue;
+			for (i = 0; i < wakenum; i++)
+				if (wakeid[i] == pe.id)
+					break;
+			if (i == wakenum && wakenum < WAKEIDS)
+				wakeid[wakenum++] = pe.id;
+			continue;
+		}
+		++done;
+		++delivered;
+		if (now - up > maxdelay)
+			maxdelay = now - up;
+		delay += now - up;
+		/* the host is back, wake the deferred messages */
+		for (i = 0; i < wakenum; i++)
+			if (wheel_find(&events, wakeid[i], &pe))
+				if (pe.dt > now) {
+					pe.dt = now;
+					if (!wheel_insert(&events, &pe))
+						die_nomem();
+				}
+		wakenum = 0;
+	}
+	putbucket(cur, attempts, done);
+
+	bench_put("# messages "); bench_putnum(num);
+	bench_put(" attempts "); bench_putnum(total);
+	bench_put(" delivered "); bench_putnum(delivered);
+	bench_put("\n# seconds after the host came back: average ");
+	bench_putnum(delivered ? delay / delivered : 0);
+	bench_put(" maximum "); bench_putnum(maxdelay); bench_put("\n");
+	if (substdio_flush(subfdout) == -1)
+		strerr_die2sys(111, FATAL, "unable to write output: ");
+	return 0;
+}
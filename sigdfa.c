@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2000-2004 Claudio Jeker,
+ *      Internet Business Solutions AG, CH-8005 Zrich, Switzerland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Internet Business
+ *      Solutions AG and its contributors.
+ * 4. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#include <unistd.h>
+
+#include "alloc.h"
+#include "byte.h"
+#include "open.h"
+#include "readwrite.h"
+#include "sigdfa.h"
+
+/*
+ * control/signatures holds anchored prefixes of a line where '*'
+ * matches any single character. The automaton is built with the
+ * usual subset construction: a state is the sorted set of positions
+ * (offsets into the NUL separated signature text) that are still
+ * alive. As soon as one position reaches the terminating NUL the
+ * signature matched completely and the automaton moves to
+ * SIGDFA_MATCH.
+ *
+ * The compiled form is written by qmail-sigdfa to control/signatures.dfa:
+ * a 16 byte header ("QSDF", nclass, nstate and start as 32bit little
+ * endian numbers), the 256 byte class map and then the transition
+ * table with nclass 32bit entries per state.
+ */
+
+struct set {
+	unsigned int	off;
+	unsigned int	len;
+};
+
+struct build {
+	const char	*sig;
+	unsigned int	*items;		/* all state sets back to back */
+	unsigned int	 itemlen, itemsize;
+	struct set	*sets;
+	unsigned int	 setsize;
+	unsigned int	*hash;		/* open addressing, 0 is empty */
+	unsigned int	 hashsize;
+	unsigned int	*next;		/* scratch set */
+	unsigned int	 transsize;
+};
+
+static int
+grow(void *pp, unsigned int *size, unsigned int want, unsigned int elem)
+{
+	char **p = pp;
+	unsigned int n;
+
+	if (want <= *size)
+		return 0;
+	n = *size ? *size : 64;
+	while (n < want)
+		n *= 2;
+	if (*p == 0) {
+		*p = alloc(n * elem);
+		if (*p == 0)
+			return -1;
+	} else if (!alloc_re(p, *size * elem, n * elem))
+		return -1;
+	*size = n;
+	return 0;
+}
+
+static unsigned int
+sethash(const unsigned int *set, unsigned int len)
+{
+	unsigned int h, i;
+
+	h = 5381;
+	for (i = 0; i < len; i++)
+		h = ((h << 5) + h) ^ set[i];
+	return h;
+}
+
+static int
+rehash(struct build *b, unsigned int nstate)
+{
+	unsigned int i, j, n;
+
+	n = b->hashsize ? b->hashsize * 2 : 1024;
+	if (b->hash)
+		alloc_free(b->hash);
+	b->hash = alloc(n * sizeof(unsigned int));
+	if (b->hash == 0)
+		return -1;
+	byte_zero(b->hash, n * sizeof(unsigned int));
+	b->hashsize = n;
+	for (i = 2; i < nstate; i++) {
+		j = sethash(b->items + b->sets[i].off, b->sets[i].len) & (n - 1);
+		while (b->hash[j])
+			j = (j + 1) & (n - 1);
+		b->hash[j] = i;
+	}
+	return 0;
+}
+
+/*
+ * Returns the state for the set in b->next, adding it if needed.
+ * -1 means out of memory, -2 too many states.
+ */
+static int
+addstate(struct build *b, struct sigdfa *d, unsigned int len)
+{
+	unsigned int i, j;
+
+	j = sethash(b->next, len) & (b->hashsize - 1);
+	while ((i = b->hash[j]) != 0) {
+		if (b->sets[i].len == len && byte_equal(b->items +
+		    b->sets[i].off, len * sizeof(unsigned int), b->next))
+			return i;
+		j = (j + 1) & (b->hashsize - 1);
+	}
+	if (d->nstate >= SIGDFA_MAXSTATES)
+		return -2;
+	i = d->nstate;
+	if (grow(&b->sets, &b->setsize, i + 1, sizeof(struct set)) == -1)
+		return -1;
+	if (grow(&b->items, &b->itemsize, b->itemlen + len,
+	    sizeof(unsigned int)) == -1)
+		return -1;
+	if (grow(&d->trans, &b->transsize, (i + 1) * d->nclass,
+	    sizeof(unsigned int)) == -1)
+		return -1;
+	byte_copy(b->items + b->itemlen, len * sizeof(unsigned int), b->next);
+	b->sets[i].off = b->itemlen;
+	b->sets[i].len = len;
+	b->itemlen += len;
+	b->hash[j] = i;
+	d->nstate++;
+	if (d->nstate * 2 > b->hashsize)
+		if (rehash(b, d->nstate) == -1)
+			return -1;
+	return i;
+}
+
+/*
+ * Compile the NUL separated signatures in sig into d.
+ * Returns 0 on success, -1 if out of memory and -2 if the automaton
+ * would get too big (the caller should fall back to plain matching).
+ */
+int
+sigdfa_compile(struct sigdfa *d, const char *sig, unsigned int siglen)
+{
+	struct build b;
+	unsigned char rep[256];
+	unsigned int i, j, k, n, p, nsig, s;
+	int r;
+
+	byte_zero(&b, sizeof(b));
+	byte_zero(d, sizeof(*d));
+	b.sig = sig;
+
+	/* class 0 is "any other character", '*' matches it too */
+	d->nclass = 1;
+	rep[0] = 0;
+	for (i = 0; i < siglen; i++) {
+		k = (unsigned char)sig[i];
+		if (k == 0 || k == '*' || d->cmap[k] != 0)
+			continue;
+		d->cmap[k] = d->nclass;
+		rep[d->nclass++] = k;
+	}
+
+	nsig = 0;
+	for (i = 0; i < siglen; i++)
+		if (sig[i] == 0)
+			nsig++;
+	b.next = alloc((nsig + 1) * sizeof(unsigned int));
+	if (b.next == 0)
+		goto nomem;
+	if (rehash(&b, 0) == -1)
+		goto nomem;
+
+	/* dead and match state are absorbing */
+	d->nstate = 2;
+	if (grow(&b.sets, &b.setsize, 2, sizeof(struct set)) == -1 ||
+	    grow(&d->trans, &b.transsize, 2 * d->nclass,
+	    sizeof(unsigned int)) == -1)
+		goto nomem;
+	for (k = 0; k < d->nclass; k++) {
+		d->trans[SIGDFA_DEAD * d->nclass + k] = SIGDFA_DEAD;
+		d->trans[SIGDFA_MATCH * d->nclass + k] = SIGDFA_MATCH;
+	}
+
+	/* start state: the first position of every signature */
+	n = 0;
+	d->start = SIGDFA_DEAD;
+	for (i = j = 0; i < siglen; i++)
+		if (sig[i] == 0) {
+			if (i == j)
+				d->start = SIGDFA_MATCH; /* empty signature */
+			else
+				b.next[n++] = j;
+			j = i + 1;
+		}
+	if (d->start != SIGDFA_MATCH && n > 0) {
+		if ((r = addstate(&b, d, n)) < 0)
+			goto fail;
+		d->start = r;
+	}
+
+	/* states are numbered in creation order so this is a BFS */
+	for (s = 2; s < d->nstate; s++) {
+		for (k = 0; k < d->nclass; k++) {
+			n = 0;
+			r = SIGDFA_DEAD;
+			for (i = 0; i < b.sets[s].len; i++) {
+				p = b.items[b.sets[s].off + i];
+				if (sig[p] != '*' &&
+				    (k == 0 || (unsigned char)sig[p] != rep[k]))
+					continue;
+				if (sig[p + 1] == 0) {
+					r = SIGDFA_MATCH;
+					break;
+				}
+				b.next[n++] = p + 1;
+			}
+			if (r != SIGDFA_MATCH && n > 0)
+				if ((r = addstate(&b, d, n)) < 0)
+					goto fail;
+			d->trans[s * d->nclass + k] = r;
+		}
+	}
+
+	alloc_free(b.next);
+	alloc_free(b.hash);
+	alloc_free(b.sets);
+	if (b.items)
+		alloc_free(b.items);
+	return 0;
+
+nomem:
+	r = -1;
+fail:
+	if (b.next)
+		alloc_free(b.next);
+	if (b.hash)
+		alloc_free(b.hash);
+	if (b.sets)
+		alloc_free(b.sets);
+	if (b.items)
+		alloc_free(b.items);
+	sigdfa_free(d);
+	return r;
+}
+
+/* returns 1 if one of the signatures is a prefix of buf */
+int
+sigdfa_match(const struct sigdfa *d, const char *buf, unsigned int len)
+{
+	const unsigned int *t = d->trans;
+	unsigned int i, n, q;
+
+	q = d->start;
+	n = d->nclass;
+	for (i = 0; i < len && q > SIGDFA_MATCH; i++)
+		q = t[q * n + d->cmap[(unsigned char)buf[i]]];
+	return q == SIGDFA_MATCH;
+}
+
+static unsigned int
+unpack(const unsigned char *s)
+{
+	return s[0] | (s[1] << 8) | (s[2] << 16) | ((unsigned int)s[3] << 24);
+}
+
+static void
+pack(unsigned char *s, unsigned int u)
+{
+	s[0] = u & 0xff;
+	s[1] = (u >> 8) & 0xff;
+	s[2] = (u >> 16) & 0xff;
+	s[3] = (u >> 24) & 0xff;
+}
+
+static int
+readall(int fd, void *buf, unsigned int len)
+{
+	char *s = buf;
+	int r;
+
+	while (len > 0) {
+		r = read(fd, s, len);
+		if (r == -1)
+			return -1;
+		if (r == 0)
+			return -2;
+		s += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int
+writeall(int fd, const void *buf, unsigned int len)
+{
+	const char *s = buf;
+	int w;
+
+	while (len > 0) {
+		w = write(fd, s, len);
+		if (w == -1)
+			return -1;
+		s += w;
+		len -= w;
+	}
+	return 0;
+}
+
+/*
+ * Load a compiled automaton. Returns 0 on success, -1 on I/O errors
+ * (with errno set) and -2 if the file is not a valid automaton.
+ */
+int
+sigdfa_load(struct sigdfa *d, const char *fn)
+{
+	unsigned char hdr[16];
+	unsigned char *t;
+	unsigned int i, n;
+	int fd, r;
+
+	byte_zero(d, sizeof(*d));
+	fd = open_read(fn);
+	if (fd == -1)
+		return -1;
+	if ((r = readall(fd, hdr, sizeof(hdr))) != 0)
+		goto fail;
+	r = -2;
+	if (!byte_equal(hdr, 4, "QSDF"))
+		goto fail;
+	d->nclass = unpack(hdr + 4);
+	d->nstate = unpack(hdr + 8);
+	d->start = unpack(hdr + 12);
+	if (d->nclass == 0 || d->nclass > 256 || d->nstate < 2 ||
+	    d->nstate > SIGDFA_MAXSTATES || d->start >= d->nstate)
+		goto fail;
+	if ((r = readall(fd, d->cmap, sizeof(d->cmap))) != 0)
+		goto fail;
+	r = -2;
+	for (i = 0; i < 256; i++)
+		if (d->cmap[i] >= d->nclass)
+			goto fail;
+
+	n = d->nstate * d->nclass;
+	r = -1;
+	d->trans = alloc(n * sizeof(unsigned int));
+	if (d->trans == 0)
+		goto fail;
+	/* every entry is unpacked in place over its own four bytes */
+	t = (unsigned char *)d->trans;
+	if ((r = readall(fd, t, n * 4)) != 0)
+		goto fail;
+	r = -2;
+	for (i = n; i-- > 0; ) {
+		d->trans[i] = unpack(t + i * 4);
+		if (d->trans[i] >= d->nstate)
+			goto fail;
+	}
+	close(fd);
+	return 0;
+
+fail:
+	close(fd);
+	sigdfa_free(d);
+	return r;
+}
+
+int
+sigdfa_save(const struct sigdfa *d, int fd)
+{
+	unsigned char buf[1024];
+	unsigned int i, n;
+
+	byte_copy(buf, 4, "QSDF");
+	pack(buf + 4, d->nclass);
+	pack(buf + 8, d->nstate);
+	pack(buf + 12, d->start);
+	if (writeall(fd, buf, 16) == -1)
+		return -1;
+	if (writeall(fd, d->cmap, sizeof(d->cmap)) == -1)
+		return -1;
+	n = 0;
+	for (i = 0; i < d->nstate * d->nclass; i++) {
+		pack(buf + n, d->trans[i]);
+		n += 4;
+		if (n == sizeof(buf)) {
+			if (writeall(fd, buf, n) == -1)
+				return -1;
+			n = 0;
+		}
+	}
+	if (n > 0 && writeall(fd, buf, n) == -1)
+		return -1;
+	return 0;
+}
+
+void
+sigdfa_free(struct sigdfa *d)
+{
+	if (d->trans)
+		alloc_free(d->trans);
+	d->trans = 0;
+	d->nstate = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef SIGDFA_H
+#define SIGDFA_H
+
+/*
+ * Deterministic automaton for the REJECTEXEC signatures. State 0 is
+ * the dead state, state 1 means a signature matched, everything else
+ * is still undecided. Input bytes are first mapped to a character
+ * class so the transition table only needs one column per distinct
+ * signature character (plus one for everything else).
+ */
+#define SIGDFA_DEAD	0
+#define SIGDFA_MATCH	1
+#define SIGDFA_MAXSTATES	65536
+
+struct sigdfa {
+	unsigned char	 cmap[256];
+	unsigned int	 nclass;
+	unsigned int	 nstate;
+	unsigned int	 start;
+	unsigned int	*trans;
+};
+
+extern int sigdfa_compile(struct sigdfa *, const char *, unsigned int);
+extern int sigdfa_match(const struct sigdfa *, const char *, unsigned int);
+extern int sigdfa_load(struct sigdfa *, const char *);
+extern int sigdfa_save(const struct sigdfa *, int);
+extern void sigdfa_free(struct sigdfa *);
+
+#endif
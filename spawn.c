@@ -1,6 +1,10 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include "hasepoll.h"
+#ifdef HASEPOLL
+#include <sys/epoll.h>
+#endif
 #include "readwrite.h"
 #include "alloc.h"
 #include "sig.h"
@@ -69,7 +73,7 @@ int okwrite(fd,buf,n) int fd; char *buf; int n;
 }
 
 int flagreading = 1;
-char outbuf[1024]; substdio ssout;
+char outbuf[4096]; substdio ssout; /* flushed once per round */
 
 int stage = 0; /* reading 0:delnum 1:delnum2 2:messid 3:sender 4:recip */
 int flagabort = 0; /* if 1, everything except delnum is garbage */
@@ -83,9 +87,28 @@ void err(s) char *s;
  unsigned char ch;
  ch = delnum; substdio_put(&ssout,&ch,1);
  ch = delnum >> 8; substdio_put(&ssout,&ch,1);
- substdio_puts(&ssout,s); substdio_putflush(&ssout,"",1);
+ substdio_puts(&ssout,s); substdio_put(&ssout,"",1);
+}
+
+#ifdef HASEPOLL
+int epfd = -1;
+
+void epoll_add(fd,i) int fd; unsigned int i;
+{
+ struct epoll_event ev;
+ ev.events = EPOLLIN;
+ ev.data.u32 = i;
+ if (epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev) == -1)
+  { close(epfd); epfd = -1; } /* back to select() */
 }
 
+void epoll_del(fd) int fd;
+{
+ struct epoll_event ev;
+ if (epfd != -1) epoll_ctl(epfd,EPOLL_CTL_DEL,fd,&ev);
+}
+#endif
+
 void docmd()
 {
  int f;
@@ -150,9 +173,12 @@ void docmd()
  d[delnum].fdout = pi[1]; coe(pi[1]);
  d[delnum].pid = f;
  d[delnum].used = 1;
+#ifdef HASEPOLL
+ if (epfd != -1) epoll_add(pi[0],delnum);
+#endif
 }
 
-char cmdbuf[1024];
+char cmdbuf[4096];
 
 void getcmd()
 {
@@ -162,11 +188,11 @@ void getcmd()
 
  r = read(0,cmdbuf,sizeof(cmdbuf));
  if (r == 0)
-  { flagreading = 0; return; }
+  { flagreading = 0; goto stop; }
  if (r == -1)
   {
    if (errno != error_intr)
-     flagreading = 0;
+    { flagreading = 0; goto stop; }
    return;
   }
  
@@ -196,9 +222,110 @@ void getcmd()
        flagabort = 0; stage = 0; break;
     }
   }
+ return;
+
+ stop:
+#ifdef HASEPOLL
+ epoll_del(0);
+#endif
+ return;
 }
 
-char inbuf[128];
+char inbuf[1024];
+
+void doread(i)
+unsigned int i;
+{
+ int r;
+#ifdef DEBUG
+ unsigned char ch;
+#endif
+
+ r = read(d[i].fdin,inbuf,sizeof(inbuf));
+ if (r == -1)
+   return; /* read error on a readable pipe? be serious */
+ if (r == 0)
+  {
+   unsigned char c; c = i; substdio_put(&ssout,&c,1);
+   c = i >> 8; substdio_put(&ssout,&c,1);
+   report(&ssout,d[i].wstat,d[i].output.s,d[i].output.len);
+   substdio_put(&ssout,"",1);
+#ifdef HASEPOLL
+   epoll_del(d[i].fdin);
+#endif
+   close(d[i].fdin); d[i].used = 0;
+   return;
+  }
+#ifdef DEBUG
+#	 define IS_LOG(x) ( d[(x)].used & 0x8 )
+#	 define LOGON(x)  ( d[(x)].used |= 0x8 )
+#	 define LOGOFF(x) ( d[(x)].used = 1 )
+ {
+  unsigned int j;
+  unsigned int b;
+  unsigned int t;
+  for (j=0, b=0; j < (unsigned int)r; j++) {
+    if (inbuf[j] == 15) {
+      while (!stralloc_readyplus(&d[i].output,j-b)) sleep(10); /*XXX*/
+      byte_copy(d[i].output.s + d[i].output.len,j-b,inbuf+b);
+      d[i].output.len += j-b;
+      LOGON(i);
+      b = j+1;
+    } else if ( inbuf[j] == 16 ) {
+      while (!stralloc_readyplus(&d[i].log,j-b)) sleep(10); /*XXX*/
+      byte_copy(d[i].log.s + d[i].log.len,j-b,inbuf+b);
+      d[i].log.len += j-b;
+      b = j+1;
+      LOGOFF(i);
+      if (truncreport > 100)
+	if (d[i].log.len > truncreport) {
+	  const char *truncmess = "\nError report too long, sorry.\n";
+	  d[i].log.len = truncreport - str_len(truncmess) - 3;
+	  stralloc_cats(&d[i].log,truncmess);
+	}
+      ch = i; substdio_put(&ssout,&ch,1);
+      ch = i >> 8; substdio_put(&ssout,&ch,1);
+      ch = 'L'; substdio_put(&ssout,&ch,1);
+      for (t = 0;t < d[i].log.len; ++t) if (!d[i].log.s[t]) break;
+      substdio_put(&ssout,d[i].log.s,t);
+      substdio_put(&ssout,"",1);
+      d[i].log.len = 0;
+    }
+  }
+  if (b == (unsigned int)r) return;
+  if ( IS_LOG(i) )
+   {
+    while (!stralloc_readyplus(&d[i].log,r-b)) sleep(10); /*XXX*/
+    byte_copy(d[i].log.s + d[i].log.len,r-b,inbuf+b);
+    d[i].log.len += r-b;
+   }
+  else
+   {
+    while (!stralloc_readyplus(&d[i].output,r-b)) sleep(10); /*XXX*/
+    byte_copy(d[i].output.s + d[i].output.len,r-b,inbuf+b);
+    d[i].output.len += r-b;
+    if (truncreport > 100)
+      if (d[i].output.len > truncreport)
+       {
+	const char *truncmess = "\nError report too long, sorry.\n";
+	d[i].output.len = truncreport - str_len(truncmess) - 3;
+	stralloc_cats(&d[i].output,truncmess);
+       }
+   }
+ }
+#else
+ while (!stralloc_readyplus(&d[i].output,r)) sleep(10); /*XXX*/
+ byte_copy(d[i].output.s + d[i].output.len,r,inbuf);
+ d[i].output.len += r;
+ if (truncreport > 100)
+   if (d[i].output.len > truncreport)
+    {
+     const char *truncmess = "\nError report too long, sorry.\n";
+     d[i].output.len = truncreport - str_len(truncmess) - 3;
+     stralloc_cats(&d[i].output,truncmess);
+    }
+#endif
+}
 
 int main(argc,argv)
 int argc;
@@ -209,6 +336,10 @@ char **argv;
  int r;
  fd_set rfds;
  int nfds;
+#ifdef HASEPOLL
+ struct epoll_event ev[64];
+ int n;
+#endif
 
  if (chdir(auto_qmail) == -1) _exit(111);
  if (chdir("queue/mess") == -1) _exit(111);
@@ -237,6 +368,12 @@ char **argv;
 #endif
  }
 
+#ifdef HASEPOLL
+ /* with a few hundred children select() setup dominates, use epoll */
+ epfd = epoll_create(auto_spawn + 1);
+ if (epfd != -1) { coe(epfd); epoll_add(0,auto_spawn); }
+#endif
+
  for (;;)
   {
    if (flagreinit) {
@@ -250,6 +387,25 @@ char **argv;
     }
    sig_childunblock();
 
+#ifdef HASEPOLL
+   if (epfd != -1)
+    {
+     n = epoll_wait(epfd,ev,sizeof(ev) / sizeof(ev[0]),-1);
+     sig_childblock();
+     for (r = 0;r < n;++r)
+      {
+       i = ev[r].data.u32;
+       if (i == auto_spawn)
+        { if (flagreading) getcmd(); }
+       else if (i < auto_spawn && d[i].used)
+	 doread(i);
+      }
+     /* all results of this round go to qmail-send in one write */
+     substdio_flush(&ssout);
+     continue;
+    }
+#endif
+
    FD_ZERO(&rfds);
    if (flagreading) FD_SET(0,&rfds);
    nfds = 1;
@@ -266,91 +422,8 @@ char **argv;
 	 getcmd();
      for (i = 0;i < auto_spawn;++i) if (d[i].used)
        if (FD_ISSET(d[i].fdin,&rfds))
-	{
-	 r = read(d[i].fdin,inbuf,128);
-	 if (r == -1)
-	   continue; /* read error on a readable pipe? be serious */
-	 if (r == 0)
-	  {
-	   unsigned char c; c = i; substdio_put(&ssout,&c,1);
-	   c = i >> 8; substdio_put(&ssout,&c,1);
-	   report(&ssout,d[i].wstat,d[i].output.s,d[i].output.len);
-	   substdio_put(&ssout,"",1);
-	   substdio_flush(&ssout);
-	   close(d[i].fdin); d[i].used = 0;
-	   continue;
-	  }
-#ifdef DEBUG
-#	 define IS_LOG(x) ( d[(x)].used & 0x8 )
-#	 define LOGON(x)  ( d[(x)].used |= 0x8 )
-#	 define LOGOFF(x) ( d[(x)].used = 1 )
-	 {
-	  unsigned int j;
-	  unsigned int b;
-	  unsigned int t;
-	  for (j=0, b=0; j < (unsigned int)r; j++) {
-	    if (inbuf[j] == 15) {
-	      while (!stralloc_readyplus(&d[i].output,j-b)) sleep(10); /*XXX*/
-	      byte_copy(d[i].output.s + d[i].output.len,j-b,inbuf+b);
-	      d[i].output.len += j-b;
-	      LOGON(i);
-	      b = j+1;
-	    } else if ( inbuf[j] == 16 ) {
-	      while (!stralloc_readyplus(&d[i].log,j-b)) sleep(10); /*XXX*/
-	      byte_copy(d[i].log.s + d[i].log.len,j-b,inbuf+b);
-	      d[i].log.len += j-b;
-	      b = j+1;
-	      LOGOFF(i);
-	      if (truncreport > 100)
-		if (d[i].log.len > truncreport) {
-		  const char *truncmess = "\nError report too long, sorry.\n";
-		  d[i].log.len = truncreport - str_len(truncmess) - 3;
-		  stralloc_cats(&d[i].log,truncmess);
-		}
-	      ch = i; substdio_put(&ssout,&ch,1);
-	      ch = i >> 8; substdio_put(&ssout,&ch,1);
-	      ch = 'L'; substdio_put(&ssout,&ch,1);
-	      for (t = 0;t < d[i].log.len; ++t) if (!d[i].log.s[t]) break;
-	      substdio_put(&ssout,d[i].log.s,t);
-	      substdio_put(&ssout,"",1);
-	      substdio_flush(&ssout);
-	      d[i].log.len = 0;
-	    }
-	  }
-	  if (b == (unsigned int)r) continue;
-	  if ( IS_LOG(i) )
-	   {
-	    while (!stralloc_readyplus(&d[i].log,r-b)) sleep(10); /*XXX*/
-	    byte_copy(d[i].log.s + d[i].log.len,r-b,inbuf+b);
-	    d[i].log.len += r-b;
-	   }
-	  else
-	   {
-	    while (!stralloc_readyplus(&d[i].output,r-b)) sleep(10); /*XXX*/
-	    byte_copy(d[i].output.s + d[i].output.len,r-b,inbuf+b);
-	    d[i].output.len += r-b;
-	    if (truncreport > 100)
-	      if (d[i].output.len > truncreport)
-	       {
-		const char *truncmess = "\nError report too long, sorry.\n";
-		d[i].output.len = truncreport - str_len(truncmess) - 3;
-		stralloc_cats(&d[i].output,truncmess);
-	       }
-	   }
-	 }
-#else
-	 while (!stralloc_readyplus(&d[i].output,r)) sleep(10); /*XXX*/
-	 byte_copy(d[i].output.s + d[i].output.len,r,inbuf);
-	 d[i].output.len += r;
-	 if (truncreport > 100)
-	   if (d[i].output.len > truncreport)
-	    {
-	     const char *truncmess = "\nError report too long, sorry.\n";
-	     d[i].output.len = truncreport - str_len(truncmess) - 3;
-	     stralloc_cats(&d[i].output,truncmess);
-	    }
-#endif
-	}
+	 doread(i);
+     substdio_flush(&ssout);
     }
   }
  /* NOTREACHED */
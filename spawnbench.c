@@ -0,0 +1,228 @@
+/*
+ * spawnbench [-n deliveries] [-p program] messid recipient [concurrency ...]
+ * Talks to qmail-rspawn (or -p program) the way qmail-send does and
+ * sends the message ~queue/mess/messid to recipient as often as asked,
+ * at each given concurrency (by default 1, 4, 16 and 64). It prints the
+ * deliveries per second. messid must be a message in the queue owned by
+ * qmailq.
+ *
+ * Called as qmail-remote spawnbench is a stub delivery program: it reads
+ * the message, waits $SPAWNBENCH_DELAY milliseconds and reports success.
+ * With a symlink qmail-remote -> spawnbench in front of $PATH the run
+ * measures the spawn path alone instead of the network.
+ */
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "alloc.h"
+#include "bench.h"
+#include "byte.h"
+#include "coe.h"
+#include "env.h"
+#include "error.h"
+#include "readwrite.h"
+#include "scan.h"
+#include "select.h"
+#include "sgetopt.h"
+#include "sig.h"
+#include "str.h"
+#include "strerr.h"
+#include "subfd.h"
+#include "substdio.h"
+#include "wait.h"
+
+#define FATAL "spawnbench: fatal: "
+#define USAGE "spawnbench: usage: spawnbench [-n deliveries] " \
+    "[-p program] messid recipient [concurrency ...]"
+
+unsigned long deliveries = 1000;
+char *program;
+char *messid;
+char *recip;
+
+char inbuf[4096];
+char outbuf[4096];
+substdio ssout;
+
+static int
+stub(void)
+{
+	struct timeval tv;
+	unsigned long delay;
+	char *x;
+
+	while (read(0, inbuf, sizeof(inbuf)) > 0)
+		;
+	x = env_get("SPAWNBENCH_DELAY");
+	if (x && scan_ulong(x, &delay) && delay) {
+		tv.tv_sec = delay / 1000;
+		tv.tv_usec = (delay % 1000) * 1000;
+		select(0, (fd_set *)0, (fd_set *)0, (fd_set *)0, &tv);
+	}
+	/* recipient report and message report, both \0 terminated */
+	substdio_put(subfdoutsmall, "rstub accepted message.\n", 25);
+	substdio_putflush(subfdoutsmall, "Kstub done.\n", 13);
+	return 0;
+}
+
+static void
+command(unsigned int slot)
+{
+	unsigned char ch;
+
+	ch = slot; substdio_put(&ssout, (char *)&ch, 1);
+	ch = slot >> 8; substdio_put(&ssout, (char *)&ch, 1);
+	substdio_put(&ssout, messid, str_len(messid) + 1);
+	substdio_put(&ssout, "", 1);
+	substdio_put(&ssout, recip, str_len(recip) + 1);
+}
+
+static void
+run(unsigned long conc)
+{
+	struct timeval t0, t1;
+	unsigned long sent, done, ms, fails;
+	unsigned int spawnmax, slot, stage, j;
+	unsigned char *busy;
+	char *args[2];
+	unsigned char ch;
+	int pi[2], po[2];
+	int pid, wstat, r, i;
+
+	if (pipe(pi) == -1 || pipe(po) == -1)
+		strerr_die2sys(111, FATAL, "unable to create pipe: ");
+	coe(pi[1]); coe(po[0]);
+	args[0] = program;
+	args[1] = 0;
+	pid = bench_spawn(FATAL, args, pi[0], po[1]);
+	substdio_fdbuf(&ssout, subwrite, pi[1], outbuf, sizeof(outbuf));
+
+	/* the spawn program starts by telling its maximum concurrency */
+	for (i = 0; i < 2; i += r) {
+		r = read(po[0], inbuf + i, 2 - i);
+		if (r <= 0)
+			strerr_die3x(111, FATAL, program, " did not start");
+	}
+	spawnmax = (unsigned char)inbuf[0];
+	spawnmax += (unsigned int)(unsigned char)inbuf[1] << 8;
+	if (conc > spawnmax)
+		conc = spawnmax;
+	busy = (unsigned char *)alloc(conc);
+	if (!busy)
+		strerr_die2x(111, FATAL, "out of memory");
+	byte_zero(busy, conc);
+
+	gettimeofday(&t0, (struct timezone *)0);
+	sent = done = fails = 0;
+	slot = stage = 0;
+	ch = 0;
+	while (done < deliveries) {
+		for (j = 0; sent < deliveries && j < conc; j++)
+			if (!busy[j]) {
+				command(j);
+				busy[j] = 1;
+				sent++;
+			}
+		if (substdio_flush(&ssout) == -1)
+			strerr_die2sys(111, FATAL, "unable to write: ");
+		r = read(po[0], inbuf, sizeof(inbuf));
+		if (r == -1) {
+			if (errno == error_intr) continue;
+			strerr_die2sys(111, FATAL, "unable to read: ");
+		}
+		if (r == 0)
+			strerr_die3x(111, FATAL, program, " died");
+		/* results are delnum low, delnum high, text, \0 */
+		for (i = 0; i < r; i++)
+			switch (stage++) {
+			case 0:
+				slot = (unsigned char)inbuf[i];
+				break;
+			case 1:
+				slot += (unsigned int)(unsigned char)inbuf[i] << 8;
+				break;
+			case 2:
+				ch = inbuf[i];
+				/* FALLTHROUGH */
+			default:
+				if (inbuf[i])
+					break;
+				stage = 0;
+				if (ch == 'L')	/* DEBUG log line */
+					break;
+				if (slot >= conc || !busy[slot])
+					strerr_die2x(111, FATAL,
+					    "result for an idle slot");
+				if (ch != 'K')
+					fails++;
+				busy[slot] = 0;
+				done++;
+			}
+	}
+	gettimeofday(&t1, (struct timezone *)0);
+	close(pi[1]);
+	while (read(po[0], inbuf, sizeof(inbuf)) > 0)
+		;
+	close(po[0]);
+	if (wait_pid(&wstat, pid) == -1)
+		strerr_die2sys(111, FATAL, "unable to wait: ");
+	alloc_free(busy);
+
+	ms = bench_usecs(&t0, &t1) / 1000;
+	if (!ms) ms = 1;
+	bench_put("concurrency "); bench_putnum(conc);
+	bench_put(": "); bench_putnum(deliveries);
+	bench_put(" deliveries in "); bench_putnum(ms);
+	bench_put(" ms, "); bench_putnum(deliveries * 1000 / ms);
+	bench_put(" deliveries/s");
+	if (fails) {
+		bench_put(", "); bench_putnum(fails);
+		bench_put(" not delivered");
+	}
+	bench_put("\n");
+	bench_flush();
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long conc;
+	int opt;
+
+	if (bench_calledas(argv[0], "qmail-remote"))
+		return stub();
+
+	while ((opt = getopt(argc, argv, "n:p:")) != opteof)
+		switch (opt) {
+		case 'n':
+			scan_ulong(optarg, &deliveries);
+			break;
+		case 'p':
+			program = optarg;
+			break;
+		default:
+			bench_usage(USAGE);
+		}
+	argc -= optind;
+	argv += optind;
+	if (!argv[0] || !argv[1] || !deliveries)
+		bench_usage(USAGE);
+	messid = *argv++;
+	recip = *argv++;
+	if (!program)
+		program = (char *)bench_bin(FATAL, "qmail-rspawn");
+	sig_pipeignore();
+
+	if (!*argv) {
+		for (conc = 1; conc <= 64; conc *= 4)
+			run(conc);
+		return 0;
+	}
+	for (; *argv; argv++) {
+		scan_ulong(*argv, &conc);
+		if (!conc)
+			bench_usage(USAGE);
+		run(conc);
+	}
+	return 0;
+}
@@ -30,8 +30,13 @@ extern void substdio_seek(substdio *, unsigned int);
 
 #define substdio_fileno(s) ((s)->fd)
 
+/* can be raised at compile time, e.g. -DSUBSTDIO_INSIZE=65536 in conf-cc */
+#ifndef SUBSTDIO_INSIZE
 #define SUBSTDIO_INSIZE 8192
+#endif
+#ifndef SUBSTDIO_OUTSIZE
 #define SUBSTDIO_OUTSIZE 8192
+#endif
 
 #define substdio_PEEK(s) ( (s)->x + (s)->n )
 #define substdio_SEEK(s,len) ( ( (s)->p -= (len) ) , ( (s)->n += (len) ) )
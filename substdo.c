@@ -1,4 +1,7 @@
+#include <sys/types.h>
+#include <sys/uio.h>
 #include "substdio.h"
+#include "readwrite.h"
 #include "str.h"
 #include "byte.h"
 #include "error.h"
@@ -24,6 +27,39 @@ register unsigned int len;
   return 0;
 }
 
+/* buffer and buf in one writev(), only for plain file descriptors */
+static int allwritev(s,buf,len)
+register substdio *s;
+register const char *buf;
+register unsigned int len;
+{
+  struct iovec iov[2];
+  char *x;
+  unsigned int p;
+  int w;
+
+  x = s->x;
+  p = s->p;
+  s->p = 0;
+  while (p) {
+    iov[0].iov_base = x;
+    iov[0].iov_len = p;
+    iov[1].iov_base = (char *) buf;
+    iov[1].iov_len = len;
+    w = writev(s->fd,iov,2);
+    if (w == -1) {
+      if (errno == error_intr) continue;
+      return -1; /* note that some data may have been written */
+    }
+    if ((unsigned int) w < p) { x += w; p -= w; continue; }
+    w -= p;
+    buf += w;
+    len -= w;
+    p = 0;
+  }
+  return allwrite(s->op,s->fd,buf,len);
+}
+
 int substdio_flush(s)
 register substdio *s;
 {
@@ -61,6 +97,7 @@ register unsigned int len;
  
   n = s->n;
   if (len > n - s->p) {
+    if (s->op == subwrite) return allwritev(s,buf,len);
     if (substdio_flush(s) == -1) return -1;
     /* now s->p == 0 */
     if (n < SUBSTDIO_OUTSIZE) n = SUBSTDIO_OUTSIZE;
@@ -82,6 +119,7 @@ register substdio *s;
 register const char *buf;
 register unsigned int len;
 {
+  if (s->op == subwrite) return allwritev(s,buf,len);
   if (substdio_flush(s) == -1) return -1;
   return allwrite(s->op,s->fd,buf,len);
 }
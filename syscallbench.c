@@ -0,0 +1,351 @@
+/*
+ * syscallbench [-n messages] [-s bytes] dir
+ * Counts the read and write system calls per message on the way through
+ * qmail-smtpd, qmail-queue and qmail-local. Each stage runs the programs
+ * of ~/bin on its own:
+ *   qmail-smtpd: one SMTP session over pipes, qmail-smtpd runs qmail-queue
+ *   qmail-queue: the message file and an envelope fed to qmail-queue
+ *   qmail-local: delivery of the message file to dir/Maildir/
+ * The numbers come from syscr and syscw in /proc/self/io, which include
+ * all reaped children, so this is Linux only. The calls of syscallbench
+ * itself are subtracted. Data moved by copy_file_range(2) or sendfile(2)
+ * does not show up as reads or writes. dir must be an absolute path, it
+ * keeps the message file and the deliveries. The messages are really
+ * queued: use a test installation.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "bench.h"
+#include "coe.h"
+#include "env.h"
+#include "error.h"
+#include "getln.h"
+#include "open.h"
+#include "readwrite.h"
+#include "scan.h"
+#include "sgetopt.h"
+#include "sig.h"
+#include "str.h"
+#include "stralloc.h"
+#include "strerr.h"
+#include "substdio.h"
+#include "wait.h"
+
+#define FATAL "syscallbench: fatal: "
+#define USAGE "syscallbench: usage: syscallbench [-n messages] " \
+    "[-s bytes] dir"
+
+unsigned long messages = 100;
+unsigned long size = 100000;
+char *dir;
+const char *msgfn = "syscallbench.msg";
+
+struct count {
+	unsigned long r;
+	unsigned long w;
+};
+struct count own;	/* calls made by syscallbench itself */
+struct count probe;	/* calls made by reading /proc/self/io */
+
+char inbuf[1024];
+char outbuf[8192];
+substdio ssin;
+substdio ssout;
+stralloc line = {0};
+
+/* 64 lines of 76 base64 characters, with CRLF and with LF */
+char crlfbody[64 * 78];
+char lfbody[64 * 77];
+
+static void
+die_nomem(void)
+{
+	strerr_die2x(111, FATAL, "out of memory");
+}
+
+static int
+cread(int fd, void *buf, int len)
+{
+	own.r++;
+	return read(fd, buf, len);
+}
+
+static int
+cwrite(int fd, void *buf, int len)
+{
+	own.w++;
+	return write(fd, buf, len);
+}
+
+static void
+ioget(struct count *c)
+{
+	char buf[512];
+	unsigned int i;
+	int fd, r;
+
+	c->r = c->w = 0;
+	fd = open_read("/proc/self/io");
+	if (fd == -1)
+		strerr_die2sys(111, FATAL, "unable to open /proc/self/io: ");
+	r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r <= 0)
+		strerr_die2sys(111, FATAL, "unable to read /proc/self/io: ");
+	buf[r] = 0;
+	for (i = 0; buf[i]; i += str_chr(buf + i, '\n') + 1) {
+		if (!str_diffn(buf + i, "syscr: ", 7))
+			scan_ulong(buf + i + 7, &c->r);
+		if (!str_diffn(buf + i, "syscw: ", 7))
+			scan_ulong(buf + i + 7, &c->w);
+		if (!buf[i + str_chr(buf + i, '\n')])
+			break;
+	}
+}
+
+static void
+report(const char *stage, struct count *start)
+{
+	struct count end;
+
+	ioget(&end);
+	end.r -= start->r + probe.r + own.r;
+	end.w -= start->w + probe.w + own.w;
+	bench_put(stage);
+	bench_putnum(end.r / messages); bench_put(" reads, ");
+	bench_putnum(end.w / messages); bench_put(" writes per message\n");
+	bench_flush();
+}
+
+static void
+finish(int pid, const char *prog)
+{
+	int wstat;
+
+	if (wait_pid(&wstat, pid) == -1)
+		strerr_die2sys(111, FATAL, "unable to wait: ");
+	if (wait_crashed(wstat))
+		strerr_die3x(111, FATAL, prog, " crashed");
+	if (wait_exitcode(wstat))
+		strerr_die3x(111, FATAL, prog, " failed");
+}
+
+static void
+say(const char *s, unsigned int len)
+{
+	if (substdio_put(&ssout, s, len) == -1)
+		strerr_die2sys(111, FATAL, "unable to write: ");
+}
+
+static void
+expect(const char *code)
+{
+	int match;
+
+	if (substdio_flush(&ssout) == -1)
+		strerr_die2sys(111, FATAL, "unable to write: ");
+	do {
+		if (getln(&ssin, &line, &match, '\n') == -1)
+			strerr_die2sys(111, FATAL, "unable to read: ");
+		if (!match)
+			strerr_die2x(111, FATAL, "qmail-smtpd closed the session");
+		if (line.len < 4 || str_diffn(line.s, code, 3)) {
+			if (!stralloc_0(&line)) die_nomem();
+			strerr_die3x(111, FATAL, "unexpected reply: ", line.s);
+		}
+	} while (line.s[3] == '-');
+}
+
+static void
+smtpd(void)
+{
+	struct count begin;
+	char *args[2];
+	unsigned long i, n;
+	int pi[2], po[2];
+	int pid;
+
+	if (pipe(pi) == -1 || pipe(po) == -1)
+		strerr_die2sys(111, FATAL, "unable to create pipe: ");
+	coe(pi[1]); coe(po[0]);
+	if (!env_get("TCPREMOTEIP"))
+		if (!env_put2("TCPREMOTEIP", "127.0.0.1")) die_nomem();
+	if (!env_get("RELAYCLIENT"))
+		if (!env_put2("RELAYCLIENT", "")) die_nomem();
+	args[0] = (char *)bench_bin(FATAL, "qmail-smtpd");
+	args[1] = 0;
+	substdio_fdbuf(&ssin, cread, po[0], inbuf, sizeof(inbuf));
+	substdio_fdbuf(&ssout, cwrite, pi[1], outbuf, sizeof(outbuf));
+
+	ioget(&begin);
+	own.r = own.w = 0;
+	pid = bench_spawn(FATAL, args, pi[0], po[1]);
+	expect("220");
+	say("HELO syscallbench\r\n", 19);
+	expect("250");
+	for (i = 0; i < messages; i++) {
+		say("MAIL FROM:<syscallbench@localhost>\r\n", 36);
+		expect("250");
+		say("RCPT TO:<syscallbench@localhost>\r\n", 34);
+		expect("250");
+		say("DATA\r\n", 6);
+		expect("354");
+		say("Subject: syscallbench\r\n\r\n", 25);
+		for (n = size / 77; n > 64; n -= 64)
+			say(crlfbody, sizeof(crlfbody));
+		say(crlfbody, n * 78);
+		say(".\r\n", 3);
+		expect("250");
+	}
+	say("QUIT\r\n", 6);
+	expect("221");
+	close(pi[1]);
+	close(po[0]);
+	finish(pid, "qmail-smtpd");
+	report("qmail-smtpd+qmail-queue: ", &begin);
+}
+
+static void
+queue(void)
+{
+	struct count begin;
+	char *args[2];
+	const char env[] = "Fsyscallbench@localhost\0"
+	    "Tsyscallbench@localhost\0";	/* and the final \0 */
+	unsigned long i;
+	int pi[2];
+	int fd, pid;
+
+	args[0] = (char *)bench_bin(FATAL, "qmail-queue");
+	args[1] = 0;
+
+	ioget(&begin);
+	own.r = own.w = 0;
+	for (i = 0; i < messages; i++) {
+		if ((fd = open_read(msgfn)) == -1)
+			strerr_die4sys(111, FATAL, "unable to open ", msgfn,
+			    ": ");
+		if (pipe(pi) == -1)
+			strerr_die2sys(111, FATAL, "unable to create pipe: ");
+		coe(pi[1]);
+		pid = bench_spawn(FATAL, args, fd, pi[0]);
+		own.w++;
+		if (write(pi[1], env, sizeof(env)) != sizeof(env))
+			strerr_die2sys(111, FATAL, "unable to write: ");
+		close(pi[1]);
+		finish(pid, "qmail-queue");
+	}
+	report("qmail-queue: ", &begin);
+}
+
+static void
+local(void)
+{
+	struct count begin;
+	char *args[11];
+	unsigned long i;
+	int fd, fdnull, pid;
+
+	args[0] = (char *)bench_bin(FATAL, "qmail-local");
+	args[1] = (char *)"--";
+	args[2] = (char *)"syscallbench";
+	args[3] = dir;
+	args[4] = (char *)"syscallbench";
+	args[5] = (char *)"";
+	args[6] = (char *)"";
+	args[7] = (char *)"localhost";
+	args[8] = (char *)"syscallbench@localhost";
+	args[9] = (char *)"./Maildir/";
+	args[10] = 0;
+
+	ioget(&begin);
+	own.r = own.w = 0;
+	for (i = 0; i < messages; i++) {
+		if ((fd = open_read(msgfn)) == -1)
+			strerr_die4sys(111, FATAL, "unable to open ", msgfn,
+			    ": ");
+		/* qmail-local reports to qmail-lspawn on stdout */
+		if ((fdnull = open_write("/dev/null")) == -1)
+			strerr_die2sys(111, FATAL, "unable to open /dev/null: ");
+		pid = bench_spawn(FATAL, args, fd, fdnull);
+		finish(pid, "qmail-local");
+	}
+	report("qmail-local: ", &begin);
+}
+int
+main(int argc, char **argv)
+{
+	const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	    "abcdefghijklmnopqrstuvwxyz0123456789+/";
+	struct count first;
+	substdio ss;
+	unsigned long i, n;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != opteof)
+		switch (opt) {
+		case 'n':
+			scan_ulong(optarg, &messages);
+			break;
+		case 's':
+			scan_ulong(optarg, &size);
+			break;
+		default:
+			bench_usage(USAGE);
+		}
+	dir = argv[optind];
+	size -= size % 77;	/* whole lines only */
+	if (!dir || argv[optind + 1] || *dir != '/' || !messages || !size)
+		bench_usage(USAGE);
+
+	for (i = 0; i < 64 * 76; i++) {
+		crlfbody[i / 76 * 78 + i % 76] = b64[(i * 7 + i / 76) % 64];
+		lfbody[i / 76 * 77 + i % 76] = b64[(i * 7 + i / 76) % 64];
+	}
+	for (i = 0; i < 64; i++) {
+		crlfbody[i * 78 + 76] = '\r';
+		crlfbody[i * 78 + 77] = '\n';
+		lfbody[i * 77 + 76] = '\n';
+	}
+
+	if (chdir(dir) == -1)
+		strerr_die4sys(111, FATAL, "unable to chdir to ", dir, ": ");
+	if ((mkdir("Maildir", 0700) == -1 && errno != error_exist) ||
+	    (mkdir("Maildir/tmp", 0700) == -1 && errno != error_exist) ||
+	    (mkdir("Maildir/new", 0700) == -1 && errno != error_exist) ||
+	    (mkdir("Maildir/cur", 0700) == -1 && errno != error_exist))
+		strerr_die2sys(111, FATAL, "unable to create Maildir: ");
+	if ((fd = open_trunc(msgfn)) == -1)
+		strerr_die4sys(111, FATAL, "unable to create ", msgfn, ": ");
+	substdio_fdbuf(&ss, subwrite, fd, outbuf, sizeof(outbuf));
+	if (substdio_puts(&ss, "Subject: syscallbench\n\n") == -1)
+		goto writeerr;
+	for (n = size / 77; n > 64; n -= 64)
+		if (substdio_put(&ss, lfbody, sizeof(lfbody)) == -1)
+			goto writeerr;
+	if (substdio_put(&ss, lfbody, n * 77) == -1 ||
+	    substdio_flush(&ss) == -1 || fsync(fd) == -1)
+		goto writeerr;
+	close(fd);
+	sig_pipeignore();
+
+	ioget(&first);
+	ioget(&probe);
+	probe.r -= first.r;
+	probe.w -= first.w;
+
+	bench_put("syscalls for "); bench_putnum(messages);
+	bench_put(" messages of "); bench_putnum(size);
+	bench_put(" bytes\n");
+	bench_flush();
+	smtpd();
+	queue();
+	local();
+	return 0;
+
+writeerr:
+	strerr_die4sys(111, FATAL, "unable to write ", msgfn, ": ");
+	/* NOTREACHED */
+	return 111;
+}
@@ -0,0 +1,11 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <unistd.h>
+
+void main()
+{
+  loff_t off;
+
+  off = 0;
+  copy_file_range(0,&off,1,(loff_t *) 0,4096,0);
+}
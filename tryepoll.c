@@ -0,0 +1,13 @@
+#include <sys/epoll.h>
+
+void main()
+{
+  struct epoll_event ev;
+  int fd;
+
+  fd = epoll_create(1);
+  ev.events = EPOLLIN;
+  ev.data.u32 = 0;
+  epoll_ctl(fd,EPOLL_CTL_ADD,0,&ev);
+  epoll_wait(fd,&ev,1,0);
+}
@@ -0,0 +1,10 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+
+void main()
+{
+  struct stat st;
+
+  st.st_mtim.tv_nsec = 0;
+  stat(".",&st);
+}
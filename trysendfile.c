@@ -0,0 +1,10 @@
+#include <sys/types.h>
+#include <sys/sendfile.h>
+
+void main()
+{
+  off_t off;
+
+  off = 0;
+  sendfile(1,0,&off,4096);
+}
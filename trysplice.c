@@ -0,0 +1,9 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+void main()
+{
+  epoll_create(1);
+  splice(0,(loff_t *) 0,1,(loff_t *) 0,4096,SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
@@ -0,0 +1,7 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+
+void main()
+{
+  sync_file_range(0,0,0,SYNC_FILE_RANGE_WRITE);
+}
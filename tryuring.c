@@ -0,0 +1,13 @@
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+void main()
+{
+  struct io_uring_params p;
+  struct io_uring_sqe sqe;
+
+  sqe.opcode = IORING_OP_LINKAT;
+  sqe.hardlink_flags = 0;
+  syscall(__NR_io_uring_setup,1,&p);
+}
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2000-2004 Claudio Jeker,
+ *      Internet Business Solutions AG, CH-8005 Zrich, Switzerland
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *      This product includes software developed by Internet Business
+ *      Solutions AG and its contributors.
+ * 4. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHORS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#include "alloc.h"
+#include "gen_allocdefs.h"
+#include "prioq.h"
+#include "wheel.h"
+
+GEN_ALLOC_readyplus(wheel_slot,struct prioq_elt,p,len,a,i,n,x,16,wheel_slot_readyplus)
+GEN_ALLOC_append(wheel_slot,struct prioq_elt,p,len,a,i,n,x,16,wheel_slot_readyplus,wheel_slot_append)
+
+#define MASK (WHEEL_SIZE - 1)
+#define SUPER(b) ((b) >> WHEEL_BITS)
+#define HASH(w, id) ((unsigned int)((id) * 2654435761UL) & ((w)->idsize - 1))
+
+static struct wheel_id *
+idfind(wheel *w, unsigned long id)
+{
+	unsigned int h;
+
+	if (!w->ids)
+		return 0;
+	for (h = HASH(w, id); w->ids[h].n; h = (h + 1) & (w->idsize - 1))
+		if (w->ids[h].id == id)
+			return &w->ids[h];
+	return 0;
+}
+
+/* make room for one more id, the table is kept at most half full */
+static int
+idready(wheel *w)
+{
+	struct wheel_id *x;
+	unsigned int size, i, h;
+
+	if (w->ids && 2 * (w->idlen + 1) <= w->idsize)
+		return 1;
+	size = w->idsize ? 2 * w->idsize : 64;
+	x = (struct wheel_id *)alloc(size * sizeof(struct wheel_id));
+	if (!x)
+		return 0;
+	for (i = 0; i < size; i++)
+		x[i].n = 0;
+	for (i = 0; i < w->idsize; i++) {
+		if (!w->ids[i].n)
+			continue;
+		h = (unsigned int)(w->ids[i].id * 2654435761UL) & (size - 1);
+		while (x[h].n)
+			h = (h + 1) & (size - 1);
+		x[h] = w->ids[i];
+	}
+	if (w->ids)
+		alloc_free(w->ids);
+	w->ids = x;
+	w->idsize = size;
+	return 1;
+}
+
+/* needs a successful idready() first */
+static void
+idadd(wheel *w, struct prioq_elt *pe)
+{
+	struct wheel_id *x;
+	unsigned int h;
+
+	if (!(x = idfind(w, pe->id))) {
+		for (h = HASH(w, pe->id); w->ids[h].n;
+		    h = (h + 1) & (w->idsize - 1))
+			;
+		x = &w->ids[h];
+		x->id = pe->id;
+		x->n = 0;
+		++w->idlen;
+	}
+	if (x->n && x->dt != pe->dt) {
+		/* moved, the old entries are stale now */
+		w->len -= x->n;
+		x->n = 0;
+	}
+	x->dt = pe->dt;
+	++x->n;
+	++w->len;
+}
+
+static void
+iddel(wheel *w, struct wheel_id *x)
+{
+	unsigned int i, j, h, mask;
+
+	mask = w->idsize - 1;
+	i = x - w->ids;
+	w->ids[i].n = 0;
+	--w->idlen;
+	/* pull back the entries that can not be found past the hole */
+	for (j = (i + 1) & mask; w->ids[j].n; j = (j + 1) & mask) {
+		h = HASH(w, w->ids[j].id);
+		if (j > i ? (h <= i || h > j) : (h <= i && h > j)) {
+			w->ids[i] = w->ids[j];
+			w->ids[j].n = 0;
+			i = j;
+		}
+	}
+}
+
+static int
+live(wheel *w, struct prioq_elt *pe)
+{
+	struct wheel_id *x;
+
+	x = idfind(w, pe->id);
+	return x && x->dt == pe->dt;
+}
+
+/* a live entry was taken out */
+static void
+used(wheel *w, struct prioq_elt *pe)
+{
+	struct wheel_id *x;
+
+	x = idfind(w, pe->id);
+	if (!x || x->dt != pe->dt)
+		return;
+	--w->len;
+	if (!--x->n)
+		iddel(w, x);
+}
+
+static int
+place(wheel *w, struct prioq_elt *pe)
+{
+	datetime_sec b;
+	unsigned int i;
+
+	b = pe->dt >> WHEEL_BITS;
+	if (pe->dt < 0 || b < w->block)
+		return prioq_insert(&w->early, pe);
+	if (b == w->block) {
+		i = pe->dt & MASK;
+		if (!wheel_slot_append(&w->l0[i], pe))
+			return 0;
+		if (i < w->l0next)
+			w->l0next = i;
+		return 1;
+	}
+	if (SUPER(b) == SUPER(w->block)) {
+		i = b & MASK;
+		if (!wheel_slot_append(&w->l1[i], pe))
+			return 0;
+		if (i < w->l1next)
+			w->l1next = i;
+		return 1;
+	}
+	return wheel_slot_append(&w->far, pe);
+}
+
+int
+wheel_insert(wheel *w, struct prioq_elt *pe)
+{
+	if (!idready(w))
+		return 0;
+	if (!place(w, pe))
+		return 0;
+	idadd(w, pe);
+	return 1;
+}
+
+/*
+ * Move on to the next non-empty block. Entries are moved down a level
+ * only once, so insert and expiry stay O(1) amortized. Stale entries
+ * are dropped on the way. Returns 0 if the wheel is empty.
+ */
+static int
+advance(wheel *w)
+{
+	wheel_slot *s;
+	datetime_sec m;
+	unsigned int i, j;
+
+	while (w->l1next < WHEEL_SIZE && !w->l1[w->l1next].len)
+		++w->l1next;
+	if (w->l1next < WHEEL_SIZE) {
+		w->block = (w->block & ~(datetime_sec)MASK) | w->l1next;
+		w->l0next = 0;
+		s = &w->l1[w->l1next];
+		while (s->len) {
+			if (live(w, &s->p[s->len - 1]) &&
+			    !place(w, &s->p[s->len - 1]))
+				return -1;
+			--s->len;
+		}
+		++w->l1next;
+		return 1;
+	}
+	if (!w->far.len)
+		return 0;
+	m = w->far.p[0].dt;
+	for (i = 1; i < w->far.len; i++)
+		if (w->far.p[i].dt < m)
+			m = w->far.p[i].dt;
+	w->block = m >> WHEEL_BITS;
+	w->l0next = 0;
+	w->l1next = (w->block & MASK) + 1;
+	for (i = j = 0; i < w->far.len; i++) {
+		if (SUPER(w->far.p[i].dt >> WHEEL_BITS) != SUPER(w->block))
+			w->far.p[j++] = w->far.p[i];
+		else if (live(w, &w->far.p[i]) && !place(w, &w->far.p[i])) {
+			while (i < w->far.len)
+				w->far.p[j++] = w->far.p[i++];
+			w->far.len = j;
+			return -1;
+		}
+	}
+	w->far.len = j;
+	return 1;
+}
+
+/*
+ * Returns 1 if the minimum is in early, 2 if in l0[l0next], 0 if none.
+ * Stale entries in front of the minimum are dropped.
+ */
+static int
+find(wheel *w)
+{
+	wheel_slot *s;
+
+	for (;;) {
+		if (w->early.p && w->early.len) {
+			if (live(w, &w->early.p[0]))
+				return 1;
+			prioq_delmin(&w->early);
+			continue;
+		}
+		while (w->l0next < WHEEL_SIZE && !w->l0[w->l0next].len)
+			++w->l0next;
+		if (w->l0next < WHEEL_SIZE) {
+			s = &w->l0[w->l0next];
+			if (live(w, &s->p[s->len - 1]))
+				return 2;
+			--s->len;
+			continue;
+		}
+		if (advance(w) <= 0)
+			return 0;
+	}
+}
+
+int
+wheel_min(wheel *w, struct prioq_elt *pe)
+{
+	wheel_slot *s;
+
+	switch (find(w)) {
+	case 1:
+		return prioq_min(&w->early, pe);
+	case 2:
+		s = &w->l0[w->l0next];
+		*pe = s->p[s->len - 1];
+		return 1;
+	}
+	return 0;
+}
+
+void
+wheel_delmin(wheel *w)
+{
+	struct prioq_elt pe;
+	wheel_slot *s;
+
+	switch (find(w)) {
+	case 1:
+		pe = w->early.p[0];
+		prioq_delmin(&w->early);
+		break;
+	case 2:
+		s = &w->l0[w->l0next];
+		pe = s->p[--s->len];
+		break;
+	default:
+		return;
+	}
+	used(w, &pe);
+}
+
+/*
+ * Make every entry due at dt. All entries end up in the l0 slot of dt,
+ * this is a plain linear move without any reordering.
+ */
+int
+wheel_run(wheel *w, datetime_sec dt)
+{
+	struct wheel_pos pos;
+	struct prioq_elt pe;
+	wheel_slot *s;
+	unsigned int i, j, n;
+
+	i = dt & MASK;
+	s = &w->l0[i];
+	for (j = n = 0; j < s->len; j++)
+		if (live(w, &s->p[j]))
+			s->p[n++] = s->p[j];
+	s->len = n;
+	n = 0;
+	wheel_walkstart(&pos);
+	while (wheel_walk(w, &pos, &pe))
+		if (pos.slot != i + 1)
+			++n;
+	if (!wheel_slot_readyplus(s, n))
+		return 0;
+	wheel_walkstart(&pos);
+	while (wheel_walk(w, &pos, &pe)) {
+		if (pos.slot == i + 1)
+			continue;
+		s->p[s->len++] = pe;
+	}
+	for (j = 0; j < s->len; j++)
+		s->p[j].dt = dt;
+	for (j = 0; j < w->idsize; j++)
+		if (w->ids[j].n)
+			w->ids[j].dt = dt;
+	if (w->early.p)
+		w->early.len = 0;
+	for (pos.slot = 0; pos.slot < WHEEL_SIZE; pos.slot++) {
+		if (pos.slot != i)
+			w->l0[pos.slot].len = 0;
+		w->l1[pos.slot].len = 0;
+	}
+	w->far.len = 0;
+	w->block = dt >> WHEEL_BITS;
+	w->l0next = i;
+	w->l1next = (w->block & MASK) + 1;
+	return 1;
+}
+
+/* look up the due time of id, returns 0 if id is not in the wheel */
+int
+wheel_find(wheel *w, unsigned long id, struct prioq_elt *pe)
+{
+	struct wheel_id *x;
+
+	if (!(x = idfind(w, id)))
+		return 0;
+	pe->id = id;
+	pe->dt = x->dt;
+	return 1;
+}
+
+void
+wheel_walkstart(struct wheel_pos *pos)
+{
+	pos->slot = 0;
+	pos->i = 0;
+}
+
+/*
+ * Return the live entries one after the other in no particular order.
+ * pos->slot is 0 for early, 1 + i for l0[i], 1 + WHEEL_SIZE + i for
+ * l1[i] and 1 + 2 * WHEEL_SIZE for far.
+ */
+int
+wheel_walk(wheel *w, struct wheel_pos *pos, struct prioq_elt *pe)
+{
+	struct prioq_elt *p;
+	unsigned int len;
+
+	for (; pos->slot <= 2 * WHEEL_SIZE + 1; pos->slot++, pos->i = 0) {
+		if (pos->slot == 0) {
+			p = w->early.p;
+			len = p ? w->early.len : 0;
+		} else if (pos->slot <= WHEEL_SIZE) {
+			p = w->l0[pos->slot - 1].p;
+			len = w->l0[pos->slot - 1].len;
+		} else if (pos->slot <= 2 * WHEEL_SIZE) {
+			p = w->l1[pos->slot - 1 - WHEEL_SIZE].p;
+			len = w->l1[pos->slot - 1 - WHEEL_SIZE].len;
+		} else {
+			p = w->far.p;
+			len = w->far.len;
+		}
+		while (pos->i < len) {
+			*pe = p[pos->i++];
+			if (live(w, pe))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+void
+wheel_clear(wheel *w)
+{
+	unsigned int i;
+
+	if (w->early.p)
+		w->early.len = 0;
+	for (i = 0; i < WHEEL_SIZE; i++) {
+		w->l0[i].len = 0;
+		w->l1[i].len = 0;
+	}
+	w->far.len = 0;
+	for (i = 0; i < w->idsize; i++)
+		w->ids[i].n = 0;
+	w->idlen = 0;
+	w->block = 0;
+	w->l0next = 0;
+	w->l1next = 0;
+	w->len = 0;
+}
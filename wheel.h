@@ -0,0 +1,53 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include "datetime.h"
+#include "gen_alloc.h"
+#include "prioq.h"
+
+#define WHEEL_BITS 10
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+
+GEN_ALLOC_typedef(wheel_slot,struct prioq_elt,p,len,a)
+
+struct wheel_id {
+	unsigned long	id;
+	datetime_sec	dt;
+	unsigned int	n;	/* entries due at dt, 0 if unused */
+};
+
+/*
+ * A two level timing wheel keyed on seconds. l0 holds one slot per
+ * second of the current block of WHEEL_SIZE seconds, l1 one slot per
+ * block of the current superblock and far everything after that.
+ * Entries that are due before the current block go into a small heap.
+ * ids is a hash of all ids in the wheel with their due time. Inserting
+ * an id with another due time moves it; the old entry is left where it
+ * is and dropped as stale once it comes up.
+ */
+typedef struct wheel {
+	prioq		early;
+	wheel_slot	l0[WHEEL_SIZE];
+	wheel_slot	l1[WHEEL_SIZE];
+	wheel_slot	far;
+	datetime_sec	block;
+	unsigned int	l0next;
+	unsigned int	l1next;
+	unsigned long	len;
+	struct wheel_id	*ids;
+	unsigned int	idsize;
+	unsigned int	idlen;
+} wheel;
+
+struct wheel_pos { unsigned int slot; unsigned int i; };
+
+extern int wheel_insert(wheel *, struct prioq_elt *);
+extern int wheel_min(wheel *, struct prioq_elt *);
+extern void wheel_delmin(wheel *);
+extern int wheel_run(wheel *, datetime_sec);
+extern int wheel_find(wheel *, unsigned long, struct prioq_elt *);
+extern void wheel_walkstart(struct wheel_pos *);
+extern int wheel_walk(wheel *, struct wheel_pos *, struct prioq_elt *);
+extern void wheel_clear(wheel *);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * wheelbench [messages [wakes]]
+ * Runs the same work through the old prioq and through the timing wheel
+ * of qmail-send: insert the messages with due times spread over two
+ * days, wake some of them early like defer_wake() does and then expire
+ * everything, rescheduling every other message once like a deferral.
+ * Prints the time of each phase and checks that both expire in the
+ * same order.
+ */
+#include <sys/types.h>
+#include <sys/time.h>
+#include "alloc.h"
+#include "bench.h"
+#include "prioq.h"
+#include "scan.h"
+#include "strerr.h"
+#include "wheel.h"
+
+#define FATAL "wheelbench: fatal: "
+
+prioq pq = {0};
+wheel wq;
+unsigned long messages = 100000;
+unsigned long wakes = 1000;
+datetime_sec *order[2];
+unsigned long ordlen[2];
+unsigned int seed;
+
+static unsigned int
+rnd(void)
+{
+	seed = seed * 69069 + 1;
+	return seed >> 8;
+}
+
+static void
+die_nomem(void)
+{
+	strerr_die2x(111, FATAL, "out of memory");
+}
+
+static long
+msecs(struct timeval *t0)
+{
+	struct timeval t1;
+	long ms;
+
+	gettimeofday(&t1, (struct timezone *)0);
+	ms = (t1.tv_sec - t0->tv_sec) * 1000;
+	ms += (t1.tv_usec - t0->tv_usec) / 1000;
+	gettimeofday(t0, (struct timezone *)0);
+	return ms;
+}
+
+static void
+report(const char *name, long ins, long wake, long drain)
+{
+	bench_put(name);
+	bench_put(": insert "); bench_putnum(ins);
+	bench_put(" ms, wake "); bench_putnum(wake);
+	bench_put(" ms, expire "); bench_putnum(drain);
+	bench_put(" ms\n");
+	bench_flush();
+}
+
+static void
+bench_prioq(void)
+{
+	struct timeval t;
+	struct prioq_elt pe;
+	datetime_sec now;
+	long ins, wake;
+	unsigned long u, id;
+	unsigned int i;
+
+	seed = 1;
+	now = 0;
+	gettimeofday(&t, (struct timezone *)0);
+	for (u = 1; u <= messages; u++) {
+		pe.id = u;
+		pe.dt = now + rnd() % 172800;
+		if (!prioq_insert(&pq, &pe)) die_nomem();
+	}
+	ins = msecs(&t);
+	/* without an index the heap has to be searched */
+	for (u = 0; u < wakes; u++) {
+		id = rnd() % messages + 1;
+		for (i = 0; i < pq.len; i++)
+			if (pq.p[i].id == id) {
+				prioq_decrease(&pq, i, now);
+				break;
+			}
+	}
+	wake = msecs(&t);
+	while (prioq_min(&pq, &pe)) {
+		prioq_delmin(&pq);
+		now = pe.dt;
+		order[0][ordlen[0]++] = now;
+		if (ordlen[0] <= messages && rnd() & 1) {
+			pe.dt = now + 300 + rnd() % 3300;
+			if (!prioq_insert(&pq, &pe)) die_nomem();
+		}
+	}
+	report("prioq", ins, wake, msecs(&t));
+}
+
+static void
+bench_wheel(void)
+{
+	struct timeval t;
+	struct prioq_elt pe;
+	datetime_sec now;
+	long ins, wake;
+	unsigned long u;
+
+	seed = 1;
+	now = 0;
+	gettimeofday(&t, (struct timezone *)0);
+	for (u = 1; u <= messages; u++) {
+		pe.id = u;
+		pe.dt = now + rnd() % 172800;
+		if (!wheel_insert(&wq, &pe)) die_nomem();
+	}
+	ins = msecs(&t);
+	for (u = 0; u < wakes; u++)
+		if (wheel_find(&wq, rnd() % messages + 1, &pe))
+			if (pe.dt > now) {
+				pe.dt = now;
+				if (!wheel_insert(&wq, &pe)) die_nomem();
+			}
+	wake = msecs(&t);
+	while (wheel_min(&wq, &pe)) {
+		wheel_delmin(&wq);
+		now = pe.dt;
+		order[1][ordlen[1]++] = now;
+		if (ordlen[1] <= messages && rnd() & 1) {
+			pe.dt = now + 300 + rnd() % 3300;
+			if (!wheel_insert(&wq, &pe)) die_nomem();
+		}
+	}
+	report("wheel", ins, wake, msecs(&t));
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long u;
+
+	if (argc > 1) scan_ulong(argv[1], &messages);
+	if (argc > 2) scan_ulong(argv[2], &wakes);
+	if (!messages)
+		strerr_die1x(100, "wheelbench: usage: wheelbench "
+		    "[messages [wakes]]");
+	for (u = 0; u < 2; u++)
+		if (!(order[u] = (datetime_sec *)alloc(2 * messages *
+		    sizeof(datetime_sec))))
+			die_nomem();
+
+	bench_prioq();
+	bench_wheel();
+
+	if (ordlen[0] != ordlen[1])
+		strerr_die2x(111, FATAL, "different number of expiries");
+	for (u = 0; u < ordlen[0]; u++)
+		if (order[0][u] != order[1][u])
+			strerr_die2x(111, FATAL, "expiry order differs");
+	bench_put("expired "); bench_putnum(ordlen[0]);
+	bench_put(" entries in the same order\n");
+	bench_flush();
+	return 0;
+}